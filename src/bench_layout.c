@@ -0,0 +1,184 @@
+/**
+ * @filename   bench_layout.c
+ *   benchmark of false sharing between worker contexts and of
+ *   task_arg alignment in queue slots.
+ *
+ *   $ make bench && ./bench_layout [threads] [iterations]
+ *
+ * @create     2019-11-20
+ */
+#include "timeut.h"
+#include "misc.h"
+
+#include "threadpool.h"
+
+#define BENCH_THREADS_MAX   64
+#define BENCH_TASKS         200000
+#define BENCH_PAYLOAD       256
+
+
+/* thread_context_t as it was before it was padded to cache lines */
+typedef struct {
+    int id;
+    void *pool;
+    pthread_t thread;
+    void *thread_arg;
+
+    struct threadpool_task_t *task;
+} packed_context_t;
+
+
+typedef struct {
+    void *ctx;          /* packed_context_t * or thread_context_t * */
+    int packed;
+    long iterations;
+    volatile int *go;
+} bench_worker_t;
+
+
+static packed_context_t packed_ctxs[BENCH_THREADS_MAX];
+static thread_context_t padded_ctxs[BENCH_THREADS_MAX];
+
+
+static ub8 now_nsec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ub8) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+/* what a worker does to its own context for every task */
+static void * bench_ctx_writer (void *arg)
+{
+    long i;
+    bench_worker_t *bw = (bench_worker_t *) arg;
+
+    while (!*bw->go) {
+        sched_yield();
+    }
+
+    if (bw->packed) {
+        packed_context_t *ctx = (packed_context_t *) bw->ctx;
+        for (i = 0; i < bw->iterations; i++) {
+            ctx->task = (threadpool_task_t *) (uintptr_t) i;
+            __asm__ __volatile__ ("" ::: "memory");
+        }
+    } else {
+        thread_context_t *ctx = (thread_context_t *) bw->ctx;
+        for (i = 0; i < bw->iterations; i++) {
+            ctx->task = (threadpool_task_t *) (uintptr_t) i;
+            __asm__ __volatile__ ("" ::: "memory");
+        }
+    }
+
+    return 0;
+}
+
+
+static double bench_contexts (int threads, long iterations, int packed)
+{
+    int i;
+    ub8 t0;
+    volatile int go = 0;
+    pthread_t tids[BENCH_THREADS_MAX];
+    bench_worker_t bws[BENCH_THREADS_MAX];
+
+    for (i = 0; i < threads; i++) {
+        bws[i].ctx = packed? (void *) &packed_ctxs[i] : (void *) &padded_ctxs[i];
+        bws[i].packed = packed;
+        bws[i].iterations = iterations;
+        bws[i].go = &go;
+        pthread_create(&tids[i], NULL, bench_ctx_writer, &bws[i]);
+    }
+
+    t0 = now_nsec();
+    go = 1;
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    return (double) (now_nsec() - t0) / iterations;
+}
+
+
+static volatile long tasks_done = 0;
+
+static void bench_task (thread_context_t *thread_ctx)
+{
+    int i;
+    ub8 sum = 0;
+    const ub8 *payload = (const ub8 *) thread_ctx->task->task_arg;
+
+    for (i = 0; i < (int) (thread_ctx->task->arg_size / sizeof(ub8)); i++) {
+        sum += payload[i];
+    }
+
+    thread_ctx->task->flags = sum;
+
+    __sync_add_and_fetch(&tasks_done, 1);
+}
+
+
+static double bench_pool (int threads, int task_arg_align)
+{
+    int i;
+    ub8 t0;
+    ub8 payload[BENCH_PAYLOAD / sizeof(ub8)];
+    threadpool_opts_t opts = {0};
+    threadpool_t *pool;
+
+    opts.queue_mode = THREADPOOL_QUEUE_LOCKFREE;
+    opts.inplace = 1;
+    opts.task_arg_align = task_arg_align;
+
+    pool = threadpool_create_ex(threads, 1024, 0, 0, NULL, BENCH_PAYLOAD + 8, &opts);
+    if (!pool) {
+        printf("[bench] threadpool_create_ex failed !\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(payload, 1, sizeof(payload));
+    tasks_done = 0;
+
+    t0 = now_nsec();
+
+    for (i = 0; i < BENCH_TASKS; i++) {
+        while (threadpool_add(pool, bench_task, NULL, payload, sizeof(payload), 0) == threadpool_queue_full) {
+            sched_yield();
+        }
+    }
+
+    while (tasks_done < BENCH_TASKS) {
+        sched_yield();
+    }
+
+    t0 = now_nsec() - t0;
+
+    threadpool_destroy(pool);
+
+    return (double) t0 / BENCH_TASKS;
+}
+
+
+int main (int argc, char *argv[])
+{
+    int threads = (argc > 1)? atoi(argv[1]) : 4;
+    long iterations = (argc > 2)? atol(argv[2]) : 50000000L;
+
+    if (threads < 1 || threads > BENCH_THREADS_MAX) {
+        printf("[bench] threads must be 1..%d\n", BENCH_THREADS_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("[bench] %d threads, %ld writes each to own context\n", threads, iterations);
+    printf("  packed contexts (%d bytes): %.2f ns/write\n", (int) sizeof(packed_context_t), bench_contexts(threads, iterations, 1));
+    printf("  padded contexts (%d bytes): %.2f ns/write\n", (int) sizeof(thread_context_t), bench_contexts(threads, iterations, 0));
+
+    printf("[bench] %d workers, %d inplace tasks summing %d bytes task_arg\n", threads, BENCH_TASKS, BENCH_PAYLOAD);
+    printf("  task_arg_align=8  : %.1f ns/task\n", bench_pool(threads, 0));
+    printf("  task_arg_align=%d : %.1f ns/task\n", POOL_CACHELINE_SIZE, bench_pool(threads, POOL_CACHELINE_SIZE));
+
+    return 0;
+}
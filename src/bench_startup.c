@@ -0,0 +1,81 @@
+/**
+ * @filename   bench_startup.c
+ *   benchmark of threadpool_create and threadpool_destroy time for pools
+ *   of 1 to max threads, by startup mode.
+ *
+ *   $ make bench && ./bench_startup [max_threads] [affinity_cpus]
+ *
+ * @create     2019-11-28
+ */
+#include "timeut.h"
+#include "misc.h"
+
+#include "threadpool.h"
+
+
+static ub8 now_nsec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ub8) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+static const char *startup_names[] = {
+    "eager",
+    "parallel",
+    "lazy"
+};
+
+
+static void bench_startup (int threads, int affinity_cpus, int startup)
+{
+    ub8 t0, t1, t2;
+    int running;
+    threadpool_opts_t opts = {0};
+    threadpool_t *pool;
+
+    opts.startup = startup;
+
+    t0 = now_nsec();
+
+    pool = threadpool_create_ex(threads, 1024, 0, affinity_cpus, NULL, 0, &opts);
+    if (!pool) {
+        printf("  %-8s %6d threads: threadpool_create_ex failed\n", startup_names[startup], threads);
+        return;
+    }
+
+    t1 = now_nsec();
+
+    running = threadpool_get_threads_count(pool);
+
+    threadpool_destroy(pool);
+
+    t2 = now_nsec();
+
+    printf("  %-8s %6d threads: create %9.3f ms (%d running), destroy %9.3f ms\n",
+        startup_names[startup], threads, (double) (t1 - t0) / 1000000, running, (double) (t2 - t1) / 1000000);
+}
+
+
+int main (int argc, char *argv[])
+{
+    int threads, startup;
+    int max_threads = (argc > 1)? atoi(argv[1]) : POOL_MAX_THREADS;
+    int affinity_cpus = (argc > 2)? atoi(argv[2]) : 0;
+
+    if (max_threads < 1 || max_threads > POOL_MAX_THREADS) {
+        printf("[bench] max_threads must be 1..%d\n", POOL_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("[bench] startup of 1 to %d threads, affinity_cpus=%d\n", max_threads, affinity_cpus);
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        for (startup = THREADPOOL_STARTUP_EAGER; startup <= THREADPOOL_STARTUP_LAZY; startup++) {
+            bench_startup(threads, affinity_cpus, startup);
+        }
+    }
+
+    return 0;
+}
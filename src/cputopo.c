@@ -0,0 +1,625 @@
+/**
+ * @file cputopo.c
+ * @brief cpu and numa topology of linux
+ *
+ * @create: 2019-11-20
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cputopo.h"
+
+#if defined(__linux__)
+
+#include <dirent.h>
+
+
+int cputopo_parse_cpulist (const char *cpulist, cpu_set_t *cpus)
+{
+    int count = 0;
+    long first, last, cpu;
+    char *end;
+    const char *p = cpulist;
+
+    CPU_ZERO(cpus);
+
+    while (*p && *p != '\n') {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        last = first;
+
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, cpus)) {
+                CPU_SET(cpu, cpus);
+                count++;
+            }
+        }
+
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+
+int cputopo_read_cpulist (const char *path, cpu_set_t *cpus)
+{
+    char buf[4096];
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    if (!fgets(buf, sizeof(buf), fp)) {
+        fclose(fp);
+        CPU_ZERO(cpus);
+        /* empty file: no cpu */
+        return 0;
+    }
+
+    fclose(fp);
+    return cputopo_parse_cpulist(buf, cpus);
+}
+
+
+static int cputopo_node_cmp (const void *a, const void *b)
+{
+    return ((const cputopo_node_t *) a)->node_id - ((const cputopo_node_t *) b)->node_id;
+}
+
+
+int cputopo_numa_nodes (cputopo_node_t *nodes, int maxnodes)
+{
+    int num = 0;
+    char path[256];
+    struct dirent *ent;
+    cpu_set_t online;
+
+    DIR *dir = opendir(CPUTOPO_SYSFS_NODE);
+    if (!dir) {
+        return 0;
+    }
+
+    if (cputopo_read_cpulist(CPUTOPO_SYSFS_CPU "/online", &online) < 0) {
+        closedir(dir);
+        return 0;
+    }
+
+    while (num < maxnodes && (ent = readdir(dir)) != NULL) {
+        char *end;
+        long id;
+        cputopo_node_t *node = &nodes[num];
+
+        if (strncmp(ent->d_name, "node", 4)) {
+            continue;
+        }
+
+        id = strtol(ent->d_name + 4, &end, 10);
+        if (end == ent->d_name + 4 || *end) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_NODE "/node%ld/cpulist", id);
+
+        if (cputopo_read_cpulist(path, &node->cpus) <= 0) {
+            /* memory only node */
+            continue;
+        }
+
+        CPU_AND(&node->cpus, &node->cpus, &online);
+
+        node->cpu_count = CPU_COUNT(&node->cpus);
+        if (node->cpu_count > 0) {
+            node->node_id = (int) id;
+            num++;
+        }
+    }
+
+    closedir(dir);
+
+    qsort(nodes, num, sizeof(cputopo_node_t), cputopo_node_cmp);
+
+    return num;
+}
+
+
+int cputopo_allowed_cpus (cpu_set_t *cpus)
+{
+    cpu_set_t online;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), cpus) != 0) {
+        CPU_ZERO(cpus);
+        return 0;
+    }
+
+    if (cputopo_read_cpulist(CPUTOPO_SYSFS_CPU "/online", &online) > 0) {
+        CPU_AND(cpus, cpus, &online);
+    }
+
+    return CPU_COUNT(cpus);
+}
+
+
+/* read one integer from sysfs file, returns dflt on error */
+static int cputopo_read_int (const char *path, int dflt)
+{
+    int val;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return dflt;
+    }
+
+    if (fscanf(fp, "%d", &val) != 1) {
+        val = dflt;
+    }
+
+    fclose(fp);
+    return val;
+}
+
+
+/* whether comma separated list has item */
+static int cputopo_list_has (const char *list, const char *item)
+{
+    size_t len = strlen(item);
+    const char *p = list;
+
+    while (p && *p) {
+        if (!strncmp(p, item, len) && (p[len] == ',' || p[len] == 0)) {
+            return 1;
+        }
+
+        p = strchr(p, ',');
+        if (p) {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * cputopo_cgroup_dir
+ *   directory of cgroup of process in hierarchy which has cpu controller:
+ *   cgroup2 (v2 = 1) or cgroup "cpu" (v2 = 0). mount point goes to mnt.
+ *   returns 0 on success.
+ */
+static int cputopo_cgroup_dir (int v2, char *mnt, char *dir, size_t size)
+{
+    char line[1024], root[512], path[512];
+    char mntpoint[512], fstype[64], superopts[256];
+    int found = 0;
+    FILE *fp;
+
+    /* mount of hierarchy: "id parent major:minor root mountpoint opts... - fstype source superopts" */
+    fp = fopen(CPUTOPO_PROC_MOUNTINFO, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char *sep = strstr(line, " - ");
+
+        if (!sep ||
+            sscanf(line, "%*s %*s %*s %511s %511s", root, mntpoint) != 2 ||
+            sscanf(sep + 3, "%63s %*s %255s", fstype, superopts) != 2) {
+            continue;
+        }
+
+        if (v2) {
+            found = !strcmp(fstype, "cgroup2");
+        } else {
+            found = !strcmp(fstype, "cgroup") && cputopo_list_has(superopts, "cpu");
+        }
+    }
+
+    fclose(fp);
+
+    if (!found) {
+        return -1;
+    }
+
+    /* cgroup of process: "id:controllers:path", v2 is "0::path" */
+    fp = fopen(CPUTOPO_PROC_CGROUP, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    found = 0;
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char *ctrls = strchr(line, ':');
+        char *cgpath = ctrls? strchr(ctrls + 1, ':') : NULL;
+
+        if (!cgpath) {
+            continue;
+        }
+
+        *cgpath++ = 0;
+        *ctrls++ = 0;
+
+        if (v2) {
+            found = !strcmp(line, "0") && !*ctrls;
+        } else {
+            found = cputopo_list_has(ctrls, "cpu");
+        }
+
+        if (found) {
+            cgpath[strcspn(cgpath, "\n")] = 0;
+            snprintf(path, sizeof(path), "%s", cgpath);
+        }
+    }
+
+    fclose(fp);
+
+    if (!found) {
+        return -1;
+    }
+
+    /* path is relative to root of mount (cgroup namespace, container) */
+    if (strcmp(root, "/") && !strncmp(path, root, strlen(root))) {
+        memmove(path, path + strlen(root), strlen(path + strlen(root)) + 1);
+    }
+
+    snprintf(mnt, size, "%s", mntpoint);
+    snprintf(dir, size, "%s%s", mntpoint, path);
+    return 0;
+}
+
+
+int cputopo_parse_quota (const char *quota, const char *period)
+{
+    long q = -1, p = 0;
+    char max[32];
+
+    if (!period) {
+        /* v2 cpu.max: "$MAX $PERIOD", $MAX is "max" if not limited */
+        if (sscanf(quota, "%31s %ld", max, &p) != 2 || !strcmp(max, "max")) {
+            return 0;
+        }
+        q = strtol(max, NULL, 10);
+    } else if (sscanf(quota, "%ld", &q) != 1 || sscanf(period, "%ld", &p) != 1) {
+        return 0;
+    }
+
+    if (q <= 0 || p <= 0) {
+        return 0;
+    }
+
+    return (int) ((q + p - 1) / p);
+}
+
+
+/* first line of file into buf, 0 on success */
+static int cputopo_read_line (const char *path, char *buf, int size)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    if (!fgets(buf, size, fp)) {
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+
+/* cpus of cfs quota in dir, 0 if not limited */
+static int cputopo_dir_quota (int v2, const char *dir)
+{
+    char path[1024 + 32], quota[64], period[64];
+
+    if (v2) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if (cputopo_read_line(path, quota, sizeof(quota)) != 0) {
+            return 0;
+        }
+        return cputopo_parse_quota(quota, NULL);
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+    if (cputopo_read_line(path, quota, sizeof(quota)) != 0) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+    if (cputopo_read_line(path, period, sizeof(period)) != 0) {
+        return 0;
+    }
+
+    return cputopo_parse_quota(quota, period);
+}
+
+
+int cputopo_cpu_quota (void)
+{
+    int v2, quota, cpus = 0;
+    char mnt[1024], dir[1024];
+
+    for (v2 = 1; v2 >= 0; v2--) {
+        if (cputopo_cgroup_dir(v2, mnt, dir, sizeof(dir)) != 0) {
+            continue;
+        }
+
+        /* limits of ancestors apply too */
+        for (;;) {
+            char *slash;
+
+            quota = cputopo_dir_quota(v2, dir);
+            if (quota > 0 && (cpus == 0 || quota < cpus)) {
+                cpus = quota;
+            }
+
+            if (strlen(dir) <= strlen(mnt)) {
+                break;
+            }
+
+            slash = strrchr(dir, '/');
+            if (!slash || slash < dir + strlen(mnt)) {
+                break;
+            }
+            *slash = 0;
+        }
+    }
+
+    return cpus;
+}
+
+
+int cputopo_effective_cpus (void)
+{
+    cpu_set_t allowed;
+    int cpus = cputopo_allowed_cpus(&allowed);
+    int quota = cputopo_cpu_quota();
+
+    if (quota > 0 && (cpus == 0 || quota < cpus)) {
+        cpus = quota;
+    }
+
+    return cpus;
+}
+
+
+/* lowest cpu id in cpus, -1 if empty */
+static int cputopo_first_cpu (const cpu_set_t *cpus)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus)) {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+
+/* domain of last level data or unified cache of cpu, -1 if unknown */
+static int cputopo_read_llc (int cpu_id)
+{
+    int index, level, llc = -1, llc_level = 0;
+    char path[256], type[32];
+    cpu_set_t shared;
+
+    for (index = 0; ; index++) {
+        FILE *fp;
+
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/cache/index%d/level", cpu_id, index);
+        level = cputopo_read_int(path, -1);
+        if (level < 0) {
+            break;
+        }
+
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/cache/index%d/type", cpu_id, index);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        if (fscanf(fp, "%31s", type) != 1) {
+            type[0] = 0;
+        }
+        fclose(fp);
+
+        if (!strcmp(type, "Instruction") || level <= llc_level) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu_id, index);
+        if (cputopo_read_cpulist(path, &shared) > 0) {
+            llc = cputopo_first_cpu(&shared);
+            llc_level = level;
+        }
+    }
+
+    return llc;
+}
+
+
+static int cputopo_cpu_cmp (const void *a, const void *b)
+{
+    const cputopo_cpu_t *x = (const cputopo_cpu_t *) a;
+    const cputopo_cpu_t *y = (const cputopo_cpu_t *) b;
+
+    if (x->llc != y->llc) {
+        return x->llc - y->llc;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    return x->smt - y->smt;
+}
+
+
+int cputopo_cpus (cputopo_cpu_t *cpus, int maxcpus)
+{
+    int cpu, sib, num = 0;
+    char path[256];
+    cpu_set_t allowed, siblings;
+
+    if (cputopo_allowed_cpus(&allowed) <= 0) {
+        return 0;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE && num < maxcpus; cpu++) {
+        cputopo_cpu_t *c = &cpus[num];
+
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        c->cpu_id = cpu;
+
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+        c->package_id = cputopo_read_int(path, 0);
+
+        /* siblings may be offline or not allowed, index counts them all
+           so that smt 0 is the same hardware thread for every process */
+        snprintf(path, sizeof(path), CPUTOPO_SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+        if (cputopo_read_cpulist(path, &siblings) > 0) {
+            c->core = cputopo_first_cpu(&siblings);
+            for (c->smt = 0, sib = c->core; sib < cpu; sib++) {
+                if (CPU_ISSET(sib, &siblings)) {
+                    c->smt++;
+                }
+            }
+        } else {
+            c->core = cpu;
+            c->smt = 0;
+        }
+
+        c->llc = cputopo_read_llc(cpu);
+        if (c->llc < 0) {
+            c->llc = c->package_id;
+        }
+
+        num++;
+    }
+
+    qsort(cpus, num, sizeof(cputopo_cpu_t), cputopo_cpu_cmp);
+
+    return num;
+}
+
+
+int cputopo_place (const cputopo_cpu_t *cpus, int num, int policy, int index, const cpu_set_t *within, cpu_set_t *cpuset)
+{
+    int i, n = 0, ncores = 0, ndomains = 0, d, k;
+    int idx[CPU_SETSIZE];
+
+    CPU_ZERO(cpuset);
+
+    /* cpus to place on, keeping order of cpus */
+    for (i = 0; i < num && n < CPU_SETSIZE; i++) {
+        if (!within || CPU_ISSET(cpus[i].cpu_id, within)) {
+            idx[n++] = i;
+        }
+    }
+
+    if (n == 0 || index < 0) {
+        return 0;
+    }
+
+    /* first thread of a core comes first among its siblings in order.
+       a core whose first thread is not allowed counts from its lowest
+       allowed sibling */
+    for (i = 0; i < n; i++) {
+        if (i == 0 || cpus[idx[i]].core != cpus[idx[i - 1]].core) {
+            ncores++;
+        }
+        if (i == 0 || cpus[idx[i]].llc != cpus[idx[i - 1]].llc) {
+            ndomains++;
+        }
+    }
+
+    switch (policy) {
+    case CPUTOPO_PLACE_CORE:
+    case CPUTOPO_PLACE_NOSMT:
+        k = index % ncores;
+
+        for (i = 0; i < n; i++) {
+            if (i > 0 && cpus[idx[i]].core != cpus[idx[i - 1]].core) {
+                k--;
+            }
+
+            if (k == 0) {
+                CPU_SET(cpus[idx[i]].cpu_id, cpuset);
+
+                if (policy == CPUTOPO_PLACE_NOSMT) {
+                    break;
+                }
+            } else if (k < 0) {
+                break;
+            }
+        }
+        break;
+
+    case CPUTOPO_PLACE_COMPACT:
+        CPU_SET(cpus[idx[index % n]].cpu_id, cpuset);
+        break;
+
+    case CPUTOPO_PLACE_SPREAD:
+        d = index % ndomains;
+        k = index / ndomains;
+
+        do {
+            /* cpus of d-th domain */
+            int first = 0, last, smt, size;
+
+            for (i = 1; i < n && d > 0; i++) {
+                if (cpus[idx[i]].llc != cpus[idx[i - 1]].llc) {
+                    d--;
+                    first = i;
+                }
+            }
+            for (last = first + 1; last < n && cpus[idx[last]].llc == cpus[idx[first]].llc; last++) {
+                /* nothing */
+            }
+
+            size = last - first;
+            k %= size;
+
+            /* k-th cpu of domain ordered by (smt, core) */
+            for (smt = 0; ; smt++) {
+                for (i = first; i < last; i++) {
+                    if (cpus[idx[i]].smt == smt && k-- == 0) {
+                        CPU_SET(cpus[idx[i]].cpu_id, cpuset);
+                        return 1;
+                    }
+                }
+            }
+        } while(0);
+        break;
+    }
+
+    return CPU_COUNT(cpuset);
+}
+
+#endif /* __linux__ */
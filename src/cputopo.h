@@ -0,0 +1,172 @@
+/**
+ * cputopo.h
+ *   cpu and numa topology of linux from /sys/devices/system
+ *
+ * @create: 2019-11-20
+ */
+
+#ifndef _CPUTOPO_H_
+#define _CPUTOPO_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#ifndef __USE_GNU
+#  define __USE_GNU
+#endif
+
+#include "unitypes.h"
+
+#include <sched.h>
+
+#if defined(__linux__)
+
+#ifndef CPUTOPO_NODES_MAX
+#  define CPUTOPO_NODES_MAX    64
+#endif
+
+#define CPUTOPO_SYSFS_NODE     "/sys/devices/system/node"
+#define CPUTOPO_SYSFS_CPU      "/sys/devices/system/cpu"
+
+#define CPUTOPO_PROC_CGROUP    "/proc/self/cgroup"
+#define CPUTOPO_PROC_MOUNTINFO "/proc/self/mountinfo"
+
+
+/**
+ * @struct cputopo_node_t
+ * @brief one numa node
+ *
+ * @var node_id   id of node N in /sys/devices/system/node/nodeN
+ * @var cpu_count number of cpus in cpus
+ * @var cpus      online cpus of node
+ */
+typedef struct cputopo_node_t
+{
+    int node_id;
+    int cpu_count;
+    cpu_set_t cpus;
+} cputopo_node_t;
+
+
+/**
+ * @struct cputopo_cpu_t
+ * @brief one cpu (hardware thread) usable by process
+ *
+ * @var cpu_id     id of cpu N in /sys/devices/system/cpu/cpuN
+ * @var package_id physical package (socket) of cpu
+ * @var core       physical core of cpu: lowest cpu id of its smt siblings
+ * @var smt        index of cpu among its smt siblings, 0 for first thread
+ * @var llc        last level cache domain of cpu (L3, or CCX on AMD): lowest
+ *                 cpu id sharing it. package_id if cache is unknown.
+ */
+typedef struct cputopo_cpu_t
+{
+    int cpu_id;
+    int package_id;
+    int core;
+    int smt;
+    int llc;
+} cputopo_cpu_t;
+
+
+/**
+ * placement policies of cputopo_place.
+ *   same values as THREADPOOL_AFFINITY_* in threadpool.h
+ *
+ * CPUTOPO_PLACE_CORE    i-th thread on all smt siblings of i-th physical core
+ * CPUTOPO_PLACE_COMPACT i-th thread on i-th cpu, filling smt siblings and
+ *                       then cores of one llc domain before next domain
+ * CPUTOPO_PLACE_SPREAD  i-th thread on one cpu of (i % domains)-th llc
+ *                       domain, first threads of cores before siblings
+ * CPUTOPO_PLACE_NOSMT   i-th thread on first smt thread of i-th physical
+ *                       core, siblings are left idle
+ */
+#define CPUTOPO_PLACE_CORE     1
+#define CPUTOPO_PLACE_COMPACT  2
+#define CPUTOPO_PLACE_SPREAD   3
+#define CPUTOPO_PLACE_NOSMT    4
+
+
+/**
+ * cputopo_parse_cpulist
+ *   parse a cpu list like "0-3,8,10-11" into cpus.
+ *   returns number of cpus in list, -1 if list is malformed.
+ */
+extern int cputopo_parse_cpulist (const char *cpulist, cpu_set_t *cpus);
+
+
+/**
+ * cputopo_read_cpulist
+ *   read and parse a cpu list file from sysfs.
+ *   returns number of cpus in list, -1 on error.
+ */
+extern int cputopo_read_cpulist (const char *path, cpu_set_t *cpus);
+
+
+/**
+ * cputopo_numa_nodes
+ *   read numa nodes having online cpus, ordered by node id.
+ *   returns number of nodes, 0 if numa topology is not available.
+ */
+extern int cputopo_numa_nodes (cputopo_node_t *nodes, int maxnodes);
+
+
+/**
+ * cputopo_allowed_cpus
+ *   cpus process may run on: online cpus in its inherited affinity mask
+ *   (taskset, cgroup cpuset). returns number of cpus.
+ */
+extern int cputopo_allowed_cpus (cpu_set_t *cpus);
+
+
+/**
+ * cputopo_parse_quota
+ *   cpus granted by a cfs bandwidth limit given as text of cgroup files:
+ *   v2 cpu.max ("50000 100000", "max 100000") with period NULL, or v1
+ *   cpu.cfs_quota_us ("-1" if not limited) and cpu.cfs_period_us.
+ *   returns cpus rounded up, 0 if not limited or malformed.
+ */
+extern int cputopo_parse_quota (const char *quota, const char *period);
+
+
+/**
+ * cputopo_cpu_quota
+ *   cpus granted by cfs bandwidth limit of cgroup of process and of its
+ *   ancestors: cgroup v2 cpu.max or cgroup v1 cpu.cfs_quota_us, rounded
+ *   up. returns 0 if cpu time is not limited.
+ */
+extern int cputopo_cpu_quota (void);
+
+
+/**
+ * cputopo_effective_cpus
+ *   cpus process can keep busy: cputopo_allowed_cpus limited by
+ *   cputopo_cpu_quota. returns 0 if unknown.
+ */
+extern int cputopo_effective_cpus (void);
+
+
+/**
+ * cputopo_cpus
+ *   read topology of cpus process may run on from sysfs, ordered by llc
+ *   domain, core and smt index. returns number of cpus, 0 on error.
+ */
+extern int cputopo_cpus (cputopo_cpu_t *cpus, int maxcpus);
+
+
+/**
+ * cputopo_place
+ *   cpus for index-th thread by policy among cpus (from cputopo_cpus)
+ *   which are also in within (NULL for all). returns number of cpus set
+ *   in cpuset, 0 if none or policy is unknown.
+ */
+extern int cputopo_place (const cputopo_cpu_t *cpus, int num, int policy, int index, const cpu_set_t *within, cpu_set_t *cpuset);
+
+#endif /* __linux__ */
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _CPUTOPO_H_ */
@@ -0,0 +1,183 @@
+/**
+ * @filename   test_cputopo.c
+ *   table-driven tests of the functions of cputopo that do not read
+ *   sysfs or /proc. exits with 1 at the first failed check.
+ *
+ *   $ make check
+ *
+ * @create     2019-12-02
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cputopo.h"
+
+
+#define test_check(cond)  do { \
+        if (!(cond)) { \
+            printf("[test] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+
+/* cpus 0..63 of set as bit mask */
+static ub8 cpus_mask (const cpu_set_t *cpus)
+{
+    int cpu;
+    ub8 mask = 0;
+
+    for (cpu = 0; cpu < 64; cpu++) {
+        if (CPU_ISSET(cpu, cpus)) {
+            mask |= (ub8) 1 << cpu;
+        }
+    }
+    return mask;
+}
+
+
+static void test_cpulist (void)
+{
+    static const struct {
+        const char *list;
+        int count;
+        ub8 mask;
+    } cases[] = {
+        { "0",             1, 0x1 },
+        { "0-3,8,10-11",   7, 0xd0f },
+        { "5\n",           1, 0x20 },
+        { "",              0, 0 },
+        { "\n",            0, 0 },
+        { "0-3,2-5",       6, 0x3f },
+        { "63",            1, (ub8) 1 << 63 },
+        { "1,4096",        1, 0x2 },
+        { "3-1",          -1, 0 },
+        { "a",            -1, 0 },
+        { "1,,2",         -1, 0 },
+        { "-1",           -1, 0 },
+        { "1-",           -1, 0 },
+        { "7 ",           -1, 0 },
+    };
+    int i, count;
+    cpu_set_t cpus;
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        count = cputopo_parse_cpulist(cases[i].list, &cpus);
+
+        test_check(count == cases[i].count);
+        if (count >= 0) {
+            test_check(cpus_mask(&cpus) == cases[i].mask);
+        }
+    }
+
+    printf("[test] cpulist: ok\n");
+}
+
+
+/* 2 llc domains of 2 cores of 2 smt threads, in order of cputopo_cpus:
+   siblings are n and n + 4 */
+static const cputopo_cpu_t test_topo[] = {
+    { 0, 0, 0, 0, 0 }, { 4, 0, 0, 1, 0 }, { 1, 0, 1, 0, 0 }, { 5, 0, 1, 1, 0 },
+    { 2, 0, 2, 0, 2 }, { 6, 0, 2, 1, 2 }, { 3, 0, 3, 0, 2 }, { 7, 0, 3, 1, 2 },
+};
+
+
+static void test_place (void)
+{
+    static const struct {
+        int policy;
+        int index;
+        ub8 within;  /* 0 for all */
+        ub8 mask;
+    } cases[] = {
+        { CPUTOPO_PLACE_CORE,    0, 0, 0x11 },
+        { CPUTOPO_PLACE_CORE,    1, 0, 0x22 },
+        { CPUTOPO_PLACE_CORE,    3, 0, 0x88 },
+        { CPUTOPO_PLACE_CORE,    4, 0, 0x11 },
+        { CPUTOPO_PLACE_NOSMT,   0, 0, 0x01 },
+        { CPUTOPO_PLACE_NOSMT,   2, 0, 0x04 },
+        { CPUTOPO_PLACE_NOSMT,   5, 0, 0x02 },
+        { CPUTOPO_PLACE_COMPACT, 0, 0, 0x01 },
+        { CPUTOPO_PLACE_COMPACT, 1, 0, 0x10 },
+        { CPUTOPO_PLACE_COMPACT, 2, 0, 0x02 },
+        { CPUTOPO_PLACE_COMPACT, 4, 0, 0x04 },
+        { CPUTOPO_PLACE_COMPACT, 9, 0, 0x10 },
+        { CPUTOPO_PLACE_SPREAD,  0, 0, 0x01 },
+        { CPUTOPO_PLACE_SPREAD,  1, 0, 0x04 },
+        { CPUTOPO_PLACE_SPREAD,  2, 0, 0x02 },
+        { CPUTOPO_PLACE_SPREAD,  3, 0, 0x08 },
+        { CPUTOPO_PLACE_SPREAD,  4, 0, 0x10 },
+        { CPUTOPO_PLACE_SPREAD,  7, 0, 0x80 },
+        { CPUTOPO_PLACE_SPREAD,  8, 0, 0x01 },
+        /* cpu 0 not allowed: its core counts from sibling 4 */
+        { CPUTOPO_PLACE_CORE,    0, 0xfe, 0x10 },
+        { CPUTOPO_PLACE_NOSMT,   0, 0xfe, 0x10 },
+        { CPUTOPO_PLACE_COMPACT, 0, 0xfe, 0x10 },
+        /* one domain left */
+        { CPUTOPO_PLACE_SPREAD,  1, 0xcc, 0x08 },
+        { CPUTOPO_PLACE_SPREAD,  2, 0xcc, 0x40 },
+        /* nothing to place on, unknown policy */
+        { CPUTOPO_PLACE_CORE,    0, (ub8) 1 << 40, 0 },
+        { 0,                     0, 0, 0 },
+    };
+    int i, j, count;
+    cpu_set_t within, cpuset;
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        CPU_ZERO(&within);
+        for (j = 0; j < 64; j++) {
+            if (cases[i].within & ((ub8) 1 << j)) {
+                CPU_SET(j, &within);
+            }
+        }
+
+        count = cputopo_place(test_topo, 8, cases[i].policy, cases[i].index, cases[i].within? &within : NULL, &cpuset);
+
+        test_check(cpus_mask(&cpuset) == cases[i].mask);
+        test_check(count == CPU_COUNT(&cpuset));
+    }
+
+    printf("[test] place: ok\n");
+}
+
+
+static void test_quota (void)
+{
+    static const struct {
+        const char *quota;
+        const char *period;  /* NULL for cgroup v2 cpu.max */
+        int cpus;
+    } cases[] = {
+        { "max 100000\n",    NULL,        0 },
+        { "50000 100000\n",  NULL,        1 },
+        { "150000 100000\n", NULL,        2 },
+        { "200000 100000",   NULL,        2 },
+        { "200000",          NULL,        0 },
+        { "",                NULL,        0 },
+        { "0 100000",        NULL,        0 },
+        { "-1\n",            "100000\n",  0 },
+        { "250000\n",        "100000\n",  3 },
+        { "100000",          "100000",    1 },
+        { "100000",          "0",         0 },
+        { "x",               "100000",    0 },
+        { "100000",          "",          0 },
+    };
+    int i;
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        test_check(cputopo_parse_quota(cases[i].quota, cases[i].period) == cases[i].cpus);
+    }
+
+    printf("[test] quota: ok\n");
+}
+
+
+int main (int argc, char *argv[])
+{
+    test_cpulist();
+    test_place();
+    test_quota();
+
+    printf("[test] all passed\n");
+    return 0;
+}
@@ -0,0 +1,1310 @@
+/**
+ * @filename   test_threadpool.c
+ *   behaviour tests of threadpool, one test_* per feature. exits with 1
+ *   at the first failed check.
+ *
+ *   $ make check
+ *   $ make check-asan
+ *   $ make check-tsan
+ *
+ * @create     2019-12-02
+ */
+#include "timeut.h"
+#include "misc.h"
+
+#include "threadpool.h"
+
+
+#define TEST_TASKS      20000
+#define TEST_KEYS       16
+#define TEST_WAIT_MSEC  20000
+
+
+#define test_check(cond)  do { \
+        if (!(cond)) { \
+            printf("[test] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while(0)
+
+
+static volatile sb8 test_done;
+
+
+/* wait till test_done reaches n, 0 if in time */
+static int wait_done (sb8 n)
+{
+    int msec;
+
+    for (msec = 0; msec < TEST_WAIT_MSEC; msec++) {
+        if (__sync_add_and_fetch(&test_done, 0) >= n) {
+            return 0;
+        }
+        sleep_msec(1);
+    }
+    return -1;
+}
+
+
+static void count_task (thread_context_t *thread_ctx)
+{
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+/* adds one more task from a worker: pushed to its deque when stealing.
+   a worker must not wait for room in the queue it drains: run it here */
+static void fork_task (thread_context_t *thread_ctx)
+{
+    threadpool_t *pool = (threadpool_t *) thread_ctx->pool;
+    int err = threadpool_add(pool, count_task, NULL, NULL, 0, 0);
+
+    test_check(err == threadpool_success || err == threadpool_queue_full);
+    if (err == threadpool_queue_full) {
+        count_task(thread_ctx);
+    }
+
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void add_retry (threadpool_t *pool, void (*routine)(thread_context_t *))
+{
+    int err;
+
+    while ((err = threadpool_add(pool, routine, NULL, NULL, 0, 0)) == threadpool_queue_full) {
+        sched_yield();
+    }
+    test_check(err == threadpool_success);
+}
+
+
+static volatile int test_gate, gate_held;
+
+
+/* holds its worker till test_gate is open */
+static void gate_task (thread_context_t *thread_ctx)
+{
+    __sync_add_and_fetch(&gate_held, 1);
+
+    while (!__sync_add_and_fetch(&test_gate, 0)) {
+        sleep_msec(1);
+    }
+}
+
+
+/* close gate and hold n workers on it, 0 if in time */
+static int hold_workers (threadpool_t *pool, int n)
+{
+    int i, msec;
+
+    test_gate = 0;
+    gate_held = 0;
+
+    for (i = 0; i < n; i++) {
+        add_retry(pool, gate_task);
+    }
+
+    for (msec = 0; msec < TEST_WAIT_MSEC; msec++) {
+        if (__sync_add_and_fetch(&gate_held, 0) == n) {
+            return 0;
+        }
+        sleep_msec(1);
+    }
+    return -1;
+}
+
+
+static void open_gate (void)
+{
+    __sync_add_and_fetch(&test_gate, 1);
+}
+
+
+#define TEST_ORDER_MAX  256
+
+static volatile int test_order[TEST_ORDER_MAX];
+static volatile int order_len;
+
+
+/* records its argument in test_order */
+static void order_task (thread_context_t *thread_ctx)
+{
+    int k = __sync_fetch_and_add(&order_len, 1);
+
+    if (k < TEST_ORDER_MAX) {
+        test_order[k] = (int) (intptr_t) thread_ctx->task->argument;
+    }
+
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+/* all tasks of a pool run once, fork_task adds from workers */
+static void test_mode (const threadpool_opts_t *opts)
+{
+    int i;
+    sb8 expect = 0;
+    threadpool_t *pool = threadpool_create_ex(4, 256, 0, 0, NULL, 0, opts);
+
+    test_check(pool);
+
+    test_done = 0;
+
+    for (i = 0; i < TEST_TASKS; i++) {
+        add_retry(pool, count_task);
+    }
+    expect += TEST_TASKS;
+
+    for (i = 0; i < TEST_TASKS / 4; i++) {
+        add_retry(pool, fork_task);
+    }
+    expect += TEST_TASKS / 2;
+
+    if (opts->sched_mode == THREADPOOL_SCHED_EDF) {
+        ub8 now = threadpool_clock_nsec();
+        int err;
+
+        for (i = 0; i < TEST_TASKS / 4; i++) {
+            while ((err = threadpool_add_deadline(pool, count_task, NULL, NULL, 0, 0, now + (ub8) (i % 100) * 1000)) == threadpool_queue_full) {
+                sched_yield();
+            }
+            test_check(err == threadpool_success);
+        }
+        expect += TEST_TASKS / 4;
+    } else {
+        test_check(threadpool_add_deadline(pool, count_task, NULL, NULL, 0, 0, 0) == threadpool_invalid);
+    }
+
+    test_check(wait_done(expect) == 0);
+    test_check(threadpool_destroy(pool) == 0);
+    test_check(test_done == expect);
+}
+
+
+static void test_modes (void)
+{
+    int queue_mode, sched_mode, inplace, batch_max, park_mode;
+
+    for (queue_mode = THREADPOOL_QUEUE_MUTEX; queue_mode <= THREADPOOL_QUEUE_LOCKFREE; queue_mode++) {
+        for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_EDF; sched_mode++) {
+            for (inplace = 0; inplace <= 1; inplace++) {
+                for (batch_max = 1; batch_max <= 4; batch_max += 3) {
+                    for (park_mode = THREADPOOL_PARK_CONDVAR; park_mode <= THREADPOOL_PARK_FUTEX; park_mode++) {
+                        threadpool_opts_t opts = {0};
+
+                        opts.queue_mode = queue_mode;
+                        opts.sched_mode = sched_mode;
+                        opts.inplace = inplace;
+                        opts.batch_max = batch_max;
+                        opts.park_mode = park_mode;
+
+                        /* a batch is made of task copies */
+                        if (inplace && batch_max > 1) {
+                            test_check(threadpool_create_ex(4, 256, 0, 0, NULL, 0, &opts) == NULL);
+                            continue;
+                        }
+
+                        test_mode(&opts);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("[test] modes: ok\n");
+}
+
+
+/* task_arg: sb8 added to test_done */
+static void arg_task (thread_context_t *thread_ctx)
+{
+    sb8 v;
+
+    memcpy(&v, thread_ctx->task->task_arg, sizeof(v));
+    __sync_add_and_fetch(&test_done, v);
+}
+
+
+static void test_reserve (void)
+{
+    int i;
+    sb8 v, expect = 0;
+    threadpool_task_t *slot;
+    threadpool_t *pool = threadpool_create(2, 64, 0, 0, NULL, sizeof(sb8));
+
+    test_check(pool);
+
+    test_done = 0;
+
+    test_check(threadpool_reserve(pool, &slot, sizeof(sb8) + 1) == threadpool_task_arg_overflow);
+
+    /* task_arg is written in the slot: aborted ones never run */
+    for (i = 1; i <= 1000; i++) {
+        while (threadpool_reserve(pool, &slot, sizeof(sb8)) == threadpool_queue_full) {
+            sched_yield();
+        }
+
+        v = i;
+        memcpy(slot->task_arg, &v, sizeof(v));
+
+        if (i % 3 == 0) {
+            test_check(threadpool_abort(pool, slot) == 0);
+        } else {
+            test_check(threadpool_commit(pool, slot, arg_task, NULL, sizeof(sb8), 0) == 0);
+            expect += i;
+        }
+    }
+
+    /* too much task_arg at commit: slot is given back */
+    while (threadpool_reserve(pool, &slot, sizeof(sb8)) == threadpool_queue_full) {
+        sched_yield();
+    }
+    test_check(threadpool_commit(pool, slot, arg_task, NULL, sizeof(sb8) + 1, 0) == threadpool_task_arg_overflow);
+
+    test_check(wait_done(expect) == 0);
+
+    /* a reserved slot holds back the tasks added after it */
+    test_done = 0;
+    test_check(threadpool_reserve(pool, &slot, sizeof(sb8)) == 0);
+
+    for (i = 0; i < 10; i++) {
+        add_retry(pool, count_task);
+    }
+    sleep_msec(20);
+    test_check(test_done == 0);
+
+    v = 1;
+    memcpy(slot->task_arg, &v, sizeof(v));
+    test_check(threadpool_commit(pool, slot, arg_task, NULL, sizeof(sb8), 0) == 0);
+    test_check(wait_done(11) == 0);
+
+    test_check(threadpool_destroy(pool) == 0);
+    test_check(test_done == 11);
+
+    printf("[test] reserve: ok\n");
+}
+
+
+/* argument: index of task, below test_done when it runs */
+static void index_task (thread_context_t *thread_ctx)
+{
+    sb8 index = (sb8) (intptr_t) thread_ctx->task->argument;
+
+    if (index >= __sync_add_and_fetch(&test_done, 0) + 64) {
+        test_done = -TEST_TASKS;
+    }
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void test_batch (void)
+{
+    int i, accepted, n = 40;
+    threadpool_task_desc_t descs[40];
+    threadpool_t *pool = threadpool_create(1, 16, 0, 0, NULL, 0);
+
+    test_check(pool);
+
+    for (i = 0; i < n; i++) {
+        descs[i].function = index_task;
+        descs[i].argument = (void *) (intptr_t) i;
+        descs[i].task_arg = NULL;
+        descs[i].arg_size = 0;
+        descs[i].flags = 0;
+    }
+
+    test_check(threadpool_add_batch(pool, descs, 0, &accepted) == 0 && accepted == 0);
+
+    descs[3].function = NULL;
+    test_check(threadpool_add_batch(pool, descs, n, &accepted) == threadpool_invalid && accepted == 0);
+    descs[3].function = index_task;
+
+    /* worker held: only the leading tasks that fit are added */
+    test_check(hold_workers(pool, 1) == 0);
+    test_done = 0;
+
+    test_check(threadpool_add_batch(pool, descs, n, &accepted) == threadpool_queue_full);
+    test_check(accepted > 0 && accepted <= 16);
+
+    open_gate();
+    test_check(wait_done(accepted) == 0);
+    sleep_msec(10);
+    test_check(test_done == accepted);
+
+    for (i = accepted; i < n; i += accepted) {
+        while (threadpool_add_batch(pool, descs + i, n - i, &accepted) == threadpool_queue_full && accepted == 0) {
+            sched_yield();
+        }
+    }
+
+    test_check(wait_done(n) == 0);
+    test_check(threadpool_destroy(pool) == 0);
+    test_check(test_done == n);
+
+    printf("[test] batch: ok\n");
+}
+
+
+typedef struct test_producer_t
+{
+    threadpool_t *pool;
+    int index;
+    pthread_t thread;
+} test_producer_t;
+
+
+static void * producer_run (void *arg)
+{
+    test_producer_t *p = (test_producer_t *) arg;
+
+    test_check(threadpool_add_timed(p->pool, order_task, (void *) (intptr_t) p->index, NULL, 0, 0, NULL) == 0);
+    return NULL;
+}
+
+
+static void test_timed (void)
+{
+    int i, filled;
+    struct timespec abstime, now;
+    test_producer_t producers[4];
+    threadpool_t *pool = threadpool_create(1, 4, 0, 0, NULL, 0);
+
+    test_check(pool);
+
+    /* worker held, queue full */
+    test_check(hold_workers(pool, 1) == 0);
+    test_done = 0;
+    order_len = 0;
+
+    for (filled = 0; threadpool_add(pool, count_task, NULL, NULL, 0, 0) == 0; filled++) {
+    }
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_nsec += 30000000;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    test_check(threadpool_add_timed(pool, count_task, NULL, NULL, 0, 0, &abstime) == threadpool_timedout);
+    clock_gettime(CLOCK_REALTIME, &now);
+    test_check(now.tv_sec > abstime.tv_sec || (now.tv_sec == abstime.tv_sec && now.tv_nsec >= abstime.tv_nsec));
+
+    /* blocked producers get slots in the order they came */
+    for (i = 0; i < 4; i++) {
+        producers[i].pool = pool;
+        producers[i].index = i;
+        test_check(pthread_create(&producers[i].thread, NULL, producer_run, &producers[i]) == 0);
+        sleep_msec(20);
+    }
+
+    open_gate();
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+
+    test_check(wait_done(filled + 4) == 0);
+    test_check(order_len == 4);
+    for (i = 0; i < 4; i++) {
+        test_check(test_order[i] == i);
+    }
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    printf("[test] timed: ok\n");
+}
+
+
+static void test_threads (void)
+{
+    int n = threadpool_auto_threads(0);
+    threadpool_opts_t opts = {0};
+    threadpool_t *pool;
+
+    test_check(n >= 1);
+    test_check(threadpool_auto_threads(50) >= n);
+    test_check(threadpool_auto_threads(-1) == threadpool_invalid);
+    test_check(threadpool_auto_threads(100) == threadpool_invalid);
+
+    /* thread_count 0: one thread per effective cpu */
+    pool = threadpool_create(0, 64, 0, 0, NULL, 0);
+    test_check(pool);
+    test_check(threadpool_get_threads_count(pool) == n);
+    test_check(threadpool_destroy(pool) == 0);
+
+    opts.blocking_ratio = 100;
+    test_check(threadpool_create_ex(0, 64, 0, 0, NULL, 0, &opts) == NULL);
+    test_check(threadpool_create_ex(4, 64, 0, 0, NULL, 0, &opts) == NULL);
+
+    printf("[test] threads: ok\n");
+}
+
+
+static void test_lanes (void)
+{
+    int i, prio;
+    threadpool_lane_stats_t stats;
+    threadpool_opts_t opts = {0};
+    threadpool_t *pool;
+
+    opts.lanes = 3;
+    opts.aging_msec = 10000;
+
+    pool = threadpool_create_ex(1, 64, 0, 0, NULL, 0, &opts);
+    test_check(pool);
+
+    test_check(threadpool_add_prio(pool, 3, count_task, NULL, NULL, 0, 0) == threadpool_invalid);
+    test_check(threadpool_lane_stats(pool, 3, &stats) == threadpool_invalid);
+
+    /* higher lanes first, in order within a lane */
+    test_check(hold_workers(pool, 1) == 0);
+    test_done = 0;
+    order_len = 0;
+
+    for (i = 0; i < 30; i++) {
+        prio = i % 3;
+        test_check(threadpool_add_prio(pool, prio, order_task, (void *) (intptr_t) (prio * 100 + i), NULL, 0, 0) == 0);
+    }
+
+    open_gate();
+    test_check(wait_done(30) == 0);
+
+    for (i = 1; i < 30; i++) {
+        test_check(test_order[i - 1] / 100 > test_order[i] / 100 ||
+            (test_order[i - 1] / 100 == test_order[i] / 100 && test_order[i - 1] < test_order[i]));
+    }
+
+    for (prio = 0; prio < 3; prio++) {
+        test_check(threadpool_lane_stats(pool, prio, &stats) == 0);
+        test_check(stats.depth == 0 && stats.added == 10 + (prio == 0) && stats.taken == stats.added);
+        test_check(stats.wait_usec > 0);
+    }
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    /* aging: a task waiting long enough in lane 0 goes before new ones
+       of lane 2 */
+    opts.aging_msec = 5;
+
+    pool = threadpool_create_ex(1, 64, 0, 0, NULL, 0, &opts);
+    test_check(pool);
+
+    test_check(hold_workers(pool, 1) == 0);
+    test_done = 0;
+    order_len = 0;
+
+    test_check(threadpool_add_prio(pool, 0, order_task, (void *) 0, NULL, 0, 0) == 0);
+    sleep_msec(50);
+    for (i = 1; i <= 5; i++) {
+        test_check(threadpool_add_prio(pool, 2, order_task, (void *) (intptr_t) i, NULL, 0, 0) == 0);
+    }
+
+    open_gate();
+    test_check(wait_done(6) == 0);
+    test_check(test_order[0] == 0);
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    printf("[test] lanes: ok\n");
+}
+
+
+static void test_timers (void)
+{
+    int i, filled;
+    ub8 ids[8];
+    int mode;
+    sb8 runs;
+    threadpool_t *pool = threadpool_create(2, 64, 0, 0, NULL, 0);
+
+    test_check(pool);
+
+    /* one-shot: half cancelled before due */
+    test_done = 0;
+
+    for (i = 0; i < 8; i++) {
+        test_check(threadpool_add_after(pool, 50000000ULL, count_task, NULL, NULL, 0, 0, &ids[i]) == 0);
+    }
+    for (i = 0; i < 8; i += 2) {
+        test_check(threadpool_cancel_timer(pool, ids[i]) == 0);
+        test_check(threadpool_cancel_timer(pool, ids[i]) == threadpool_invalid);
+    }
+
+    test_check(wait_done(4) == 0);
+    sleep_msec(50);
+    test_check(test_done == 4);
+
+    for (i = 1; i < 8; i += 2) {
+        test_check(threadpool_cancel_timer(pool, ids[i]) == threadpool_invalid);
+    }
+
+    /* periodic: about 100 msec / 5 msec runs, none after cancel */
+    for (mode = THREADPOOL_PERIODIC_RATE; mode <= THREADPOOL_PERIODIC_DELAY; mode++) {
+        test_done = 0;
+
+        test_check(threadpool_add_periodic(pool, 5000000ULL, 5000000ULL, mode, count_task, NULL, NULL, 0, 0, &ids[0]) == 0);
+        sleep_msec(100);
+        test_check(threadpool_cancel_timer(pool, ids[0]) == 0);
+
+        /* a run queued already completes */
+        sleep_msec(20);
+        runs = __sync_add_and_fetch(&test_done, 0);
+        sleep_msec(50);
+
+        test_check(__sync_add_and_fetch(&test_done, 0) == runs);
+        test_check(runs >= 3 && runs <= 22);
+    }
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    /* queue full: due tasks wait in the wheel, still cancellable */
+    pool = threadpool_create(1, 4, 0, 0, NULL, 0);
+    test_check(pool);
+
+    test_check(hold_workers(pool, 1) == 0);
+    test_done = 0;
+
+    for (filled = 0; threadpool_add(pool, count_task, NULL, NULL, 0, 0) == 0; filled++) {
+    }
+
+    for (i = 0; i < 8; i++) {
+        test_check(threadpool_add_after(pool, 1000000ULL, count_task, NULL, NULL, 0, 0, &ids[i]) == 0);
+    }
+    sleep_msec(30);
+
+    for (i = 0; i < 4; i++) {
+        test_check(threadpool_cancel_timer(pool, ids[i]) == 0);
+    }
+
+    open_gate();
+    test_check(wait_done(filled + 4) == 0);
+    sleep_msec(20);
+    test_check(test_done == filled + 4);
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    printf("[test] timers: ok\n");
+}
+
+
+/* argument: n, result: n * n */
+static void square_task (thread_context_t *thread_ctx)
+{
+    sb8 n = (sb8) (intptr_t) thread_ctx->task->argument;
+    sb8 *result = (sb8 *) threadpool_task_result(thread_ctx);
+
+    *result = n * n;
+}
+
+
+static void slow_task (thread_context_t *thread_ctx)
+{
+    sleep_msec(50);
+}
+
+
+/* not added by threadpool_submit */
+static void no_result_task (thread_context_t *thread_ctx)
+{
+    if (threadpool_task_result(thread_ctx) == NULL) {
+        __sync_add_and_fetch(&test_done, 1);
+    }
+}
+
+
+static void test_futures (void)
+{
+    int i, k, num_seen = 0;
+    threadpool_future_t *futures[64], *seen[8];
+    threadpool_t *pool = threadpool_create(2, 256, 0, 0, NULL, 0);
+
+    test_check(pool);
+
+    test_check(threadpool_submit(pool, NULL, NULL, NULL, 0, 0, &futures[0]) == threadpool_invalid);
+
+    for (i = 0; i < 64; i++) {
+        test_check(threadpool_submit(pool, square_task, (void *) (intptr_t) i, NULL, 0, 0, &futures[i]) == 0);
+    }
+    for (i = 0; i < 64; i++) {
+        test_check(threadpool_wait(futures[i], -1) == 0);
+        test_check(threadpool_poll(futures[i]) == 1);
+        test_check(*(sb8 *) threadpool_future_result(futures[i]) == (sb8) i * i);
+        threadpool_future_release(futures[i]);
+    }
+
+    /* 0 and a short timeout do not wait for a slow task */
+    test_check(threadpool_submit(pool, slow_task, NULL, NULL, 0, 0, &futures[0]) == 0);
+    test_check(threadpool_wait(futures[0], 0) == threadpool_timedout);
+    test_check(threadpool_poll(futures[0]) == 0);
+    test_check(threadpool_wait(futures[0], 5) == threadpool_timedout);
+    test_check(threadpool_wait(futures[0], -1) == 0);
+    test_check(threadpool_wait(futures[0], 0) == 0);
+    threadpool_future_release(futures[0]);
+
+    /* released before done */
+    test_check(threadpool_submit(pool, slow_task, NULL, NULL, 0, 0, &futures[0]) == 0);
+    threadpool_future_release(futures[0]);
+
+    /* futures are recycled: one at a time uses few of them */
+    for (i = 0; i < 1000; i++) {
+        test_check(threadpool_submit(pool, square_task, (void *) (intptr_t) 3, NULL, 0, 0, &futures[0]) == 0);
+        test_check(threadpool_wait(futures[0], -1) == 0);
+
+        for (k = 0; k < num_seen && seen[k] != futures[0]; k++) {
+        }
+        if (k == num_seen) {
+            test_check(num_seen < 8);
+            seen[num_seen++] = futures[0];
+        }
+        threadpool_future_release(futures[0]);
+    }
+
+    test_done = 0;
+    add_retry(pool, no_result_task);
+    test_check(wait_done(1) == 0);
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    printf("[test] futures: ok\n");
+}
+
+
+/* argument: depth, forks two tasks in a group of its own till depth 0.
+   with 2 workers all wait at once: they must run queued tasks meanwhile */
+static void tree_task (thread_context_t *thread_ctx)
+{
+    int depth = (int) (intptr_t) thread_ctx->task->argument;
+    threadpool_group_t *group;
+
+    if (depth == 0) {
+        __sync_add_and_fetch(&test_done, 1);
+        return;
+    }
+
+    group = threadpool_group_create((threadpool_t *) thread_ctx->pool);
+    test_check(group);
+
+    test_check(threadpool_group_add(group, tree_task, (void *) (intptr_t) (depth - 1), NULL, 0, 0) == 0);
+    test_check(threadpool_group_add(group, tree_task, (void *) (intptr_t) (depth - 1), NULL, 0, 0) == 0);
+    test_check(threadpool_group_wait(group) == 0);
+
+    threadpool_group_destroy(group);
+}
+
+
+static void test_groups (void)
+{
+    int sched_mode, i;
+    threadpool_group_t *group;
+
+    for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_STEAL; sched_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+
+        opts.sched_mode = sched_mode;
+
+        pool = threadpool_create_ex(2, 1024, 0, 0, NULL, 0, &opts);
+        test_check(pool);
+
+        group = threadpool_group_create(pool);
+        test_check(group);
+
+        /* empty group, then used twice */
+        test_check(threadpool_group_wait(group) == 0);
+
+        test_done = 0;
+        test_check(threadpool_group_add(group, tree_task, (void *) 8, NULL, 0, 0) == 0);
+        test_check(threadpool_group_wait(group) == 0);
+        test_check(test_done == 256);
+
+        test_done = 0;
+        for (i = 0; i < 100; i++) {
+            test_check(threadpool_group_add(group, count_task, NULL, NULL, 0, 0) == 0);
+        }
+        test_check(threadpool_group_wait(group) == 0);
+        test_check(test_done == 100);
+
+        threadpool_group_destroy(group);
+        test_check(threadpool_destroy(pool) == 0);
+    }
+
+    printf("[test] groups: ok\n");
+}
+
+
+#define TEST_RANGE  100003
+
+static volatile int range_hits[TEST_RANGE];
+
+
+/* ctx: grain of chunks of THREADPOOL_PARTITION_DYNAMIC, 0 for others */
+static void range_body (sb8 begin, sb8 end, void *ctx)
+{
+    sb8 grain = (sb8) (intptr_t) ctx;
+
+    if (grain && end - begin > grain) {
+        __sync_lock_test_and_set(&test_done, -1);
+    }
+
+    for (; begin < end; begin++) {
+        __sync_add_and_fetch(&range_hits[begin], 1);
+    }
+}
+
+
+/* parallel_for from a task: the worker is one of the threads */
+static void nested_for_task (thread_context_t *thread_ctx)
+{
+    threadpool_t *pool = (threadpool_t *) thread_ctx->pool;
+
+    test_check(threadpool_parallel_for(pool, 0, TEST_RANGE, 64, range_body, NULL) == 0);
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void test_parallel_for (void)
+{
+    int sched_mode, partition;
+    sb8 n, i, grain;
+
+    for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_STEAL; sched_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+
+        opts.sched_mode = sched_mode;
+
+        pool = threadpool_create_ex(4, 256, 0, 0, NULL, 0, &opts);
+        test_check(pool);
+
+        test_check(threadpool_parallel_for_ex(pool, 0, 10, 1, range_body, NULL, THREADPOOL_PARTITION_GUIDED + 1) == threadpool_invalid);
+
+        for (partition = THREADPOOL_PARTITION_STATIC; partition <= THREADPOOL_PARTITION_GUIDED; partition++) {
+            for (n = 0; n <= TEST_RANGE; n = n * 10 + 3) {
+                for (grain = 1; grain <= 64; grain *= 8) {
+                    memset((void *) range_hits, 0, sizeof(range_hits));
+                    test_done = 0;
+
+                    test_check(threadpool_parallel_for_ex(pool, 0, n, grain, range_body,
+                        (void *) (intptr_t) (partition == THREADPOOL_PARTITION_DYNAMIC? grain : 0), partition) == 0);
+
+                    test_check(test_done == 0);
+                    for (i = 0; i < n; i++) {
+                        test_check(range_hits[i] == 1);
+                    }
+                }
+            }
+        }
+
+        memset((void *) range_hits, 0, sizeof(range_hits));
+        test_done = 0;
+        add_retry(pool, nested_for_task);
+        test_check(wait_done(1) == 0);
+        for (i = 0; i < TEST_RANGE; i++) {
+            test_check(range_hits[i] == 1);
+        }
+
+        test_check(threadpool_destroy(pool) == 0);
+    }
+
+    printf("[test] parallel_for: ok\n");
+}
+
+
+static void sum_body (sb8 begin, sb8 end, void *acc, void *ctx)
+{
+    for (; begin < end; begin++) {
+        *(sb8 *) acc += begin;
+    }
+}
+
+
+static void sum_combine (void *acc, const void *other, void *ctx)
+{
+    *(sb8 *) acc += *(const sb8 *) other;
+}
+
+
+/* not commutative: scan must keep order */
+static void pair_combine (void *acc, const void *elem, void *ctx)
+{
+    sb8 *a = (sb8 *) acc;
+    const sb8 *e = (const sb8 *) elem;
+
+    if (a[1] == 0) {
+        a[0] = e[0];
+    }
+    a[1] = e[1] ? e[1] : a[1];
+}
+
+
+static void test_reduce_scan (void)
+{
+    int sched_mode;
+    sb8 n, i, identity[2] = {0, 0}, result;
+    sb8 *in = (sb8 *) malloc(sizeof(sb8) * 2 * 100000);
+    sb8 *out = (sb8 *) malloc(sizeof(sb8) * 2 * 100000);
+
+    test_check(in && out);
+
+    for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_STEAL; sched_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+
+        opts.sched_mode = sched_mode;
+
+        pool = threadpool_create_ex(4, 256, 0, 0, NULL, 0, &opts);
+        test_check(pool);
+
+        for (n = 0; n <= 100000; n = n * 10 + 1) {
+            result = -1;
+            test_check(threadpool_parallel_reduce(pool, 0, n, 16, sum_body, sum_combine, identity, &result, sizeof(sb8), NULL) == 0);
+            test_check(result == n * (n - 1) / 2);
+
+            /* (first, last) of nonzero: out[i] is (1, i + 1) */
+            for (i = 0; i < n; i++) {
+                in[2 * i] = i + 1;
+                in[2 * i + 1] = i + 1;
+            }
+            test_check(threadpool_parallel_scan(pool, in, out, n, 2 * sizeof(sb8), pair_combine, identity, NULL) == 0);
+            for (i = 0; i < n; i++) {
+                test_check(out[2 * i] == 1 && out[2 * i + 1] == i + 1);
+            }
+        }
+
+        test_check(threadpool_destroy(pool) == 0);
+    }
+
+    free(in);
+    free(out);
+
+    printf("[test] reduce, scan: ok\n");
+}
+
+
+/* a long loop: one msec per chunk */
+static void slow_body (sb8 begin, sb8 end, void *ctx)
+{
+    sleep_msec(1);
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void slow_sum_body (sb8 begin, sb8 end, void *acc, void *ctx)
+{
+    sleep_msec(1);
+    *(sb8 *) acc += end - begin;
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+typedef struct test_loop_t
+{
+    threadpool_t *pool;
+    int reduce;
+    int err;
+} test_loop_t;
+
+
+static void * loop_run (void *arg)
+{
+    test_loop_t *loop = (test_loop_t *) arg;
+    sb8 identity = 0, result;
+
+    if (loop->reduce) {
+        loop->err = threadpool_parallel_reduce(loop->pool, 0, 1000000000, 1, slow_sum_body, sum_combine, &identity, &result, sizeof(sb8), NULL);
+        return NULL;
+    }
+
+    loop->err = threadpool_parallel_for_ex(loop->pool, 0, 1000000000, 1, slow_body, NULL, THREADPOOL_PARTITION_DYNAMIC);
+    return NULL;
+}
+
+
+/* threadpool_destroy from another thread stops a loop: helpers touch
+   the loop on the caller's stack only till it returns */
+static void test_parallel_destroy (void)
+{
+    int reduce;
+    pthread_t thread;
+    test_loop_t loop;
+
+    for (reduce = 0; reduce <= 1; reduce++) {
+        loop.pool = threadpool_create(4, 64, 0, 0, NULL, 0);
+        loop.reduce = reduce;
+        loop.err = 0;
+        test_check(loop.pool);
+
+        test_done = 0;
+        test_check(pthread_create(&thread, NULL, loop_run, &loop) == 0);
+        test_check(wait_done(1) == 0);
+
+        test_check(threadpool_destroy(loop.pool) == 0);
+        pthread_join(thread, NULL);
+
+        test_check(loop.err == threadpool_shutdown);
+    }
+
+    printf("[test] parallel destroy: ok\n");
+}
+
+
+#define TEST_DAG_NODES  64
+
+static volatile sb8 dag_stamp[TEST_DAG_NODES];
+
+
+static void dag_node (thread_context_t *thread_ctx)
+{
+    sb8 node = (sb8) (intptr_t) thread_ctx->task->argument;
+
+    dag_stamp[node] = __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void test_dag (void)
+{
+    int i, from, to, run;
+    int edges[TEST_DAG_NODES * 2][2], num_edges = 0;
+    threadpool_t *pool = threadpool_create(4, 256, 0, 0, NULL, 0);
+    threadpool_dag_t *dag;
+
+    test_check(pool);
+
+    dag = threadpool_dag_create(pool);
+    test_check(dag);
+
+    for (i = 0; i < TEST_DAG_NODES; i++) {
+        test_check(threadpool_dag_add_node(dag, dag_node, (void *) (intptr_t) i) == i);
+    }
+
+    /* edges go to higher nodes only: no cycle */
+    for (to = 1; to < TEST_DAG_NODES; to++) {
+        for (from = to / 3; from < to && num_edges < TEST_DAG_NODES * 2; from += 1 + to / 2) {
+            test_check(threadpool_dag_add_edge(dag, from, to) == 0);
+            edges[num_edges][0] = from;
+            edges[num_edges][1] = to;
+            num_edges++;
+        }
+    }
+
+    for (run = 0; run < 3; run++) {
+        test_done = 0;
+        memset((void *) dag_stamp, 0, sizeof(dag_stamp));
+
+        test_check(threadpool_dag_run(dag, NULL) == 0);
+        test_check(test_done == TEST_DAG_NODES);
+
+        for (i = 0; i < num_edges; i++) {
+            test_check(dag_stamp[edges[i][0]] > 0 && dag_stamp[edges[i][0]] < dag_stamp[edges[i][1]]);
+        }
+    }
+
+    threadpool_dag_destroy(dag);
+
+    /* a cycle is refused */
+    dag = threadpool_dag_create(pool);
+    test_check(dag);
+    test_check(threadpool_dag_add_node(dag, dag_node, (void *) 0) == 0);
+    test_check(threadpool_dag_add_node(dag, dag_node, (void *) 1) == 1);
+    test_check(threadpool_dag_add_edge(dag, 0, 1) == 0);
+    test_check(threadpool_dag_add_edge(dag, 1, 0) == 0);
+    test_check(threadpool_dag_run(dag, NULL) == threadpool_invalid);
+    threadpool_dag_destroy(dag);
+
+    test_check(threadpool_destroy(pool) == 0);
+
+    printf("[test] dag: ok\n");
+}
+
+
+static sb8 keyed_seen[TEST_KEYS];
+static volatile int keyed_running[TEST_KEYS];
+static volatile int keyed_failed;
+
+
+/* task_arg: key, sequence number of task in key */
+static void keyed_task (thread_context_t *thread_ctx)
+{
+    sb8 arg[2];
+
+    memcpy(arg, thread_ctx->task->task_arg, sizeof(arg));
+
+    /* one task of a strand at a time, in order added */
+    if (__sync_add_and_fetch(&keyed_running[arg[0]], 1) != 1 || keyed_seen[arg[0]] != arg[1]) {
+        keyed_failed = 1;
+    }
+    keyed_seen[arg[0]]++;
+    __sync_sub_and_fetch(&keyed_running[arg[0]], 1);
+
+    __sync_add_and_fetch(&test_done, 1);
+}
+
+
+static void test_keyed (void)
+{
+    int sched_mode, i, err;
+
+    for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_STEAL; sched_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+        sb8 next[TEST_KEYS] = {0};
+
+        opts.sched_mode = sched_mode;
+
+        pool = threadpool_create_ex(4, 16, 0, 0, NULL, 2 * sizeof(sb8), &opts);
+        test_check(pool);
+
+        test_done = 0;
+        keyed_failed = 0;
+        memset(keyed_seen, 0, sizeof(keyed_seen));
+
+        for (i = 0; i < TEST_TASKS; i++) {
+            sb8 arg[2];
+
+            arg[0] = (i * 7) % TEST_KEYS;
+            arg[1] = next[arg[0]];
+
+            while ((err = threadpool_add_keyed(pool, (ub8) arg[0], keyed_task, NULL, arg, sizeof(arg), 0)) == threadpool_queue_full) {
+                sched_yield();
+            }
+            test_check(err == threadpool_success);
+
+            next[arg[0]]++;
+        }
+
+        test_check(wait_done(TEST_TASKS) == 0);
+        test_check(threadpool_destroy(pool) == 0);
+        test_check(!keyed_failed);
+
+        for (i = 0; i < TEST_KEYS; i++) {
+            test_check(keyed_seen[i] == next[i]);
+        }
+    }
+
+    printf("[test] keyed: ok\n");
+}
+
+
+static volatile sb8 thread_inits, thread_finis;
+
+
+static void thread_init (thread_context_t *thread_ctx)
+{
+    __sync_add_and_fetch(&thread_inits, 1);
+}
+
+
+static void thread_fini (thread_context_t *thread_ctx)
+{
+    __sync_add_and_fetch(&thread_finis, 1);
+}
+
+
+static int wait_threads (threadpool_t *pool, int threads)
+{
+    int msec;
+
+    for (msec = 0; msec < TEST_WAIT_MSEC; msec++) {
+        if (threadpool_get_threads_count(pool) == threads) {
+            return 0;
+        }
+        sleep_msec(1);
+    }
+    return -1;
+}
+
+
+static void test_resize (void)
+{
+    int park_mode, i;
+
+    for (park_mode = THREADPOOL_PARK_CONDVAR; park_mode <= THREADPOOL_PARK_FUTEX; park_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+
+        opts.park_mode = park_mode;
+        opts.min_threads = 1;
+        opts.max_threads = 8;
+        opts.thread_init = thread_init;
+        opts.thread_fini = thread_fini;
+
+        thread_inits = thread_finis = 0;
+
+        pool = threadpool_create_ex(2, 256, 0, 0, NULL, 0, &opts);
+        test_check(pool);
+        test_check(threadpool_get_threads_count(pool) == 2);
+
+        test_check(threadpool_resize(pool, 0) == threadpool_invalid);
+        test_check(threadpool_resize(pool, 9) == threadpool_invalid);
+
+        test_check(threadpool_resize(pool, 6) == 0);
+        test_check(threadpool_get_threads_count(pool) == 6);
+
+        test_check(threadpool_resize(pool, 1) == 0);
+        test_check(wait_threads(pool, 1) == 0);
+
+        /* slots of retired workers are reused */
+        test_check(threadpool_resize(pool, 8) == 0);
+        test_check(threadpool_get_threads_count(pool) == 8);
+
+        test_done = 0;
+        for (i = 0; i < TEST_TASKS; i++) {
+            add_retry(pool, count_task);
+        }
+        test_check(wait_done(TEST_TASKS) == 0);
+
+        test_check(threadpool_resize(pool, 3) == 0);
+        test_check(wait_threads(pool, 3) == 0);
+
+        test_check(threadpool_destroy(pool) == 0);
+        test_check(thread_inits == 2 + 4 + 7);
+        test_check(thread_finis == thread_inits);
+    }
+
+    printf("[test] resize: ok\n");
+}
+
+
+static void test_startup (void)
+{
+    int i;
+    threadpool_opts_t opts = {0};
+    threadpool_t *pool;
+
+    opts.thread_init = thread_init;
+    opts.thread_fini = thread_fini;
+
+    /* all started by the time create returns */
+    opts.startup = THREADPOOL_STARTUP_PARALLEL;
+    thread_inits = thread_finis = 0;
+
+    pool = threadpool_create_ex(8, 64, 0, 0, NULL, 0, &opts);
+    test_check(pool);
+    test_check(threadpool_get_threads_count(pool) == 8);
+
+    test_done = 0;
+    for (i = 0; i < TEST_TASKS; i++) {
+        add_retry(pool, count_task);
+    }
+    test_check(wait_done(TEST_TASKS) == 0);
+
+    test_check(threadpool_destroy(pool) == 0);
+    test_check(thread_inits == 8 && thread_finis == 8);
+
+    /* one more worker per task added while none is idle */
+    opts.startup = THREADPOOL_STARTUP_LAZY;
+    thread_inits = thread_finis = 0;
+
+    pool = threadpool_create_ex(4, 64, 0, 0, NULL, 0, &opts);
+    test_check(pool);
+    test_check(threadpool_get_threads_count(pool) == 1);
+
+    test_gate = 0;
+    gate_held = 0;
+
+    /* a worker not parked yet counts as busy: may start one early */
+    for (i = 1; i <= 4; i++) {
+        add_retry(pool, gate_task);
+        while (__sync_add_and_fetch(&gate_held, 0) < i) {
+            sleep_msec(1);
+        }
+        test_check(threadpool_get_threads_count(pool) >= i);
+    }
+    test_check(threadpool_get_threads_count(pool) == 4);
+
+    /* no more than thread_count */
+    test_done = 0;
+    add_retry(pool, count_task);
+    test_check(threadpool_get_threads_count(pool) == 4);
+
+    open_gate();
+    test_check(wait_done(1) == 0);
+
+    test_check(threadpool_destroy(pool) == 0);
+    test_check(thread_inits == 4 && thread_finis == 4);
+
+    printf("[test] startup: ok\n");
+}
+
+
+static volatile int warmups;
+
+
+static void warmup (thread_context_t *thread_ctx)
+{
+    __sync_add_and_fetch(&warmups, 1);
+}
+
+
+static void test_prewarm (void)
+{
+    int sched_mode, i;
+
+    for (sched_mode = THREADPOOL_SCHED_FIFO; sched_mode <= THREADPOOL_SCHED_EDF; sched_mode++) {
+        threadpool_opts_t opts = {0};
+        threadpool_t *pool;
+
+        opts.sched_mode = sched_mode;
+        opts.batch_max = 4;
+        opts.prewarm = 1;
+        opts.prewarm_stack = 64 * 1024;
+        opts.warmup = warmup;
+
+        /* workers warmed up by the time create returns */
+        warmups = 0;
+
+        pool = threadpool_create_ex(4, 256, 1024 * 1024, 0, NULL, 0, &opts);
+        test_check(pool);
+        test_check(__sync_add_and_fetch(&warmups, 0) == 4);
+
+        test_done = 0;
+        for (i = 0; i < TEST_TASKS; i++) {
+            add_retry(pool, count_task);
+        }
+        test_check(wait_done(TEST_TASKS) == 0);
+
+        test_check(threadpool_destroy(pool) == 0);
+
+        /* lazy: only the first worker */
+        opts.startup = THREADPOOL_STARTUP_LAZY;
+        warmups = 0;
+
+        pool = threadpool_create_ex(4, 256, 1024 * 1024, 0, NULL, 0, &opts);
+        test_check(pool);
+        test_check(__sync_add_and_fetch(&warmups, 0) == 1);
+        test_check(threadpool_destroy(pool) == 0);
+
+        /* must leave 64 KB of stack untouched */
+        opts.prewarm_stack = 1024 * 1024 - 32 * 1024;
+        test_check(threadpool_create_ex(4, 256, 1024 * 1024, 0, NULL, 0, &opts) == NULL);
+    }
+
+    printf("[test] prewarm: ok\n");
+}
+
+
+int main (int argc, char *argv[])
+{
+    test_modes();
+    test_reserve();
+    test_batch();
+    test_timed();
+    test_threads();
+    test_lanes();
+    test_timers();
+    test_futures();
+    test_groups();
+    test_parallel_for();
+    test_reduce_scan();
+    test_parallel_destroy();
+    test_dag();
+    test_keyed();
+    test_resize();
+    test_startup();
+    test_prewarm();
+
+    printf("[test] all passed\n");
+    return 0;
+}
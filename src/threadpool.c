@@ -40,18 +40,32 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     /* memcpy */
 
 #include "threadpool.h"
+#include "cputopo.h"
+#include "timeut.h"
 
 
 #if !defined(__WINDOWS__)
 # include <unistd.h>
+# include <alloca.h>
 # include <sys/sysinfo.h>
 #endif
 
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# define POOL_HAS_FUTEX  1
+# define POOL_HAS_NUMA   1
+# define POOL_HAS_CPUTOPO  1
+# define POOL_HAS_MMAP   1
+#endif
+
 
 #if defined(__WINDOWS__) && !defined(__CYGWIN__)
 # if defined (_MSC_VER)
@@ -64,395 +78,5728 @@
 #endif
 
 
+/**
+ *  @struct threadpool_slot_t
+ *  @brief hidden header in front of each task in the ring
+ *
+ *  @var seq  sequence number of slot. slot at position pos is free for
+ *            producer if seq == pos, ready for consumer if seq == pos + 1.
+ *  @var stamp time in nsec the slot was claimed by producer (priority
+ *            lanes only).
+ */
+typedef struct threadpool_slot_t
+{
+    volatile ub8 seq;
+    ub8 stamp;
+} threadpool_slot_t;
+
+
+/**
+ *  @struct threadpool_ring_t
+ *  @brief bounded ring of task slots
+ *
+ *  read-only fields, consumer side and producer side are kept on separate
+ *  cache lines.
+ *
+ *  @var size        Number of slots.
+ *  @var slot_size   Bytes of one slot (header + task + task_arg + padding).
+ *  @var slot_offset Bytes of padding in front of header to align task_arg.
+ *  @var slots       Array of slots.
+ *  @var mapped      Bytes mapped for slots of a node ring or of a prewarmed
+ *                   ring, 0 if slots are part of the pool allocation.
+ *  @var head        Position of the next task to dequeue.
+ *  @var taken       Number of tasks dequeued (priority lanes only).
+ *  @var wait_sum    Total nsec tasks waited in ring (priority lanes only).
+ *  @var wait_max    Max nsec a task waited in ring since last read.
+ *  @var tail        Position of the next task to enqueue.
+ *  @var added       Number of slots claimed by producers (priority lanes only).
+ *  @var lock        Mutex to claim positions (THREADPOOL_QUEUE_MUTEX only).
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_ring_t
+{
+    int size;
+    int slot_size;
+    int slot_offset;
+
+    unsigned char *slots;
+    size_t mapped;
+
+    POOL_CACHELINE_ALIGNED volatile ub8 head;
+    volatile ub8 taken;
+    volatile ub8 wait_sum;
+    volatile ub8 wait_max;
+
+    POOL_CACHELINE_ALIGNED volatile ub8 tail;
+    volatile ub8 added;
+
+    POOL_CACHELINE_ALIGNED pthread_mutex_t lock;
+} threadpool_ring_t;
+
+
+/**
+ *  @struct threadpool_deque_t
+ *  @brief Chase-Lev deque of one worker (THREADPOOL_SCHED_STEAL)
+ *
+ *  @var top     Position stolen next by other workers.
+ *  @var bottom  Position pushed next by the owner.
+ *  @var seed    Owner random state to pick victims.
+ *  @var tasks   Array of size task copies, task_stride bytes each.
+ */
+typedef struct threadpool_deque_t
+{
+    POOL_CACHELINE_ALIGNED volatile sb8 top;
+
+    POOL_CACHELINE_ALIGNED volatile sb8 bottom;
+
+    ub4 seed;
+
+    unsigned char *tasks;
+} threadpool_deque_t;
+
+
+/**
+ *  @struct threadpool_worker_t
+ *  @brief private state of one worker, indexed by (id - 1)
+ *
+ *  @var deque       own deque (THREADPOOL_SCHED_STEAL only).
+ *  @var batch_next  index of the next task to run in batch.
+ *  @var batch_len   number of tasks dequeued into batch.
+ *  @var batch       task copies dequeued at once (batch_max > 1 only).
+ *  @var wake        futex word, set to 1 by the producer popping us from
+ *                   the idle stack (THREADPOOL_PARK_FUTEX only).
+ *  @var idle_next   index of the worker below us on the idle stack.
+ *  @var ring        index of the ring of our numa node.
+ *  @var nested      depth of threadpool_group_wait running tasks on us.
+ *  @var state       POOL_WORKER_OFF, POOL_WORKER_RUN or POOL_WORKER_EXITED
+ *                   (retired and detached, OFF once it left the slot).
+ *  @var tasks       deque and batch memory of a worker started after
+ *                   threadpool_create, NULL for the first ones.
+ *  @var cell        task copy of worker, allocated by the thread starting
+ *                   it and freed by the worker when it exits.
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_worker_t
+{
+    threadpool_deque_t deque;
+
+    int ring;
+
+    volatile int wake;
+    int idle_next;
+
+    int batch_next;
+    int batch_len;
+    unsigned char *batch;
+
+    int nested;
+
+    int state;
+    unsigned char *tasks;
+    unsigned char *cell;
+} threadpool_worker_t;
+
+#define POOL_WORKER_OFF     0
+#define POOL_WORKER_RUN     1
+#define POOL_WORKER_EXITED  2
+
+
+/**
+ *  @struct threadpool_heap_node_t
+ *  @brief entry of the deadline heap
+ *
+ *  @var deadline  absolute deadline in nsec of threadpool_clock_nsec.
+ *  @var seq       order of adding, breaks ties of deadlines (FIFO).
+ *  @var cell      index of the task copy in cells.
+ */
+typedef struct threadpool_heap_node_t
+{
+    ub8 deadline;
+    ub8 seq;
+    int cell;
+} threadpool_heap_node_t;
+
+
+/**
+ *  @struct threadpool_heap_t
+ *  @brief binary min-heap of tasks by deadline (THREADPOOL_SCHED_EDF)
+ *
+ *  @var lock      Mutex of heap.
+ *  @var len       Number of tasks in heap.
+ *  @var size      Max number of tasks.
+ *  @var seq       Number of tasks added.
+ *  @var nodes     heap array of size entries.
+ *  @var free_top  Number of unused cells in free_cells.
+ *  @var free_cells stack of unused cells.
+ *  @var cells     task copies, task_stride bytes each.
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_heap_t
+{
+    pthread_mutex_t lock;
+    volatile int len;
+    int size;
+    ub8 seq;
+
+    threadpool_heap_node_t *nodes;
+
+    int free_top;
+    int *free_cells;
+
+    unsigned char *cells;
+} threadpool_heap_t;
+
+
+/* timer wheel: POOL_WHEEL_LEVELS levels of POOL_WHEEL_SLOTS slots each,
+   a slot of level l spans POOL_WHEEL_SLOTS^l ticks */
+#define POOL_WHEEL_BITS    8
+#define POOL_WHEEL_SLOTS   (1 << POOL_WHEEL_BITS)
+#define POOL_WHEEL_LEVELS  4
+#define POOL_WHEEL_NEVER   ((ub8)(-1))
+
+/* timers allocated at once */
+#define POOL_TIMER_CHUNK   1024
+
+/* max due tasks added to queue with one threadpool_add_batch */
+#define POOL_TIMER_BATCH   64
+
+#define POOL_TIMER_FREE     0
+#define POOL_TIMER_PENDING  1
+#define POOL_TIMER_FIRING   2
+#define POOL_TIMER_IDLE     3
+
+
+/**
+ *  @struct threadpool_timer_t
+ *  @brief task of threadpool_add_at waiting in a slot of the timer wheel
+ *
+ *  @var next      next timer in slot, in due list or in free list.
+ *  @var pprev     link pointing to this timer in its slot.
+ *  @var expire    tick to move the task to the queue at.
+ *  @var at        clock nsec to move the task to the queue at.
+ *  @var id        handle of timer: generation << 32 | (index + 1).
+ *  @var state     POOL_TIMER_FREE, POOL_TIMER_PENDING, POOL_TIMER_FIRING,
+ *                 or POOL_TIMER_IDLE (unlinked till its task has run).
+ *  @var period    nsec between runs, 0 for one-shot timer.
+ *  @var mode      THREADPOOL_PERIODIC_RATE or THREADPOOL_PERIODIC_DELAY.
+ *  @var busy      task of periodic timer is queued or running.
+ *  @var cancelled periodic timer is cancelled while busy or firing.
+ *  @var task      copy of the task.
+ */
+typedef struct threadpool_timer_t
+{
+    struct threadpool_timer_t *next;
+    struct threadpool_timer_t **pprev;
+
+    ub8 expire;
+    ub8 at;
+    ub8 id;
+    int state;
+
+    ub8 period;
+    int mode;
+    int busy;
+    int cancelled;
+
+    threadpool_task_t *task;
+} threadpool_timer_t;
+
+
+/**
+ *  @struct threadpool_wheel_t
+ *  @brief hierarchical timing wheel, advanced by the timer thread
+ *
+ *  @var lock      Mutex of wheel and timers.
+ *  @var notify    Condition variable the timer thread sleeps on.
+ *  @var thread    timer thread, started by first threadpool_add_at.
+ *  @var started   whether timer thread is started.
+ *  @var start     clock nsec of tick 0.
+ *  @var now       next tick to run, timers of earlier ticks are gone.
+ *  @var wake      tick the timer thread sleeps till.
+ *  @var pending   Number of timers in slots.
+ *  @var free_timers list of unused timers.
+ *  @var num_chunks Number of allocated chunks of POOL_TIMER_CHUNK timers.
+ *  @var max_chunks capacity of chunks.
+ *  @var chunks    timers by index / POOL_TIMER_CHUNK.
+ *  @var slots     lists of timers by level and slot.
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_wheel_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notify;
+    pthread_t thread;
+    int started;
+
+    ub8 start;
+    ub8 now;
+    ub8 wake;
+    int pending;
+
+    threadpool_timer_t *free_timers;
+
+    int num_chunks;
+    int max_chunks;
+    threadpool_timer_t **chunks;
+
+    threadpool_timer_t *slots[POOL_WHEEL_LEVELS][POOL_WHEEL_SLOTS];
+} threadpool_wheel_t;
+
+
+/* futures allocated at once, max number of such chunks */
+#define POOL_FUTURE_CHUNK   1024
+#define POOL_FUTURE_CHUNKS  1024
+
+#define POOL_FUTURE_PENDING 0
+#define POOL_FUTURE_WAITED  1
+#define POOL_FUTURE_DONE    2
+
+/* flag of threadpool_group_t.state: some thread sleeps on it */
+#define POOL_GROUP_WAITED   0x40000000
+
+
+/**
+ *  @struct threadpool_future_t
+ *  @brief handle of a task added by threadpool_submit
+ *
+ *  @var state     POOL_FUTURE_PENDING, POOL_FUTURE_WAITED (pending, some
+ *                 thread sleeps on it) or POOL_FUTURE_DONE.
+ *  @var refs      1 for caller + 1 for the task till it is done.
+ *  @var index     index of future in chunks.
+ *  @var next_free index + 1 of next future in free stack, read by a
+ *                 thread popping it while another pushes it again.
+ *  @var pool      pool of future.
+ *  @var function  task function, run by threadpool_future_run.
+ *  @var argument  task argument.
+ *  @var group     group of task (threadpool_group_add), else NULL.
+ *  @var result    result slot, written by the task.
+ */
+struct POOL_CACHELINE_ALIGNED threadpool_future_t
+{
+    volatile int state;
+    volatile int refs;
+
+    ub4 index;
+    volatile ub4 next_free;
+
+    threadpool_t *pool;
+
+    void (*function)(thread_context_t *);
+    void *argument;
+
+    threadpool_group_t *group;
+
+    POOL_CACHELINE_ALIGNED unsigned char result[POOL_FUTURE_RESULT_SIZE];
+};
+
+
+/**
+ *  @struct threadpool_group_t
+ *  @brief tasks added by threadpool_group_add, waited for together
+ *
+ *  @var pool      pool of group.
+ *  @var state     Number of tasks not done, or'ed with POOL_GROUP_WAITED.
+ *                 futex word of waiters.
+ *  @var running   Number of tasks started and not done, a waiter leaving
+ *                 at shutdown waits for them.
+ */
+struct POOL_CACHELINE_ALIGNED threadpool_group_t
+{
+    threadpool_t *pool;
+    volatile int state;
+    volatile int running;
+};
+
+
+/**
+ *  @struct threadpool_futures_t
+ *  @brief recycled futures of a pool
+ *
+ *  @var free_head  top of free stack: tag << 32 | (index + 1), 0 if empty.
+ *  @var lock       Mutex to add chunks (and to sleep on if no futex).
+ *  @var notify     Condition variable of waiters if no futex.
+ *  @var num_chunks Number of allocated chunks.
+ *  @var chunks     futures by index / POOL_FUTURE_CHUNK.
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_futures_t
+{
+    volatile ub8 free_head;
+
+    POOL_CACHELINE_ALIGNED pthread_mutex_t lock;
+    pthread_cond_t notify;
+
+    volatile int num_chunks;
+    threadpool_future_t *chunks[POOL_FUTURE_CHUNKS];
+} threadpool_futures_t;
+
+
+/**
+ *  @struct threadpool_loop_t
+ *  @brief range of threadpool_parallel_for and threadpool_parallel_reduce,
+ *    lives on the caller's stack
+ *
+ *  @var next      next index to claim, or next block for
+ *                 THREADPOOL_PARTITION_STATIC.
+ *  @var joined    Number of threads that claimed an accumulator.
+ *  @var begin, end  range of loop.
+ *  @var grain     min indexes of a chunk.
+ *  @var parts     Number of threads sharing the range.
+ *  @var partition THREADPOOL_PARTITION_*.
+ *  @var body, ctx called for each chunk.
+ *  @var reduce    called for each chunk instead of body, with accumulator
+ *                 of thread.
+ *  @var accs      accumulators, one per thread, acc_stride bytes each.
+ *  @var identity  initial value of accumulators, acc_size bytes.
+ *  @var pool      pool of loop, no more chunks are run at shutdown.
+ *  @var stopped   a chunk was left undone at shutdown.
+ */
+typedef struct threadpool_loop_t
+{
+    POOL_CACHELINE_ALIGNED volatile sb8 next;
+
+    POOL_CACHELINE_ALIGNED volatile int joined;
+
+    POOL_CACHELINE_ALIGNED sb8 begin;
+    sb8 end;
+    sb8 grain;
+    int parts;
+    int partition;
+    void (*body)(sb8, sb8, void *);
+    void *ctx;
+
+    void (*reduce)(sb8, sb8, void *, void *);
+    unsigned char *accs;
+    size_t acc_size;
+    size_t acc_stride;
+    const void *identity;
+    threadpool_t *pool;
+    volatile int stopped;
+} threadpool_loop_t;
+
+
+/**
+ *  @struct threadpool_strand_t
+ *  @brief FIFO of tasks of threadpool_add_keyed with the same key hash
+ *
+ *  @var lock      Mutex of strand.
+ *  @var scheduled whether a drain task of strand is queued or running,
+ *                 always so while strand has tasks.
+ *  @var count     Number of tasks not yet run, up to POOL_STRAND_DEPTH.
+ *  @var ring      ring of the worker that ran strand last, -1 if none.
+ *  @var head, tail  cells of tasks not yet run, oldest first.
+ *  @var free      cells to reuse.
+ */
+typedef struct POOL_CACHELINE_ALIGNED threadpool_strand_t
+{
+    pthread_mutex_t lock;
+    int scheduled;
+    int count;
+    int ring;
+    unsigned char *head;
+    unsigned char *tail;
+    unsigned char *free;
+} threadpool_strand_t;
+
+
+/**
+ *  @struct threadpool_waiter_t
+ *  @brief producer blocked in threadpool_add_timed, lives on its stack
+ */
+typedef struct threadpool_waiter_t
+{
+    struct threadpool_waiter_t *next;
+    pthread_cond_t cond;
+} threadpool_waiter_t;
+
+
 /**
  *  @struct threadpool
  *  @brief The threadpool struct
  *
- *  @var notify       Condition variable to notify worker threads.
- *  @var threads      Array containing worker threads ID.
- *  @var thread_count Number of threads
- *  @var queue        Array containing the task queue.
- *  @var queue_size   Size of the task queue.
- *  @var head         Index of the first element.
- *  @var tail         Index of the next element.
+ *  fields read by everyone come first. fields written by producers, by
+ *  workers or by both are each kept on their own cache lines.
+ *
  *  @var shutdown     Flag indicating if the pool is shutting down
+ *  @var thread_count Number of running worker threads
+ *  @var max_threads  Number of worker slots (thread_ctxs and workers).
+ *  @var num_workers  slots in use: highest id of a running worker.
+ *  @var min_threads  workers idle for idle_nsec retire down to it.
+ *  @var target       workers above it retire as soon as they are idle.
+ *  @var idle_nsec    idle time a worker retires after, 0: never.
+ *  @var spawn_nsec   time tasks are added with no idle worker before one
+ *                    more is started, 0: never.
+ *  @var affinity_cpus  cpus per worker of threadpool_create.
+ *  @var num_groups   Number of cpu groups in group_cpus.
+ *  @var group_cpus   cpus of each group of affinity_cpus, computed once
+ *                    for all workers. NULL if workers are not grouped.
+ *  @var startup      THREADPOOL_STARTUP_* mode of threadpool_create.
+ *  @var stack_size   stack bytes of worker threads, 0 for default.
+ *  @var prewarm      workers touch prewarm_stack bytes of their stack and
+ *                    run warmup before taking tasks.
+ *  @var warmup       callback run by each worker in prewarm mode.
+ *  @var thread_init  called by each worker thread when it starts.
+ *  @var thread_fini  called by each worker thread before it exits.
+ *  @var queue_size   slots of all rings and of the EDF heap.
+ *  @var queue_mode   THREADPOOL_QUEUE_MUTEX or THREADPOOL_QUEUE_LOCKFREE
+ *  @var sched_mode   THREADPOOL_SCHED_FIFO, THREADPOOL_SCHED_STEAL or
+ *                    THREADPOOL_SCHED_EDF
+ *  @var inplace      run tasks from ring slots without copying
+ *  @var task_offset  Bytes in front of a task copy to align task_arg.
+ *  @var task_stride  Bytes of one task copy (offset + task + padding).
+ *  @var task_arg_align alignment of task_arg.
+ *  @var batch_min    min tasks a worker dequeues at once.
+ *  @var batch_max    max tasks a worker dequeues at once.
+ *  @var park_mode    THREADPOOL_PARK_CONDVAR or THREADPOOL_PARK_FUTEX
+ *  @var spin_count   times to poll for work before parking.
+ *  @var workers      private state of workers indexed by (id - 1).
+ *  @var num_lanes    Number of priority lanes.
+ *  @var lane_rings   Number of rings of one lane, one per numa node in numa mode.
+ *  @var lane_stats   whether rings keep counters and stamps (priority lanes).
+ *  @var aging_nsec   a task waiting longer in a lower lane goes first.
+ *  @var num_rings    Number of rings: num_lanes * lane_rings.
+ *  @var rings        the task queues, ring of lane on node r at
+ *                    (lane * lane_rings + r). lane 0 is the lowest.
+ *  @var heap         tasks with deadline (THREADPOOL_SCHED_EDF), else NULL.
+ *  @var expired      callback for tasks taken after their deadline.
+ *  @var wheel        timers of threadpool_add_at.
+ *  @var futures      futures of threadpool_submit.
+ *  @var strands      POOL_STRANDS strands of threadpool_add_keyed.
+ *  @var nodes        numa node of each ring, NULL if not numa mode.
+ *  @var cpu_ring     ring index of each cpu id, NULL if not numa mode.
+ *  @var affinity     THREADPOOL_AFFINITY_* placement policy of workers.
+ *  @var num_cpus     Number of cpus in cpus.
+ *  @var cpus         topology of cpus to place workers on, NULL if
+ *                    affinity is THREADPOOL_AFFINITY_GROUPS.
+ *  @var lock         Mutex to park idle worker threads.
+ *  @var notify       Condition variable to notify worker threads.
+ *  @var idle_top     Top of the idle stack (THREADPOOL_PARK_FUTEX), -1 if empty.
+ *  @var sleepers     Number of worker threads parked.
+ *  @var busy_since   clock nsec since tasks are added with no worker
+ *                    parked, 0 if one is.
+ *  @var count        Number of tasks in queue.
+ *  @var full_lock    Mutex of the FIFO of producers waiting for free slot.
+ *  @var full_waiters Number of producers in the FIFO.
+ *  @var waiters_head Longest waiting producer.
+ *  @var waiters_gone signaled by the last producer leaving the FIFO at
+ *                    shutdown, threadpool_destroy waits for it.
+ *  @var worker_gone  broadcast when a retired worker left its slot.
+ *  @var callers      Number of threads other than workers in
+ *                    threadpool_group_wait or a parallel loop, they touch
+ *                    pool until they left.
+ *  @var group_gate   Number of group tasks between reading shutdown and
+ *                    counting them running in their group.
+ *  @var started      Number of worker threads not yet exited.
+ *  @var start_next   next slot to start (THREADPOOL_STARTUP_PARALLEL).
+ *  @var start_done   slots tried to start, threadpool_create waits for
+ *                    start_count of them.
+ *  @var start_failed a slot failed to start.
+ *  @var warmed       workers done with prewarm, threadpool_create waits
+ *                    for those it started.
+ *  @var thread_ctxs  Array containing worker threads.
  */
-struct threadpool_t
+struct POOL_CACHELINE_ALIGNED threadpool_t
 {
-    pthread_mutex_t lock;
+    volatile int shutdown;
+
+    volatile int thread_count;
+    int max_threads;
+    volatile int num_workers;
+    int min_threads;
+    int target;
+    ub8 idle_nsec;
+    ub8 spawn_nsec;
+    int affinity_cpus;
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+    int num_groups;
+    cpu_set_t *group_cpus;
+#endif
+    int startup;
+    int stack_size;
+    int prewarm;
+    int prewarm_stack;
+    void (*warmup)(thread_context_t *);
+    void (*thread_init)(thread_context_t *);
+    void (*thread_fini)(thread_context_t *);
+    int queue_size;
+    int queue_mode;
+    int sched_mode;
+    int deque_size;
+    int inplace;
+    int task_arg_size;
+    int task_size;  /* total sizeof task */
+    int task_offset;
+    int task_stride;
+    int task_arg_align;
+
+    int batch_min;
+    int batch_max;
+    int park_mode;
+    int spin_count;
+
+    threadpool_worker_t *workers;
+
+    int num_lanes;
+    int lane_rings;
+    int lane_stats;
+    ub8 aging_nsec;
+
+    int num_rings;
+    threadpool_ring_t *rings;
+
+    threadpool_heap_t *heap;
+    void (*expired)(thread_context_t *);
+
+    threadpool_wheel_t *wheel;
+    threadpool_futures_t *futures;
+    threadpool_strand_t *strands;
+
+#if defined(POOL_HAS_NUMA)
+    cputopo_node_t *nodes;
+    int *cpu_ring;
+#endif
+
+    int affinity;
+#if defined(POOL_HAS_CPUTOPO)
+    int num_cpus;
+    cputopo_cpu_t *cpus;
+#endif
+
+    POOL_CACHELINE_ALIGNED pthread_mutex_t lock;
     pthread_cond_t notify;
+    int idle_top;
+
+    POOL_CACHELINE_ALIGNED volatile int sleepers;
+    volatile ub8 busy_since;
+
+    POOL_CACHELINE_ALIGNED volatile int count;
+
+    POOL_CACHELINE_ALIGNED pthread_mutex_t full_lock;
+    volatile int full_waiters;
+    threadpool_waiter_t *waiters_head;
+    threadpool_waiter_t *waiters_tail;
+    pthread_cond_t waiters_gone;
+    pthread_cond_t worker_gone;
+    int callers;
+
+    POOL_CACHELINE_ALIGNED volatile int group_gate;
+
+    POOL_CACHELINE_ALIGNED volatile int started;
+
+    POOL_CACHELINE_ALIGNED volatile int start_next;
+    volatile int start_done;
+    int start_count;
+    int start_failed;
+    volatile int warmed;
+
+    thread_context_t thread_ctxs[0];
+};
+
+
+#if defined(__WINDOWS__)
+# define pool_count_get(pool)  InterlockedCompareExchange(&pool->count, 0, 0)
+# define pool_count_add(pool)  InterlockedIncrement(&pool->count)
+# define pool_count_sub(pool)  InterlockedDecrement(&pool->count)
+
+# define pool_atomic_inc(p)        InterlockedIncrement((volatile LONG *)(p))
+# define pool_atomic_dec(p)        InterlockedDecrement((volatile LONG *)(p))
+# define pool_load64(p)            ((ub8) InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+# define pool_store64(p, v)        InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v))
+# define pool_load32(p)            ((int) InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+# define pool_store32(p, v)        InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+# define pool_cas64(p, o, n)       (InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(n), (LONG64)(o)) == (LONG64)(o))
+# define pool_cas32(p, o, n)       (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+# define pool_xchg32(p, v)         ((int) InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+# define pool_add64(p, v)          InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+# define pool_fetch_add64(p, v)    InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+# define pool_xchg64(p, v)         ((ub8) InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))
+# define pool_full_barrier()       MemoryBarrier()
+
+# define POOL_THREAD_LOCAL         __declspec(thread)
+# define pool_cpu_relax()          YieldProcessor()
+#else
+/* count is only a statistic, no barrier needed to read it */
+# define pool_count_get(pool)  __atomic_load_n(&pool->count, __ATOMIC_RELAXED)
+# define pool_count_add(pool)  __sync_add_and_fetch(&pool->count, 1)
+# define pool_count_sub(pool)  __sync_sub_and_fetch(&pool->count, 1)
+
+# define pool_atomic_inc(p)        __sync_add_and_fetch((p), 1)
+# define pool_atomic_dec(p)        __sync_sub_and_fetch((p), 1)
+# define pool_load64(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define pool_store64(p, v)        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define pool_load32(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define pool_store32(p, v)        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define pool_cas64(p, o, n)       __sync_bool_compare_and_swap((p), (o), (n))
+# define pool_cas32(p, o, n)       __sync_bool_compare_and_swap((p), (o), (n))
+# define pool_xchg32(p, v)         __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+# define pool_add64(p, v)          __sync_add_and_fetch((p), (v))
+# define pool_fetch_add64(p, v)    __sync_fetch_and_add((p), (v))
+# define pool_xchg64(p, v)         __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+# define pool_full_barrier()       __sync_synchronize()
+
+# define POOL_THREAD_LOCAL         __thread
+
+# if defined(__i386__) || defined(__x86_64__)
+#   define pool_cpu_relax()        __asm__ __volatile__ ("pause")
+# elif defined(__aarch64__) || defined(__arm__)
+#   define pool_cpu_relax()        __asm__ __volatile__ ("yield")
+# else
+#   define pool_cpu_relax()        __asm__ __volatile__ ("" ::: "memory")
+# endif
+#endif
+
+
+#if defined(POOL_HAS_FUTEX)
+# define pool_futex_wait(addr, val)  syscall(SYS_futex, (addr), FUTEX_WAIT_PRIVATE, (val), NULL, NULL, 0)
+# define pool_futex_wake(addr, n)    syscall(SYS_futex, (addr), FUTEX_WAKE_PRIVATE, (n), NULL, NULL, 0)
+# define pool_futex_wait_timed(addr, val, ts)  syscall(SYS_futex, (addr), FUTEX_WAIT_PRIVATE, (val), (ts), NULL, 0)
+#endif
+
+
+/* context of the worker running on current thread, NULL for other threads */
+static POOL_THREAD_LOCAL thread_context_t *pool_current_ctx = NULL;
+
+
+#define pool_align_size(sz, align)  \
+    ((size_t)((((size_t)(sz) + (align) - 1) / (align)) * (align)))
+
+
+#if defined(__WINDOWS__) && !defined(__CYGWIN__)
+# define pool_aligned_alloc(align, size)  _aligned_malloc((size), (align))
+# define pool_aligned_free(p)             _aligned_free(p)
+#else
+static void * pool_aligned_alloc (size_t align, size_t size)
+{
+    void *p = NULL;
+
+    if (posix_memalign(&p, align, size) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+# define pool_aligned_free(p)             free(p)
+#endif
+
+#if defined(__WINDOWS__) && !defined(__CYGWIN__)
+# define pool_alloca(size)                _alloca(size)
+#else
+# define pool_alloca(size)                alloca(size)
+#endif
+
+
+/* monotonic time in nsec */
+static ub8 pool_now_nsec (void)
+{
+#if defined(__WINDOWS__) && !defined(__CYGWIN__)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+
+    return (ub8) (now.QuadPart / freq.QuadPart) * 1000000000ULL +
+        (ub8) (now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ub8) ts.tv_sec * 1000000000ULL + (ub8) ts.tv_nsec;
+#endif
+}
+
+
+/* absolute CLOCK_REALTIME nsec from now, for pthread_cond_timedwait */
+static void pool_abstime (struct timespec *abstime, ub8 nsec)
+{
+    getnowtimeofday(abstime);
+
+    nsec += (ub8) abstime->tv_nsec;
+
+    abstime->tv_sec += (time_t) (nsec / 1000000000ULL);
+    abstime->tv_nsec = (long) (nsec % 1000000000ULL);
+}
+
+
+#define threadpool_slot_at(ring, pos)  \
+    ((threadpool_slot_t *) ((ring)->slots + (size_t)((pos) % (ub8)(ring)->size) * (ring)->slot_size + (ring)->slot_offset))
+
+#define threadpool_slot_task(slot)  \
+    ((threadpool_task_t *) ((unsigned char *)(slot) + sizeof(threadpool_slot_t)))
+
+#define threadpool_task_slot(task)  \
+    ((threadpool_slot_t *) ((unsigned char *)(task) - sizeof(threadpool_slot_t)))
+
+#define pool_stealing(pool)  ((pool)->sched_mode == THREADPOOL_SCHED_STEAL)
+
+/* whether current thread is a worker of pool */
+#define pool_is_worker(pool)  (pool_current_ctx && pool_current_ctx->pool == (void*) (pool))
+
+/* shutdown, thread_count, num_workers and target are written under
+   pool->lock by pool_store32, and read without it as hints */
+#define pool_is_shutdown(pool)  pool_load32(&(pool)->shutdown)
+
+/* ring of lane on (numa) ring index r */
+#define pool_lane_ring(pool, lane, r)  (&(pool)->rings[(lane) * (pool)->lane_rings + (r) % (pool)->lane_rings])
+
+/* i-th task copy in an array of task_stride cells */
+#define threadpool_task_cell(pool, cells, i)  \
+    ((threadpool_task_t *) ((cells) + (size_t)(i) * (pool)->task_stride + (pool)->task_offset))
+
+#define threadpool_deque_task(pool, dq, pos)  \
+    threadpool_task_cell(pool, (dq)->tasks, (pos) % (pool)->deque_size)
+
+
+/**
+ * threadpool_task_copy
+ *   copy task header and only the used bytes of task_arg.
+ *   arg_size is clamped since a thief may read a slot being overwritten
+ *   (its CAS fails then and the copy is dropped).
+ */
+static void threadpool_task_copy (threadpool_t *pool, threadpool_task_t *dst, const threadpool_task_t *src)
+{
+    size_t arg_size = src->arg_size;
+
+    if (arg_size > (size_t) pool->task_arg_size) {
+        arg_size = (size_t) pool->task_arg_size;
+    }
+
+    memcpy(dst, src, sizeof(threadpool_task_t) + arg_size);
+}
+
+
+thread_context_t * threadpool_get_context (threadpool_t *pool, int id)
+{
+	return &(pool->thread_ctxs[id - 1]);
+}
+
+
+/**
+ * ring_stamp
+ *   producer claimed k slots from pos: stamp them with time of adding for
+ *   lane counters and aging (priority lanes only).
+ */
+static void ring_stamp (threadpool_t *pool, threadpool_ring_t *ring, ub8 pos, int k)
+{
+    int i;
+    ub8 now;
+
+    if (!pool->lane_stats || k <= 0) {
+        return;
+    }
+
+    now = pool_now_nsec();
+
+    for (i = 0; i < k; i++) {
+        threadpool_slot_at(ring, pos + i)->stamp = now;
+    }
+
+    pool_add64(&ring->added, k);
+}
+
+
+/**
+ * ring_account
+ *   consumer claimed k slots from pos: count them and their wait time
+ *   (priority lanes only).
+ */
+static void ring_account (threadpool_t *pool, threadpool_ring_t *ring, ub8 pos, int k)
+{
+    int i;
+    ub8 now, wait, max, sum = 0, top = 0;
+
+    if (!pool->lane_stats || k <= 0) {
+        return;
+    }
+
+    now = pool_now_nsec();
+
+    for (i = 0; i < k; i++) {
+        ub8 stamp = threadpool_slot_at(ring, pos + i)->stamp;
+
+        wait = (now > stamp)? now - stamp : 0;
+        sum += wait;
+        if (wait > top) {
+            top = wait;
+        }
+    }
+
+    pool_add64(&ring->taken, k);
+    pool_add64(&ring->wait_sum, sum);
+
+    max = pool_load64(&ring->wait_max);
+    while (top > max && !pool_cas64(&ring->wait_max, max, top)) {
+        max = pool_load64(&ring->wait_max);
+    }
+}
+
+
+/**
+ * ring_claim_write
+ *   claim a free slot at tail for producer. returns NULL if ring is full.
+ *   the slot is owned by caller until ring_publish.
+ */
+static threadpool_slot_t * ring_claim_write (threadpool_t *pool, threadpool_ring_t *ring, ub8 *ppos)
+{
+    threadpool_slot_t *slot;
+    ub8 pos;
+    sb8 dif;
+
+    if (pool->queue_mode == THREADPOOL_QUEUE_MUTEX) {
+        pthread_mutex_lock(&ring->lock);
+
+        pos = ring->tail;
+        slot = threadpool_slot_at(ring, pos);
+
+        if (pool_load64(&slot->seq) != pos) {
+            pthread_mutex_unlock(&ring->lock);
+            return NULL;
+        }
+
+        pool_store64(&ring->tail, pos + 1);
+        pthread_mutex_unlock(&ring->lock);
+
+        *ppos = pos;
+        ring_stamp(pool, ring, pos, 1);
+        return slot;
+    }
+
+    pos = pool_load64(&ring->tail);
+
+    for (;;) {
+        slot = threadpool_slot_at(ring, pos);
+        dif = (sb8) (pool_load64(&slot->seq) - pos);
+
+        if (dif == 0) {
+            if (pool_cas64(&ring->tail, pos, pos + 1)) {
+                *ppos = pos;
+                ring_stamp(pool, ring, pos, 1);
+                return slot;
+            }
+        } else if (dif < 0) {
+            /* slot at tail still not consumed: full */
+            return NULL;
+        }
+
+        pos = pool_load64(&ring->tail);
+    }
+}
+
+
+/**
+ * ring_claim_write_n
+ *   claim up to n contiguous free slots at tail. returns number of slots
+ *   claimed from *ppos, 0 if ring is full.
+ */
+static int ring_claim_write_n (threadpool_t *pool, threadpool_ring_t *ring, int n, ub8 *ppos)
+{
+    int k;
+    ub8 pos;
+    sb8 dif;
+
+    if (pool->queue_mode == THREADPOOL_QUEUE_MUTEX) {
+        pthread_mutex_lock(&ring->lock);
+
+        pos = ring->tail;
+
+        for (k = 0; k < n; k++) {
+            if (pool_load64(&threadpool_slot_at(ring, pos + k)->seq) != pos + k) {
+                break;
+            }
+        }
+
+        pool_store64(&ring->tail, pos + k);
+        pthread_mutex_unlock(&ring->lock);
+
+        *ppos = pos;
+        ring_stamp(pool, ring, pos, k);
+        return k;
+    }
+
+    pos = pool_load64(&ring->tail);
+
+    for (;;) {
+        dif = (sb8) (pool_load64(&threadpool_slot_at(ring, pos)->seq) - pos);
+
+        if (dif < 0) {
+            return 0;
+        }
+
+        if (dif == 0) {
+            /* slots can not change while tail stays at pos */
+            for (k = 1; k < n; k++) {
+                if (pool_load64(&threadpool_slot_at(ring, pos + k)->seq) != pos + k) {
+                    break;
+                }
+            }
+
+            if (pool_cas64(&ring->tail, pos, pos + k)) {
+                *ppos = pos;
+                ring_stamp(pool, ring, pos, k);
+                return k;
+            }
+        }
+
+        pos = pool_load64(&ring->tail);
+    }
+}
+
+
+/**
+ * ring_claim_read
+ *   claim a ready slot at head for consumer. returns NULL if ring is empty.
+ *   the slot is owned by caller until ring_release.
+ */
+static threadpool_slot_t * ring_claim_read (threadpool_t *pool, threadpool_ring_t *ring, ub8 *ppos)
+{
+    threadpool_slot_t *slot;
+    ub8 pos;
+    sb8 dif;
+
+    if (pool->queue_mode == THREADPOOL_QUEUE_MUTEX) {
+        pthread_mutex_lock(&ring->lock);
+
+        pos = ring->head;
+        slot = threadpool_slot_at(ring, pos);
+
+        if (pool_load64(&slot->seq) != pos + 1) {
+            pthread_mutex_unlock(&ring->lock);
+            return NULL;
+        }
+
+        pool_store64(&ring->head, pos + 1);
+        pthread_mutex_unlock(&ring->lock);
+
+        *ppos = pos;
+        ring_account(pool, ring, pos, 1);
+        return slot;
+    }
+
+    pos = pool_load64(&ring->head);
+
+    for (;;) {
+        slot = threadpool_slot_at(ring, pos);
+        dif = (sb8) (pool_load64(&slot->seq) - (pos + 1));
+
+        if (dif == 0) {
+            if (pool_cas64(&ring->head, pos, pos + 1)) {
+                *ppos = pos;
+                ring_account(pool, ring, pos, 1);
+                return slot;
+            }
+        } else if (dif < 0) {
+            /* slot at head not yet published: empty */
+            return NULL;
+        }
+
+        pos = pool_load64(&ring->head);
+    }
+}
+
+
+/**
+ * ring_claim_read_n
+ *   claim up to n contiguous ready slots at head. returns number of slots
+ *   claimed from *ppos, 0 if ring is empty.
+ */
+static int ring_claim_read_n (threadpool_t *pool, threadpool_ring_t *ring, int n, ub8 *ppos)
+{
+    int k;
+    ub8 pos;
+    sb8 dif;
+
+    if (pool->queue_mode == THREADPOOL_QUEUE_MUTEX) {
+        pthread_mutex_lock(&ring->lock);
+
+        pos = ring->head;
+
+        for (k = 0; k < n; k++) {
+            if (pool_load64(&threadpool_slot_at(ring, pos + k)->seq) != pos + k + 1) {
+                break;
+            }
+        }
+
+        pool_store64(&ring->head, pos + k);
+        pthread_mutex_unlock(&ring->lock);
+
+        *ppos = pos;
+        ring_account(pool, ring, pos, k);
+        return k;
+    }
+
+    pos = pool_load64(&ring->head);
+
+    for (;;) {
+        dif = (sb8) (pool_load64(&threadpool_slot_at(ring, pos)->seq) - (pos + 1));
+
+        if (dif < 0) {
+            return 0;
+        }
+
+        if (dif == 0) {
+            /* slots can not be claimed by others while head stays at pos */
+            for (k = 1; k < n; k++) {
+                if (pool_load64(&threadpool_slot_at(ring, pos + k)->seq) != pos + k + 1) {
+                    break;
+                }
+            }
+
+            if (pool_cas64(&ring->head, pos, pos + k)) {
+                *ppos = pos;
+                ring_account(pool, ring, pos, k);
+                return k;
+            }
+        }
+
+        pos = pool_load64(&ring->head);
+    }
+}
+
+
+/* producer hands over a filled slot to consumers */
+#define ring_publish(slot, pos)  pool_store64(&(slot)->seq, (pos) + 1)
+
+/* consumer gives back a slot to producers */
+#define ring_release(ring, slot, pos)  pool_store64(&(slot)->seq, (pos) + (ub8)(ring)->size)
+
+/**
+ * ring_released
+ *   notify the longest waiting producer after slots were released.
+ *   the full barrier orders the release before reading full_waiters, and
+ *   pairs with the increment in threadpool_add_timed.
+ */
+static void ring_released (threadpool_t *pool)
+{
+    pool_full_barrier();
+
+    if (pool_load32(&pool->full_waiters) > 0) {
+        pthread_mutex_lock(&pool->full_lock);
+        if (pool->waiters_head) {
+            pthread_cond_signal(&pool->waiters_head->cond);
+        }
+        pthread_mutex_unlock(&pool->full_lock);
+    }
+}
+
+
+/* hint only: whether the slot at head has been published */
+#define ring_ready(ring)  \
+    (pool_load64(&threadpool_slot_at(ring, pool_load64(&(ring)->head))->seq) == pool_load64(&(ring)->head) + 1)
+
+
+/**
+ * deque_push
+ *   owner pushes a task at bottom. returns 0 if deque is full.
+ */
+static int deque_push (threadpool_t *pool, threadpool_deque_t *dq, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    threadpool_task_t *ptask;
+
+    sb8 b = dq->bottom;
+    sb8 t = (sb8) pool_load64(&dq->top);
+
+    if (b - t >= pool->deque_size) {
+        return 0;
+    }
+
+    ptask = threadpool_deque_task(pool, dq, b);
+
+    ptask->function = function;
+    ptask->argument = argument;
+    ptask->flags = flags;
+    ptask->arg_size = arg_size;
+
+    if (arg_size > 0) {
+        memcpy((void*) ptask->task_arg, task_arg, arg_size);
+    }
+
+    pool_store64(&dq->bottom, b + 1);
+    return 1;
+}
+
+
+/**
+ * deque_pop
+ *   owner pops the newest task at bottom into taskcpy. returns 0 if empty.
+ */
+static int deque_pop (threadpool_t *pool, threadpool_deque_t *dq, threadpool_task_t *taskcpy)
+{
+    sb8 t, b = dq->bottom - 1;
+
+    pool_store64(&dq->bottom, b);
+
+    /* order the bottom store before reading top, pairs with deque_steal */
+    pool_full_barrier();
+
+    t = (sb8) pool_load64(&dq->top);
+
+    if (t > b) {
+        /* empty */
+        pool_store64(&dq->bottom, b + 1);
+        return 0;
+    }
+
+    threadpool_task_copy(pool, taskcpy, threadpool_deque_task(pool, dq, b));
+
+    if (t == b) {
+        /* last one: race against thieves */
+        int won = pool_cas64(&dq->top, t, t + 1);
+        pool_store64(&dq->bottom, b + 1);
+        return won;
+    }
+
+    return 1;
+}
+
+
+/**
+ * deque_steal
+ *   thief takes the oldest task at top into taskcpy. returns 0 if empty
+ *   or lost the race.
+ */
+static int deque_steal (threadpool_t *pool, threadpool_deque_t *dq, threadpool_task_t *taskcpy)
+{
+    sb8 b, t = (sb8) pool_load64(&dq->top);
+
+    pool_full_barrier();
+
+    b = (sb8) pool_load64(&dq->bottom);
+
+    if (t >= b) {
+        return 0;
+    }
+
+    threadpool_task_copy(pool, taskcpy, threadpool_deque_task(pool, dq, t));
+
+    return pool_cas64(&dq->top, t, t + 1);
+}
+
+
+#define deque_ready(dq)  ((sb8) pool_load64(&(dq)->top) < (sb8) pool_load64(&(dq)->bottom))
+
+
+/**
+ * threadpool_steal
+ *   try every other worker once, starting from a random victim.
+ */
+static int threadpool_steal (threadpool_t *pool, thread_context_t *thread_ctx, threadpool_task_t *taskcpy)
+{
+    int i, n, victim;
+    threadpool_deque_t *self = &pool->workers[thread_ctx->id - 1].deque;
+
+    /* xorshift32 */
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+
+    /* slots of retired workers have empty deques */
+    n = pool_load32(&pool->num_workers);
+    victim = (int) (self->seed % (ub4) n);
+
+    for (i = 0; i < n; i++, victim++) {
+        if (victim == n) {
+            victim = 0;
+        }
+
+        if (victim != thread_ctx->id - 1 && deque_steal(pool, &pool->workers[victim].deque, taskcpy)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* heap node a goes before b */
+#define heap_before(a, b)  \
+    ((a)->deadline < (b)->deadline || ((a)->deadline == (b)->deadline && (a)->seq < (b)->seq))
+
+
+/**
+ * heap_push
+ *   add copy of task with deadline. returns 0 if heap is full.
+ */
+static int heap_push (threadpool_t *pool, threadpool_heap_t *heap, ub8 deadline, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    int i, parent;
+    threadpool_heap_node_t node;
+    threadpool_task_t *ptask;
+
+    pthread_mutex_lock(&heap->lock);
+
+    if (heap->len == heap->size) {
+        pthread_mutex_unlock(&heap->lock);
+        return 0;
+    }
+
+    node.deadline = deadline;
+    node.seq = heap->seq++;
+    node.cell = heap->free_cells[--heap->free_top];
+
+    ptask = threadpool_task_cell(pool, heap->cells, node.cell);
+
+    ptask->function = function;
+    ptask->argument = argument;
+    ptask->flags = flags;
+    ptask->arg_size = arg_size;
+
+    if (arg_size > 0) {
+        memcpy((void*) ptask->task_arg, task_arg, arg_size);
+    }
+
+    /* sift up */
+    for (i = heap->len; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+
+        if (!heap_before(&node, &heap->nodes[parent])) {
+            break;
+        }
+        heap->nodes[i] = heap->nodes[parent];
+    }
+    heap->nodes[i] = node;
+
+    /* pool->count += 1; */
+    pool_count_add(pool);
+
+    pool_store32(&heap->len, heap->len + 1);
+
+    pthread_mutex_unlock(&heap->lock);
+    return 1;
+}
+
+
+/**
+ * heap_pop
+ *   take the task with earliest deadline into taskcpy. returns 0 if empty.
+ */
+static int heap_pop (threadpool_t *pool, threadpool_heap_t *heap, threadpool_task_t *taskcpy, ub8 *deadline)
+{
+    int i, child, len;
+    threadpool_heap_node_t top, last;
+
+    if (pool_load32(&heap->len) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+
+    if (heap->len == 0) {
+        pthread_mutex_unlock(&heap->lock);
+        return 0;
+    }
+
+    top = heap->nodes[0];
+    len = heap->len - 1;
+    last = heap->nodes[len];
+
+    /* sift down */
+    for (i = 0; (child = 2 * i + 1) < len; i = child) {
+        if (child + 1 < len && heap_before(&heap->nodes[child + 1], &heap->nodes[child])) {
+            child++;
+        }
+
+        if (!heap_before(&heap->nodes[child], &last)) {
+            break;
+        }
+        heap->nodes[i] = heap->nodes[child];
+    }
+    heap->nodes[i] = last;
+
+    pool_store32(&heap->len, len);
+
+    threadpool_task_copy(pool, taskcpy, threadpool_task_cell(pool, heap->cells, top.cell));
+    heap->free_cells[heap->free_top++] = top.cell;
+
+    /* pool->count -= 1; */
+    pool_count_sub(pool);
+
+    pthread_mutex_unlock(&heap->lock);
+
+    *deadline = top.deadline;
+    return 1;
+}
+
+
+/* hint only: whether any task may be taken by an idle worker */
+static int threadpool_has_work (threadpool_t *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->num_rings; i++) {
+        if (ring_ready(&pool->rings[i])) {
+            return 1;
+        }
+    }
+
+    if (pool_stealing(pool)) {
+        for (i = 0; i < pool_load32(&pool->num_workers); i++) {
+            if (deque_ready(&pool->workers[i].deque)) {
+                return 1;
+            }
+        }
+    }
+
+    if (pool->heap && pool_load32(&pool->heap->len) > 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * threadpool_local_ring
+ *   index of the ring in a lane a producer on current thread adds to first:
+ *   ring of its worker, or ring of the numa node it is running on.
+ */
+static int threadpool_local_ring (threadpool_t *pool)
+{
+    if (pool->lane_rings == 1) {
+        return 0;
+    }
+
+    if (pool_is_worker(pool)) {
+        return pool->workers[pool_current_ctx->id - 1].ring;
+    }
+
+#if defined(POOL_HAS_NUMA)
+    do {
+        int cpu = sched_getcpu();
+
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            return pool->cpu_ring[cpu];
+        }
+    } while(0);
+#endif
+
+    return 0;
+}
+
+
+#if defined(POOL_HAS_FUTEX)
+
+/* pop the worker on top of idle stack, returns NULL if none. pool->lock held */
+static threadpool_worker_t * idle_pop (threadpool_t *pool)
+{
+    threadpool_worker_t *worker;
+
+    if (pool->idle_top < 0) {
+        return NULL;
+    }
+
+    worker = &pool->workers[pool->idle_top];
+    pool->idle_top = worker->idle_next;
+
+    pool_atomic_dec(&pool->sleepers);
+    return worker;
+}
+
+
+/* remove the given worker from idle stack, returns 0 if not in it. pool->lock held */
+static int idle_remove (threadpool_t *pool, int index)
+{
+    int *link = &pool->idle_top;
+
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = pool->workers[index].idle_next;
+            pool_atomic_dec(&pool->sleepers);
+            return 1;
+        }
+        link = &pool->workers[*link].idle_next;
+    }
+
+    return 0;
+}
+
+#endif
+
+
+static int threadpool_start_worker (threadpool_t *pool, int i, pthread_attr_t *attr);
+static void threadpool_slot_free (threadpool_t *pool, thread_context_t *thread_ctx);
+
+
+/**
+ * threadpool_retire
+ *   whether the calling idle worker leaves the pool: it is above target
+ *   after threadpool_resize, or it was idle for idle_nsec with more than
+ *   min_threads running. if so it is no more counted. pool->lock held.
+ */
+static int threadpool_retire (threadpool_t *pool, thread_context_t *thread_ctx, int idle)
+{
+    int i;
+
+    if (pool_is_shutdown(pool)) {
+        return 0;
+    }
+
+    if (pool->thread_count <= pool->target) {
+        if (!idle || pool->thread_count <= pool->min_threads) {
+            return 0;
+        }
+        pool_store32(&pool->target, pool->thread_count - 1);
+    }
+
+    pool->workers[thread_ctx->id - 1].state = POOL_WORKER_EXITED;
+    pool_store32(&pool->thread_count, pool->thread_count - 1);
+
+    /* its deque and batch are empty: scan no slot above the last one running */
+    for (i = pool->num_workers; i > 0 && pool->workers[i - 1].state != POOL_WORKER_RUN; i--) {
+    }
+    pool_store32(&pool->num_workers, i);
+
+    return 1;
+}
+
+
+/**
+ * threadpool_slot_free
+ *   last step of a retired worker: nobody joins it, its slot is given
+ *   back to threadpool_grow. it touches no pool memory after this.
+ */
+static void threadpool_slot_free (threadpool_t *pool, thread_context_t *thread_ctx)
+{
+    pthread_detach(pthread_self());
+
+    pthread_mutex_lock(&pool->lock);
+    pool->workers[thread_ctx->id - 1].state = POOL_WORKER_OFF;
+    pthread_cond_broadcast(&pool->worker_gone);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * threadpool_grow
+ *   start one more worker in the first free slot. pool->lock held.
+ *   if the free slots are left by retired workers still running
+ *   thread_fini, wait for one to leave if wait, else return 1.
+ */
+static int threadpool_grow (threadpool_t *pool, int wait)
+{
+    int i, err;
+    pthread_attr_t attr;
+    threadpool_worker_t *worker;
+    size_t deque_bytes = pool_stealing(pool)? (size_t) pool->task_stride * pool->deque_size : 0;
+    size_t batch_bytes = (pool->batch_max > 1)? (size_t) pool->task_stride * pool->batch_max : 0;
+
+    for (;;) {
+        int leaving = 0;
+
+        for (i = 0; i < pool->max_threads && pool->workers[i].state != POOL_WORKER_OFF; i++) {
+            leaving += (pool->workers[i].state == POOL_WORKER_EXITED);
+        }
+
+        if (i < pool->max_threads) {
+            break;
+        }
+        if (!leaving) {
+            return threadpool_invalid;
+        }
+        if (!wait) {
+            return 1;
+        }
+
+        pthread_cond_wait(&pool->worker_gone, &pool->lock);
+
+        if (pool_is_shutdown(pool)) {
+            return threadpool_shutdown;
+        }
+    }
+
+    worker = &pool->workers[i];
+
+    if ((deque_bytes && !worker->deque.tasks) || (batch_bytes && !worker->batch)) {
+        worker->tasks = (unsigned char *) pool_aligned_alloc(pool->task_arg_align > POOL_CACHELINE_SIZE? pool->task_arg_align : POOL_CACHELINE_SIZE, deque_bytes + batch_bytes);
+        if (!worker->tasks) {
+            return threadpool_out_memory;
+        }
+        worker->deque.tasks = deque_bytes? worker->tasks : NULL;
+        worker->batch = batch_bytes? worker->tasks + deque_bytes : NULL;
+    }
+
+    /* deque keeps its positions: stealers may still look at it */
+    worker->wake = 0;
+    worker->idle_next = -1;
+    worker->batch_next = worker->batch_len = 0;
+    worker->nested = 0;
+
+    if (pthread_attr_init_config(&attr, pool->stack_size, PTHREAD_SCOPE_SYSTEM, PTHREAD_CREATE_JOINABLE) != 0) {
+        return threadpool_run_failure;
+    }
+
+    err = threadpool_start_worker(pool, i, &attr);
+
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
+
+/**
+ * threadpool_busy
+ *   a task was added with every worker busy. below target (lazy startup)
+ *   start one more worker at once. else once tasks keep coming with no
+ *   worker idle for spawn_nsec, so that they wait in the queue, start
+ *   one more worker, up to max_threads.
+ */
+static void threadpool_busy (threadpool_t *pool)
+{
+    ub8 now, since;
+
+    if (pool_load32(&pool->thread_count) < pool_load32(&pool->target)) {
+        if (pthread_mutex_lock(&pool->lock) == 0) {
+            /* no retry for every task if threads cannot be created */
+            if (!pool_is_shutdown(pool) && pool->thread_count < pool->target && threadpool_grow(pool, 0) < 0) {
+                pool_store32(&pool->target, pool->thread_count);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return;
+    }
+
+    if (!pool->spawn_nsec || pool_load32(&pool->thread_count) >= pool->max_threads) {
+        return;
+    }
+
+    now = pool_now_nsec();
+    since = pool_load64(&pool->busy_since);
+
+    if (since == 0) {
+        pool_cas64(&pool->busy_since, 0, now);
+        return;
+    }
+
+    /* one producer grows the pool per period */
+    if (now - since < pool->spawn_nsec || !pool_cas64(&pool->busy_since, since, now)) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&pool->lock) == 0) {
+        if (!pool_is_shutdown(pool) && pool->thread_count < pool->max_threads) {
+            if (pool->target <= pool->thread_count) {
+                pool_store32(&pool->target, pool->thread_count + 1);
+            }
+            if (threadpool_grow(pool, 0) < 0) {
+                pool_store32(&pool->target, pool->thread_count);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+/**
+ * threadpool_wakeup
+ *   wake up at most n parked workers after n tasks have been published.
+ *   the full barrier orders the publish before reading sleepers, and
+ *   pairs with the one in threadpool_park: either the worker sees the
+ *   task, or we see the worker and wake it under the lock.
+ */
+static int threadpool_wakeup (threadpool_t *pool, int n)
+{
+    int err = 0;
+
+    pool_full_barrier();
+
+    if (pool_load32(&pool->sleepers) == 0) {
+        /* every worker is busy: no syscall */
+        threadpool_busy(pool);
+        return 0;
+    }
+
+#if defined(POOL_HAS_FUTEX)
+    if (pool->park_mode == THREADPOOL_PARK_FUTEX) {
+        threadpool_worker_t *worker;
+
+        while (n-- > 0 && pool_load32(&pool->sleepers) > 0) {
+            if (pthread_mutex_lock(&pool->lock) != 0) {
+                return threadpool_lock_failure;
+            }
+            worker = idle_pop(pool);
+            if (worker) {
+                pool_store32(&worker->wake, 1);
+            }
+            pthread_mutex_unlock(&pool->lock);
+
+            if (!worker) {
+                break;
+            }
+            pool_futex_wake(&worker->wake, 1);
+        }
+
+        return 0;
+    }
+#endif
+
+    if (pthread_mutex_lock(&pool->lock) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    if (n >= pool_load32(&pool->sleepers)) {
+        if (pthread_cond_broadcast(&pool->notify) != 0) {
+            err = threadpool_lock_failure;
+        }
+    } else {
+        while (n-- > 0) {
+            if (pthread_cond_signal(&pool->notify) != 0) {
+                err = threadpool_lock_failure;
+            }
+        }
+    }
+
+    if (pthread_mutex_unlock(&pool->lock) != 0) {
+        err = threadpool_lock_failure;
+    }
+
+    return err;
+}
+
+
+/**
+ * threadpool_wakeall
+ *   wake up every parked worker, to shut down or to retire. pool->lock held.
+ */
+static int threadpool_wakeall (threadpool_t *pool)
+{
+    int err = 0;
+
+    if (pthread_cond_broadcast(&(pool->notify)) != 0) {
+        err = threadpool_lock_failure;
+    }
+
+#if defined(POOL_HAS_FUTEX)
+    if (pool->park_mode == THREADPOOL_PARK_FUTEX) {
+        threadpool_worker_t *worker;
+
+        while ((worker = idle_pop(pool)) != NULL) {
+            pool_store32(&worker->wake, 1);
+            pool_futex_wake(&worker->wake, 1);
+        }
+    }
+#endif
+
+    return err;
+}
+
+
+/**
+ * threadpool_park
+ *   park the calling worker until a task is ready or pool is shutting down.
+ *   returns 1 if the worker retires instead (see threadpool_retire).
+ */
+static int threadpool_park (threadpool_t *pool, thread_context_t *thread_ctx)
+{
+    int i, retired = 0;
+
+    if (pool_load64(&pool->busy_since)) {
+        pool_store64(&pool->busy_since, 0);
+    }
+
+    /* a task may come soon: poll before paying for sleep and wakeup */
+    for (i = 0; i < pool->spin_count; i++) {
+        if (threadpool_has_work(pool) || pool_is_shutdown(pool)) {
+            return 0;
+        }
+        pool_cpu_relax();
+    }
+
+#if defined(POOL_HAS_FUTEX)
+    if (pool->park_mode == THREADPOOL_PARK_FUTEX) {
+        int index = thread_ctx->id - 1;
+        threadpool_worker_t *worker = &pool->workers[index];
+
+        struct timespec ts;
+
+        pthread_mutex_lock(&pool->lock);
+
+        /* under lock: threadpool_resize lowers target before it empties
+           the idle stack, we are not missed once on it */
+        if (pool->thread_count > pool->target && threadpool_retire(pool, thread_ctx, 0)) {
+            pthread_mutex_unlock(&pool->lock);
+            return 1;
+        }
+
+        worker->wake = 0;
+        worker->idle_next = pool->idle_top;
+        pool->idle_top = index;
+
+        /* full barrier, pairs with threadpool_wakeup */
+        pool_atomic_inc(&pool->sleepers);
+
+        pthread_mutex_unlock(&pool->lock);
+
+        for (;;) {
+            if (threadpool_has_work(pool) || pool_is_shutdown(pool)) {
+                pthread_mutex_lock(&pool->lock);
+                i = idle_remove(pool, index);
+                pthread_mutex_unlock(&pool->lock);
+
+                if (i) {
+                    return 0;
+                }
+
+                /* a producer popped us already: its wake is on the way */
+            }
+
+            if (!pool->idle_nsec) {
+                while (pool_load32(&worker->wake) == 0) {
+                    pool_futex_wait(&worker->wake, 0);
+                }
+                return 0;
+            }
+
+            ts.tv_sec = (time_t) (pool->idle_nsec / 1000000000ULL);
+            ts.tv_nsec = (long) (pool->idle_nsec % 1000000000ULL);
+
+            if (pool_load32(&worker->wake) ||
+                pool_futex_wait_timed(&worker->wake, 0, &ts) == 0 || errno != ETIMEDOUT) {
+                if (pool_load32(&worker->wake)) {
+                    return 0;
+                }
+                continue;
+            }
+
+            pthread_mutex_lock(&pool->lock);
+
+            i = idle_remove(pool, index);
+
+            if (i && threadpool_retire(pool, thread_ctx, 1)) {
+                pthread_mutex_unlock(&pool->lock);
+                return 1;
+            }
+
+            if (i) {
+                /* still needed: back on top of idle stack */
+                worker->idle_next = pool->idle_top;
+                pool->idle_top = index;
+                pool_atomic_inc(&pool->sleepers);
+            }
+
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+#endif
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool_atomic_inc(&pool->sleepers);
+
+    /* Wait on condition variable, check for spurious wakeups.
+       When returning from pthread_cond_wait(), we own the lock. */
+    while (!threadpool_has_work(pool) && !pool_is_shutdown(pool)) {
+        if (pool->thread_count > pool->target && threadpool_retire(pool, thread_ctx, 0)) {
+            retired = 1;
+            break;
+        }
+
+        if (pool->idle_nsec) {
+            struct timespec abstime;
+
+            pool_abstime(&abstime, pool->idle_nsec);
+
+            if (pthread_cond_timedwait(&pool->notify, &pool->lock, &abstime) == ETIMEDOUT &&
+                !threadpool_has_work(pool) && threadpool_retire(pool, thread_ctx, 1)) {
+                retired = 1;
+                break;
+            }
+        } else {
+            pthread_cond_wait(&pool->notify, &pool->lock);
+        }
+    }
+
+    pool_atomic_dec(&pool->sleepers);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return retired;
+}
+
+
+/**
+ * @function void *threadpool_run(void *threadpool)
+ * @brief the worker thread
+ * @param threadpool the pool which own the thread
+ */
+static void *threadpool_run (void *threadpool);
+
+int threadpool_free(threadpool_t *pool);
+
+
+#if defined(POOL_HAS_NUMA)
+
+/* arguments of threadpool_ring_touch */
+typedef struct threadpool_touch_t
+{
+    threadpool_ring_t *ring;
+    size_t bytes;
+} threadpool_touch_t;
+
+
+/**
+ * threadpool_ring_touch
+ *   first touch of slots of a node ring. runs on a thread pinned to cpus
+ *   of the node, so that kernel backs the pages with memory of the node.
+ */
+static void * threadpool_ring_touch (void *arg)
+{
+    ub8 i;
+    threadpool_touch_t *touch = (threadpool_touch_t *) arg;
+
+    memset(touch->ring->slots, 0, touch->bytes);
+
+    for (i = 0; i < (ub8) touch->ring->size; i++) {
+        threadpool_slot_at(touch->ring, i)->seq = i;
+    }
+
+    return 0;
+}
+
+
+/**
+ * threadpool_ring_map
+ *   map slots of ring for numa node. returns 0 on success.
+ */
+static int threadpool_ring_map (threadpool_ring_t *ring, const cputopo_node_t *node)
+{
+    pthread_t toucher;
+    pthread_attr_t attr;
+    threadpool_touch_t touch;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    touch.ring = ring;
+    touch.bytes = (size_t) ring->slot_size * ring->size;
+
+    ring->mapped = pool_align_size(touch.bytes, (size_t) pagesize);
+
+    ring->slots = (unsigned char *) mmap(NULL, ring->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->slots == (unsigned char *) MAP_FAILED) {
+        ring->slots = NULL;
+        ring->mapped = 0;
+        return -1;
+    }
+
+    if (pthread_attr_init(&attr) != 0) {
+        return -1;
+    }
+
+    if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), (cpu_set_t *) &node->cpus) != 0 ||
+        pthread_create(&toucher, &attr, threadpool_ring_touch, &touch) != 0) {
+        pthread_attr_destroy(&attr);
+
+        /* not node local, but still usable */
+        threadpool_ring_touch(&touch);
+        return 0;
+    }
+
+    pthread_join(toucher, NULL);
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+#endif
+
+
+/* stack bytes left to frames of worker below touched stack */
+#define POOL_STACK_RESERVE  65536
+
+/* stride of touching stack: smallest page size */
+#define POOL_PAGE_SIZE      4096
+
+#if defined(POOL_HAS_MMAP)
+
+/**
+ * threadpool_ring_populate
+ *   map slots of ring with pages faulted in (prewarm). returns 0 on
+ *   success.
+ */
+static int threadpool_ring_populate (threadpool_ring_t *ring)
+{
+    ub8 i;
+    size_t bytes = (size_t) ring->slot_size * ring->size;
+
+    ring->mapped = pool_align_size(bytes, (size_t) sysconf(_SC_PAGESIZE));
+
+    ring->slots = (unsigned char *) mmap(NULL, ring->mapped, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring->slots == (unsigned char *) MAP_FAILED) {
+        ring->slots = NULL;
+        ring->mapped = 0;
+        return -1;
+    }
+
+    for (i = 0; i < (ub8) ring->size; i++) {
+        threadpool_slot_at(ring, i)->seq = i;
+    }
+
+    return 0;
+}
+
+#endif
+
+
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+
+/**
+ * threadpool_worker_cpus
+ *   cpus the i-th worker is pinned to. returns 0 if worker is not pinned.
+ *
+ *   placement policy first (within numa node of the worker in numa mode),
+ *   then numa node, then groups of affinity_cpus.
+ */
+static int threadpool_worker_cpus (threadpool_t *pool, int i, int affinity_cpus, cpu_set_t *cpuset)
+{
+#if defined(POOL_HAS_CPUTOPO)
+    if (pool->cpus) {
+        const cpu_set_t *within = NULL;
+        int index = i;
+
+# if defined(POOL_HAS_NUMA)
+        if (pool->nodes) {
+            within = &pool->nodes[pool->workers[i].ring].cpus;
+            index = i / pool->lane_rings;
+        }
+# endif
+
+        if (cputopo_place(pool->cpus, pool->num_cpus, pool->affinity, index, within, cpuset) > 0) {
+            return 1;
+        }
+    }
+#endif
+
+#if defined(POOL_HAS_NUMA)
+    if (pool->nodes) {
+        /* worker stays on node of its ring */
+        memcpy(cpuset, &pool->nodes[pool->workers[i].ring].cpus, sizeof(cpu_set_t));
+        return 1;
+    }
+#endif
+
+    if (pool->group_cpus) {
+        memcpy(cpuset, &pool->group_cpus[(i + 1) % pool->num_groups], sizeof(cpu_set_t));
+        return 1;
+    }
+
+    if (affinity_cpus > 0) {
+        thread_set_affinity_cpus(i + 1, affinity_cpus, cpuset);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * threadpool_group_cpus
+ *   cpus of every group of affinity_cpus, so that starting a worker does
+ *   not read the allowed cpus again. groups repeat by (id % num_groups),
+ *   see thread_set_affinity_cpus.
+ */
+static int threadpool_group_cpus (threadpool_t *pool, int affinity_cpus)
+{
+    int g, cpus;
+    cpu_set_t cpuset;
+
+    cpus = thread_set_affinity_cpus(0, affinity_cpus, &cpuset);
+
+    if (affinity_cpus == -1 || affinity_cpus > POOL_CPU_ID_MAX) {
+        affinity_cpus = POOL_CPU_ID_MAX + 1;
+    }
+
+    pool->num_groups = (cpus / affinity_cpus < 1)? 1 : cpus / affinity_cpus;
+
+    pool->group_cpus = (cpu_set_t *) malloc(sizeof(cpu_set_t) * pool->num_groups);
+    if (!pool->group_cpus) {
+        return threadpool_out_memory;
+    }
+
+    for (g = 0; g < pool->num_groups; g++) {
+        thread_set_affinity_cpus(g, affinity_cpus, &pool->group_cpus[g]);
+    }
+
+    return 0;
+}
+
+#endif
+
+
+/**
+ * threadpool_spawn
+ *   create thread of worker in slot i (0 based), pinned by attr.
+ */
+static int threadpool_spawn (threadpool_t *pool, int i, pthread_attr_t *attr)
+{
+    thread_context_t *pctx = &pool->thread_ctxs[i];
+
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+    cpu_set_t cpuset;
+
+    if (threadpool_worker_cpus(pool, i, pool->affinity_cpus, &cpuset)) {
+        if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpuset) != 0) {
+            printf("pthread_attr_setaffinity_np error: %s\n", strerror(errno));
+            return threadpool_run_failure;
+        }
+    }
+#endif
+
+    /* a worker without it could not take tasks: fail here */
+    pool->workers[i].cell = (unsigned char *) pool_aligned_alloc(pool->task_arg_align, pool->task_stride);
+    if (!pool->workers[i].cell) {
+        return threadpool_out_memory;
+    }
+
+    if (pthread_create(&pctx->thread, attr, threadpool_run, (void*) pctx) != 0) {
+        pool_aligned_free(pool->workers[i].cell);
+        pool->workers[i].cell = NULL;
+        return threadpool_run_failure;
+    }
+
+    return 0;
+}
+
+
+/**
+ * threadpool_unstart
+ *   worker in slot i counted running did not start. pool->lock held.
+ */
+static void threadpool_unstart (threadpool_t *pool, int i)
+{
+    int n;
+
+    pool_atomic_dec(&pool->started);
+    pool->workers[i].state = POOL_WORKER_OFF;
+    pool_store32(&pool->thread_count, pool->thread_count - 1);
+
+    for (n = pool->num_workers; n > 0 && pool->workers[n - 1].state != POOL_WORKER_RUN; n--) {
+    }
+    pool_store32(&pool->num_workers, n);
+}
+
+
+/**
+ * threadpool_start_worker
+ *   start worker thread in slot i (0 based). it is counted running before
+ *   it runs, so that its deque is scanned. pool->lock held once the pool
+ *   has workers.
+ */
+static int threadpool_start_worker (threadpool_t *pool, int i, pthread_attr_t *attr)
+{
+    pool->workers[i].state = POOL_WORKER_RUN;
+    pool_store32(&pool->thread_count, pool->thread_count + 1);
+    if (pool->num_workers <= i) {
+        pool_store32(&pool->num_workers, i + 1);
+    }
+    pool_atomic_inc(&pool->started);
+
+    if (threadpool_spawn(pool, i, attr) != 0) {
+        threadpool_unstart(pool, i);
+        return threadpool_run_failure;
+    }
+
+    return 0;
+}
+
+
+/**
+ * threadpool_start_parallel
+ *   THREADPOOL_STARTUP_PARALLEL: threadpool_create and every new worker
+ *   take the next slots to start, so threads are created by a growing
+ *   number of threads. slots are counted running by threadpool_create.
+ */
+static void threadpool_start_parallel (threadpool_t *pool)
+{
+    int i, attr_err;
+    pthread_attr_t attr;
+
+    /* attr is set per slot: one each */
+    attr_err = pthread_attr_init_config(&attr, pool->stack_size, PTHREAD_SCOPE_SYSTEM, PTHREAD_CREATE_JOINABLE);
+
+    while ((i = pool_atomic_inc(&pool->start_next) - 1) < pool->start_count) {
+        if (attr_err || threadpool_spawn(pool, i, &attr) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            threadpool_unstart(pool, i);
+            pool->start_failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        if (pool_atomic_inc(&pool->start_done) == pool->start_count) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->notify);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    if (!attr_err) {
+        pthread_attr_destroy(&attr);
+    }
+}
+
+
+threadpool_t *threadpool_create(int thread_count, int queue_size, int stack_size, int affinity_cpus, void **thread_args, size_t task_arg_size)
+{
+    return threadpool_create_ex(thread_count, queue_size, stack_size, affinity_cpus, thread_args, task_arg_size, NULL);
+}
+
+
+threadpool_t *threadpool_create_ex(int thread_count, int queue_size, int stack_size, int affinity_cpus, void **thread_args, size_t task_arg_size, const threadpool_opts_t *opts)
+{
+    int i, slot_size, slot_offset, lane_rings = 1, num_lanes, num_rings;
+    int min_threads, max_threads;
+    int arg_align = (int) sizeof(ub8), blk_align;
+    size_t rings_offset, slots_offset, slots_bytes;
+
+    threadpool_t *pool = NULL;
+
+#if defined(POOL_HAS_NUMA)
+    cputopo_node_t *nodes = NULL;
+#endif
+
+    pthread_attr_t attr;
+
+    threadpool_opts_t defopts = {0};
+
+    if (!opts) {
+        opts = &defopts;
+    }
+
+    if (opts->queue_mode != THREADPOOL_QUEUE_MUTEX && opts->queue_mode != THREADPOOL_QUEUE_LOCKFREE) {
+        goto err;
+    }
+
+    if (opts->sched_mode != THREADPOOL_SCHED_FIFO && opts->sched_mode != THREADPOOL_SCHED_STEAL &&
+        opts->sched_mode != THREADPOOL_SCHED_EDF) {
+        goto err;
+    }
+
+    if (opts->deque_size < 0 || opts->deque_size > POOL_MAX_QUEUES) {
+        goto err;
+    }
+
+    if (opts->batch_min < 0 || opts->batch_max < 0 || opts->batch_max > POOL_MAX_QUEUES ||
+        (opts->batch_max && opts->batch_min > opts->batch_max)) {
+        goto err;
+    }
+
+    /* a batch is made of task copies */
+    if (opts->inplace && opts->batch_max > 1) {
+        goto err;
+    }
+
+    if ((opts->park_mode != THREADPOOL_PARK_CONDVAR && opts->park_mode != THREADPOOL_PARK_FUTEX) ||
+        opts->spin_count < 0) {
+        goto err;
+    }
+
+    if (opts->affinity < THREADPOOL_AFFINITY_GROUPS || opts->affinity > THREADPOOL_AFFINITY_NOSMT) {
+        goto err;
+    }
+
+    if (opts->lanes < 0 || opts->lanes > POOL_MAX_LANES || opts->aging_msec < 0) {
+        goto err;
+    }
+
+    if (opts->startup < THREADPOOL_STARTUP_EAGER || opts->startup > THREADPOOL_STARTUP_LAZY) {
+        goto err;
+    }
+
+    if (stack_size < 0 || opts->prewarm_stack < 0) {
+        goto err;
+    }
+
+    /* checked even when thread_count is given */
+    if (opts->blocking_ratio < 0 || opts->blocking_ratio > 99) {
+        goto err;
+    }
+
+    /* Check thread_count for negative or otherwise very big input parameters */
+    if (thread_count < 0 || thread_count > POOL_MAX_THREADS) {
+        goto err;
+    }
+    if (thread_count == 0) {
+        thread_count = threadpool_auto_threads(opts->blocking_ratio);
+        if (thread_count < 0) {
+            goto err;
+        }
+    }
+
+    /* elastic: thread_count starts in [min_threads, max_threads] */
+    min_threads = opts->min_threads? opts->min_threads : thread_count;
+    max_threads = opts->max_threads? opts->max_threads : thread_count;
+
+    if (min_threads < 1 || min_threads > thread_count ||
+        max_threads < thread_count || max_threads > POOL_MAX_THREADS ||
+        opts->idle_msec < 0 || opts->spawn_usec < 0) {
+        goto err;
+    }
+
+    /* Check queue_size for negative or otherwise very big input parameters */
+    if (queue_size < 0 || queue_size > POOL_MAX_QUEUES) {
+        goto err;
+    }
+
+    if (queue_size == 0) {
+        queue_size = POOL_DEFAULT_QUEUES;
+    }
+
+    /* Check task_arg_size for negative or otherwise very big input parameters */
+    if (task_arg_size == (size_t)(-1) || task_arg_size > POOL_TASK_ARG_SIZE_MAX) {
+        goto err;
+    }
+
+    if (opts->task_arg_align) {
+        /* power of 2 in [8, 4096] */
+        if (opts->task_arg_align < (int) sizeof(ub8) || opts->task_arg_align > 4096 ||
+            (opts->task_arg_align & (opts->task_arg_align - 1))) {
+            goto err;
+        }
+        arg_align = opts->task_arg_align;
+    }
+
+#if defined(POOL_HAS_NUMA)
+    if (opts->numa) {
+        nodes = (cputopo_node_t *) malloc(sizeof(cputopo_node_t) * CPUTOPO_NODES_MAX);
+        if (!nodes) {
+            goto err;
+        }
+
+        lane_rings = cputopo_numa_nodes(nodes, CPUTOPO_NODES_MAX);
+
+        if (lane_rings <= 0) {
+            /* no numa topology: one shared ring */
+            free(nodes);
+            nodes = NULL;
+            lane_rings = 1;
+        }
+    }
+#endif
+
+    num_lanes = opts->lanes? opts->lanes : 1;
+    num_rings = num_lanes * lane_rings;
+
+    blk_align = (arg_align > POOL_CACHELINE_SIZE)? arg_align : POOL_CACHELINE_SIZE;
+
+    /* header and task go right before task_arg, which starts aligned */
+    slot_offset = (int) (pool_align_size(sizeof(threadpool_slot_t) + sizeof(threadpool_task_t), arg_align) -
+            (sizeof(threadpool_slot_t) + sizeof(threadpool_task_t)));
+    slot_size = (int) pool_align_size(slot_offset + sizeof(threadpool_slot_t) + sizeof(threadpool_task_t) + task_arg_size, arg_align);
+
+    slots_bytes = (size_t) slot_size * queue_size * num_lanes;
+
+#if defined(POOL_HAS_NUMA)
+    if (nodes) {
+        /* slots of node rings are mapped per node */
+        slots_bytes = 0;
+    }
+#endif
+
+#if defined(POOL_HAS_MMAP)
+    if (opts->prewarm) {
+        /* slots of prewarmed rings are mapped populated */
+        slots_bytes = 0;
+    }
+#endif
+
+    rings_offset = pool_align_size(sizeof(threadpool_t) + sizeof(thread_context_t) * max_threads, blk_align);
+    slots_offset = pool_align_size(rings_offset + sizeof(threadpool_ring_t) * num_rings, blk_align);
+
+    /* create threadpool */
+    if ( (pool = (threadpool_t *) pool_aligned_alloc (blk_align, slots_offset + slots_bytes)) == NULL ) {
+#if defined(POOL_HAS_NUMA)
+        free(nodes);
+#endif
+        goto err;
+    }
+
+    /* zeroed header: threadpool_free releases only what was set up */
+    memset(pool, 0, slots_offset);
+
+#if defined(POOL_HAS_NUMA)
+    pool->nodes = nodes;
+#endif
+
+    /* Initialize mutex and conditional variable first */
+    if ((pthread_mutex_init (&(pool->lock), NULL) != 0) ||
+       (pthread_mutex_init (&(pool->full_lock), NULL) != 0) ||
+       (pthread_cond_init (&(pool->notify), NULL) != 0) ||
+       (pthread_cond_init (&(pool->waiters_gone), NULL) != 0) ||
+       (pthread_cond_init (&(pool->worker_gone), NULL) != 0)) {
+        goto err;
+    }
+
+    /* Initialize: thread_count counts workers as they start */
+    pool->thread_count = 0;
+    pool->num_workers = 0;
+    pool->max_threads = max_threads;
+    pool->min_threads = min_threads;
+    pool->target = thread_count;
+    pool->idle_nsec = (ub8) opts->idle_msec * 1000000ULL;
+    pool->spawn_nsec = (ub8) opts->spawn_usec * 1000ULL;
+    pool->busy_since = 0;
+    pool->affinity_cpus = affinity_cpus;
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+    pool->num_groups = 0;
+    pool->group_cpus = NULL;
+#endif
+    pool->startup = opts->startup;
+    pool->stack_size = stack_size;
+    pool->prewarm = opts->prewarm? 1 : 0;
+    pool->prewarm_stack = opts->prewarm_stack;
+    pool->warmup = opts->warmup;
+    pool->warmed = 0;
+    pool->start_next = pool->start_done = 0;
+    pool->start_count = 0;
+    pool->start_failed = 0;
+    pool->thread_init = opts->thread_init;
+    pool->thread_fini = opts->thread_fini;
+    pool->queue_size = queue_size;
+    pool->queue_mode = opts->queue_mode;
+    pool->sched_mode = opts->sched_mode;
+    pool->deque_size = opts->deque_size? opts->deque_size : POOL_DEFAULT_DEQUE_SIZE;
+    pool->inplace = opts->inplace? 1 : 0;
+    pool->task_arg_size = (int) task_arg_size;
+    pool->task_size = (int) (sizeof(threadpool_task_t) + task_arg_size);
+    pool->task_arg_align = arg_align;
+    pool->task_offset = (int) (pool_align_size(sizeof(threadpool_task_t), arg_align) - sizeof(threadpool_task_t));
+    pool->task_stride = (int) pool_align_size(pool->task_offset + pool->task_size, arg_align);
+    pool->batch_max = opts->batch_max? opts->batch_max : 1;
+    pool->batch_min = opts->batch_min? opts->batch_min : 1;
+    pool->workers = NULL;
+    pool->idle_top = -1;
+    pool->spin_count = opts->spin_count;
+#if defined(POOL_HAS_FUTEX)
+    pool->park_mode = opts->park_mode;
+#else
+    pool->park_mode = THREADPOOL_PARK_CONDVAR;
+#endif
+    pool->sleepers = pool->count = 0;
+    pool->full_waiters = 0;
+    pool->waiters_head = pool->waiters_tail = NULL;
+    pool->callers = pool->group_gate = 0;
+    pool->shutdown = pool->started = 0;
+
+    pool->num_lanes = num_lanes;
+    pool->lane_rings = lane_rings;
+    pool->lane_stats = opts->lanes? 1 : 0;
+    pool->aging_nsec = (ub8) (opts->aging_msec? opts->aging_msec : POOL_DEFAULT_AGING_MSEC) * 1000000ULL;
+
+    pool->heap = NULL;
+    pool->expired = opts->expired;
+    pool->wheel = NULL;
+    pool->futures = NULL;
+    pool->strands = NULL;
+
+    /* each lane (of each node) has its own ring */
+    pool->queue_size = queue_size * num_rings;
+
+    pool->rings = (threadpool_ring_t *) ((unsigned char *) pool + rings_offset);
+
+    /* num_rings counts rings with a lock */
+    for (i = 0; i < num_rings; i++) {
+        threadpool_ring_t *ring = &pool->rings[i];
+
+        if (pthread_mutex_init (&(ring->lock), NULL) != 0) {
+            goto err;
+        }
+        pool->num_rings = i + 1;
+
+        ring->head = ring->tail = 0;
+        ring->added = ring->taken = 0;
+        ring->wait_sum = ring->wait_max = 0;
+        ring->size = queue_size;
+        ring->slot_size = slot_size;
+        ring->slot_offset = slot_offset;
+        ring->slots = NULL;
+        ring->mapped = 0;
+    }
+
+#if defined(POOL_HAS_NUMA)
+    pool->cpu_ring = NULL;
+#endif
+
+    pool->affinity = opts->affinity;
+#if defined(POOL_HAS_CPUTOPO)
+    pool->num_cpus = 0;
+    pool->cpus = NULL;
+
+    if (pool->affinity != THREADPOOL_AFFINITY_GROUPS) {
+        pool->cpus = (cputopo_cpu_t *) malloc(sizeof(cputopo_cpu_t) * CPU_SETSIZE);
+        if (!pool->cpus) {
+            goto err;
+        }
+
+        pool->num_cpus = cputopo_cpus(pool->cpus, CPU_SETSIZE);
+    }
+#endif
+
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+    if (affinity_cpus > 0 && threadpool_group_cpus(pool, affinity_cpus) != 0) {
+        goto err;
+    }
+#endif
+
+#if defined(POOL_HAS_NUMA)
+    if (nodes) {
+        int cpu;
+
+        pool->cpu_ring = (int *) calloc(CPU_SETSIZE, sizeof(int));
+        if (!pool->cpu_ring) {
+            goto err;
+        }
+
+        for (i = 0; i < lane_rings; i++) {
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &nodes[i].cpus)) {
+                    pool->cpu_ring[cpu] = i;
+                }
+            }
+        }
+
+        for (i = 0; i < num_rings; i++) {
+            if (threadpool_ring_map(&pool->rings[i], &nodes[i % lane_rings]) != 0) {
+                goto err;
+            }
+        }
+    }
+#endif
+
+#if defined(POOL_HAS_MMAP)
+    if (!pool->rings[0].slots && opts->prewarm) {
+        for (i = 0; i < num_lanes; i++) {
+            if (threadpool_ring_populate(&pool->rings[i]) != 0) {
+                goto err;
+            }
+        }
+    }
+
+    if (opts->prewarm && opts->prewarm_mlock) {
+        /* populated or node rings: all mapped */
+        for (i = 0; i < num_rings; i++) {
+            if (mlock(pool->rings[i].slots, pool->rings[i].mapped) != 0) {
+                goto err;
+            }
+        }
+    }
+#endif
+
+    if (!pool->rings[0].slots) {
+        int lane;
+
+        for (lane = 0; lane < num_lanes; lane++) {
+            threadpool_ring_t *ring = &pool->rings[lane];
+
+            ring->slots = (unsigned char *) pool + slots_offset + (size_t) slot_size * queue_size * lane;
+
+            if (opts->prewarm) {
+                memset(ring->slots, 0, (size_t) slot_size * queue_size);
+            }
+
+            /* slot at position i is free for the i-th task */
+            for (i = 0; i < queue_size; i++) {
+                threadpool_slot_at(ring, i)->seq = (ub8) i;
+            }
+        }
+    }
+
+    do {
+        unsigned char *tasks;
+        size_t deque_bytes = pool_stealing(pool)? (size_t) pool->task_stride * pool->deque_size : 0;
+        size_t batch_bytes = (pool->batch_max > 1)? (size_t) pool->task_stride * pool->batch_max : 0;
+
+        size_t tasks_offset = pool_align_size(sizeof(threadpool_worker_t) * max_threads, blk_align);
+
+        pool->workers = (threadpool_worker_t *) pool_aligned_alloc(blk_align,
+            tasks_offset + (deque_bytes + batch_bytes) * thread_count);
+        if (!pool->workers) {
+            goto err;
+        }
+
+        tasks = (unsigned char *) pool->workers + tasks_offset;
+
+        if (opts->prewarm) {
+            memset(tasks, 0, (deque_bytes + batch_bytes) * thread_count);
+        }
+
+        /* slots above thread_count get their tasks once started */
+        for (i = 0; i < max_threads; i++) {
+            threadpool_worker_t *worker = &pool->workers[i];
+            thread_context_t *pctx = &pool->thread_ctxs[i];
+
+            worker->wake = 0;
+            worker->idle_next = -1;
+            worker->ring = i % lane_rings;
+            worker->state = POOL_WORKER_OFF;
+            worker->tasks = NULL;
+
+            worker->deque.top = worker->deque.bottom = 0;
+            worker->deque.seed = (ub4) (i + 1) * 2654435761U;
+            worker->deque.tasks = (deque_bytes && i < thread_count)? tasks : NULL;
+
+            worker->batch_next = worker->batch_len = 0;
+            worker->batch = (batch_bytes && i < thread_count)? tasks + deque_bytes : NULL;
+            worker->nested = 0;
+
+            if (i < thread_count) {
+                tasks += deque_bytes + batch_bytes;
+            }
+
+            /* set thread id: 1 based */
+            pctx->id = i + 1;
+
+            /* set pool to each thread context */
+            pctx->pool = (void*) pool;
+
+            /* assign thread argument if valid */
+            pctx->thread_arg = (thread_args && i < thread_count)? thread_args[i] : 0;
+        }
+    } while(0);
+
+    if (pool->sched_mode == THREADPOOL_SCHED_EDF) {
+        threadpool_heap_t *heap;
+
+        size_t nodes_offset = pool_align_size(sizeof(threadpool_heap_t), POOL_CACHELINE_SIZE);
+        size_t free_offset = nodes_offset + sizeof(threadpool_heap_node_t) * queue_size;
+        size_t cells_offset = pool_align_size(free_offset + sizeof(int) * queue_size, blk_align);
+
+        heap = (threadpool_heap_t *) pool_aligned_alloc(blk_align, cells_offset + (size_t) pool->task_stride * queue_size);
+        if (!heap) {
+            goto err;
+        }
+
+        if (pthread_mutex_init (&(heap->lock), NULL) != 0) {
+            pool_aligned_free(heap);
+            goto err;
+        }
+
+        heap->len = 0;
+        heap->size = queue_size;
+        heap->seq = 0;
+        heap->nodes = (threadpool_heap_node_t *) ((unsigned char *) heap + nodes_offset);
+        heap->free_cells = (int *) ((unsigned char *) heap + free_offset);
+        heap->cells = (unsigned char *) heap + cells_offset;
+
+        for (i = 0; i < queue_size; i++) {
+            heap->free_cells[i] = i;
+        }
+        heap->free_top = queue_size;
+
+        if (opts->prewarm) {
+            memset(heap->nodes, 0, sizeof(threadpool_heap_node_t) * queue_size);
+            memset(heap->cells, 0, (size_t) pool->task_stride * queue_size);
+        }
+
+        pool->heap = heap;
+
+        /* deadline tasks count in the queue capacity */
+        pool->queue_size += queue_size;
+    }
+
+    do {
+        threadpool_wheel_t *wheel = (threadpool_wheel_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_wheel_t));
+        if (!wheel) {
+            goto err;
+        }
+
+        memset(wheel, 0, sizeof(threadpool_wheel_t));
+
+        if (pthread_mutex_init (&(wheel->lock), NULL) != 0) {
+            pool_aligned_free(wheel);
+            goto err;
+        }
+
+        if (pthread_cond_init (&(wheel->notify), NULL) != 0) {
+            pthread_mutex_destroy (&(wheel->lock));
+            pool_aligned_free(wheel);
+            goto err;
+        }
+
+        wheel->start = pool_now_nsec();
+        wheel->wake = POOL_WHEEL_NEVER;
+
+        pool->wheel = wheel;
+    } while(0);
+
+    do {
+        threadpool_futures_t *futures = (threadpool_futures_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_futures_t));
+        if (!futures) {
+            goto err;
+        }
+
+        memset(futures, 0, sizeof(threadpool_futures_t));
+
+        if (pthread_mutex_init (&(futures->lock), NULL) != 0) {
+            pool_aligned_free(futures);
+            goto err;
+        }
+
+        if (pthread_cond_init (&(futures->notify), NULL) != 0) {
+            pthread_mutex_destroy (&(futures->lock));
+            pool_aligned_free(futures);
+            goto err;
+        }
+
+        pool->futures = futures;
+    } while(0);
+
+    do {
+        threadpool_strand_t *strands = (threadpool_strand_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_strand_t) * POOL_STRANDS);
+        if (!strands) {
+            goto err;
+        }
+
+        memset(strands, 0, sizeof(threadpool_strand_t) * POOL_STRANDS);
+
+        for (i = 0; i < POOL_STRANDS; i++) {
+            strands[i].ring = -1;
+
+            if (pthread_mutex_init (&(strands[i].lock), NULL) != 0) {
+                while (i-- > 0) {
+                    pthread_mutex_destroy (&(strands[i].lock));
+                }
+                pool_aligned_free(strands);
+                goto err;
+            }
+        }
+
+        pool->strands = strands;
+    } while(0);
+
+	/* http://man7.org/linux/man-pages/man3/pthread_create.3.html */
+	if (pthread_attr_init_config(&attr, stack_size, PTHREAD_SCOPE_SYSTEM, PTHREAD_CREATE_JOINABLE) != 0) {
+		goto err;
+	}
+
+    if (pool->prewarm && pool->prewarm_stack) {
+        size_t stack_bytes = 0;
+
+        /* the frames of worker need room below touched stack */
+        if (pthread_attr_getstacksize(&attr, &stack_bytes) != 0 ||
+            (size_t) pool->prewarm_stack + POOL_STACK_RESERVE > stack_bytes) {
+            pthread_attr_destroy(&attr);
+            goto err;
+        }
+    }
+
+    if (pool->startup == THREADPOOL_STARTUP_PARALLEL) {
+        /* each starting thread has its own attr */
+        pthread_attr_destroy(&attr);
+
+        /* all counted running first, workers help to start the others */
+        for (i = 0; i < thread_count; i++) {
+            pool->workers[i].state = POOL_WORKER_RUN;
+        }
+        pool->thread_count = pool->num_workers = pool->started = thread_count;
+        pool->start_count = thread_count;
+
+        threadpool_start_parallel(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool_load32(&pool->start_done) < pool->start_count) {
+            pthread_cond_wait(&pool->notify, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->start_failed) {
+            threadpool_destroy(pool);
+            return NULL;
+        }
+    } else {
+        /* Start worker threads: one if lazy, the others on demand */
+        for (i = 0; i < (pool->startup == THREADPOOL_STARTUP_LAZY? 1 : thread_count); i++) {
+            int err;
+
+            pthread_mutex_lock(&pool->lock);
+            err = threadpool_start_worker(pool, i, &attr);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (err) {
+                threadpool_destroy(pool);
+                pthread_attr_destroy(&attr);
+                return NULL;
+            }
+        }
+
+        /* Destroy the thread attributes object, since it is no longer needed */
+        if (pthread_attr_destroy(&attr) != 0) {
+            printf("pthread_attr_destroy error: %s\n", strerror(errno));
+            threadpool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    if (pool->prewarm) {
+        /* return at steady state: workers started are warm */
+        int warm = (pool->startup == THREADPOOL_STARTUP_LAZY)? 1 : thread_count;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->warmed < warm) {
+            pthread_cond_wait(&pool->notify, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return pool;
+
+ err:
+    if(pool) {
+        threadpool_free(pool);
+    }
+    return NULL;
+}
+
+/**
+ * threadpool_add_lane
+ *   add task to rings of lane, see threadpool_add_prio. ring is the index
+ *   of the (numa) ring to try first, -1 for threadpool_local_ring.
+ */
+static int threadpool_add_lane (threadpool_t *pool, int lane, int ring, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    int i, start;
+    ub8 pos;
+    threadpool_slot_t *slot;
+    threadpool_task_t *ptask;
+
+    if ( pool == NULL || function == NULL ) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        return threadpool_task_arg_overflow;
+    }
+
+    /* Are we shutting down ? */
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    /* added from a running task: push to deque of current worker.
+       deques hold tasks of the lowest lane only */
+    if (lane == 0 && pool_stealing(pool) && pool_is_worker(pool)) {
+        if (deque_push(pool, &pool->workers[pool_current_ctx->id - 1].deque, function, argument, task_arg, arg_size, flags)) {
+            return threadpool_wakeup(pool, 1);
+        }
+
+        /* deque is full: fall back to the shared queue */
+    }
+
+    /* Are we full ? local node first, then the others */
+    slot = NULL;
+    start = (ring < 0)? threadpool_local_ring(pool) : ring;
+
+    for (i = 0; i < pool->lane_rings && !slot; i++) {
+        slot = ring_claim_write(pool, pool_lane_ring(pool, lane, start + i), &pos);
+    }
+
+    if (!slot) {
+        return threadpool_queue_full;
+    }
+
+    /* Add task to queues */
+    ptask = threadpool_slot_task(slot);
+
+    ptask->function = function;
+    ptask->argument = argument;
+
+    if (arg_size > 0) {
+        /* task_arg is enabled */
+        ptask->arg_size = arg_size;
+        memcpy((void*) ptask->task_arg, task_arg, arg_size);
+    } else {
+        /* task_arg not enabled */
+        ptask->arg_size = 0;
+    }
+
+    /* Use flags to determine whether argument or task_arg is enabled */
+    ptask->flags = flags;
+
+    /* pool->count += 1; */
+    pool_count_add(pool);
+
+    ring_publish(slot, pos);
+
+    return threadpool_wakeup(pool, 1);
+}
+
+
+int threadpool_add (threadpool_t *pool, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    return threadpool_add_lane(pool, 0, -1, function, argument, task_arg, arg_size, flags);
+}
+
+
+int threadpool_add_prio (threadpool_t *pool, int prio, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    if (pool == NULL || prio < 0 || prio >= pool->num_lanes) {
+        return threadpool_invalid;
+    }
+
+    return threadpool_add_lane(pool, prio, -1, function, argument, task_arg, arg_size, flags);
+}
+
+
+/* hash of key onto a strand */
+#define threadpool_strand_of(pool, key)  \
+    (&(pool)->strands[(((key) * 0x9E3779B97F4A7C15ULL) >> 32) % POOL_STRANDS])
+
+/* cells of a strand: next pointer, then a task copy */
+#define strand_cell_next(cell)  (*(unsigned char **) (cell))
+#define strand_cell_task(pool, cell)  \
+    threadpool_task_cell(pool, (cell) + pool_align_size(sizeof(void *), (pool)->task_arg_align), 0)
+
+
+/**
+ * threadpool_strand_run
+ *   drain task of a strand: runs its tasks in order, up to
+ *   POOL_STRAND_QUANTUM of them, then queues itself again behind the
+ *   tasks of other strands.
+ */
+static void threadpool_strand_run (thread_context_t *thread_ctx)
+{
+    int n;
+    unsigned char *cell = NULL;
+    threadpool_t *pool = (threadpool_t *) thread_ctx->pool;
+    threadpool_task_t *outer = thread_ctx->task;
+    threadpool_strand_t *strand = (threadpool_strand_t *) outer->argument;
+
+    pthread_mutex_lock(&strand->lock);
+
+    strand->ring = pool->workers[thread_ctx->id - 1].ring;
+
+    for (n = 0;; n++) {
+        if (cell) {
+            strand_cell_next(cell) = strand->free;
+            strand->free = cell;
+        }
+
+        cell = strand->head;
+        if (!cell) {
+            strand->scheduled = 0;
+            break;
+        }
+
+        if (n == POOL_STRAND_QUANTUM) {
+            /* queue full: go on here */
+            if (threadpool_add_lane(pool, 0, strand->ring, threadpool_strand_run, (void*) strand, NULL, 0, 0) == threadpool_success) {
+                break;
+            }
+            n = 0;
+        }
+
+        strand->head = strand_cell_next(cell);
+        if (!strand->head) {
+            strand->tail = NULL;
+        }
+        strand->count--;
+
+        pthread_mutex_unlock(&strand->lock);
+
+        thread_ctx->task = strand_cell_task(pool, cell);
+        (*(thread_ctx->task->function)) (thread_ctx);
+        thread_ctx->task = outer;
+
+        pthread_mutex_lock(&strand->lock);
+    }
+
+    pthread_mutex_unlock(&strand->lock);
+}
+
+
+int threadpool_add_keyed (threadpool_t *pool, ub8 key, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    int err;
+    unsigned char *cell;
+    threadpool_task_t *task;
+    threadpool_strand_t *strand;
+
+    if (pool == NULL || function == NULL || arg_size < 0) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        return threadpool_task_arg_overflow;
+    }
+
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    strand = threadpool_strand_of(pool, key);
+
+    pthread_mutex_lock(&strand->lock);
+
+    if (strand->count >= POOL_STRAND_DEPTH) {
+        pthread_mutex_unlock(&strand->lock);
+        return threadpool_queue_full;
+    }
+
+    /* a strand has at most one drain task, queued or running. it starts
+       waiting for strand lock: we add task before it looks */
+    if (!strand->scheduled) {
+        err = threadpool_add_lane(pool, 0, strand->ring, threadpool_strand_run, (void*) strand, NULL, 0, 0);
+        if (err != threadpool_success) {
+            pthread_mutex_unlock(&strand->lock);
+            return err;
+        }
+        strand->scheduled = 1;
+    }
+
+    cell = strand->free;
+    if (cell) {
+        strand->free = strand_cell_next(cell);
+    } else {
+        cell = (unsigned char *) pool_aligned_alloc(pool->task_arg_align, pool_align_size(sizeof(void *), pool->task_arg_align) + pool->task_stride);
+        if (!cell) {
+            /* a drain queued for no task finds strand empty */
+            pthread_mutex_unlock(&strand->lock);
+            return threadpool_out_memory;
+        }
+    }
+
+    task = strand_cell_task(pool, cell);
+    task->function = function;
+    task->argument = argument;
+    task->arg_size = arg_size;
+    task->flags = flags;
+    if (arg_size > 0) {
+        memcpy((void*) task->task_arg, task_arg, arg_size);
+    }
+
+    strand_cell_next(cell) = NULL;
+    if (strand->tail) {
+        strand_cell_next(strand->tail) = cell;
+    } else {
+        strand->head = cell;
+    }
+    strand->tail = cell;
+    strand->count++;
+
+    pthread_mutex_unlock(&strand->lock);
+
+    return threadpool_success;
+}
+
+
+int threadpool_add_deadline (threadpool_t *pool, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 deadline)
+{
+    if (pool == NULL || function == NULL || pool->heap == NULL) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        return threadpool_task_arg_overflow;
+    }
+
+    /* Are we shutting down ? */
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    if (!heap_push(pool, pool->heap, deadline, function, argument, task_arg, arg_size, flags)) {
+        return threadpool_queue_full;
+    }
+
+    return threadpool_wakeup(pool, 1);
+}
+
+
+ub8 threadpool_clock_nsec (void)
+{
+    return pool_now_nsec();
+}
+
+
+int threadpool_add_timed (threadpool_t *pool, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, const struct timespec *abstime)
+{
+    int err;
+    threadpool_waiter_t self, *prev;
+
+    if ( pool == NULL ) {
+        return threadpool_invalid;
+    }
+
+    /* nobody waiting before us: try at once */
+    if (pool_load32(&pool->full_waiters) == 0) {
+        err = threadpool_add(pool, function, argument, task_arg, arg_size, flags);
+        if (err != threadpool_queue_full) {
+            return err;
+        }
+    }
+
+    if (pthread_cond_init(&self.cond, NULL) != 0) {
+        return threadpool_lock_failure;
+    }
+    self.next = NULL;
+
+    if (pthread_mutex_lock(&pool->full_lock) != 0) {
+        pthread_cond_destroy(&self.cond);
+        return threadpool_lock_failure;
+    }
+
+    /* threadpool_destroy may be waiting for the FIFO to drain */
+    if (pool_is_shutdown(pool)) {
+        pthread_mutex_unlock(&pool->full_lock);
+        pthread_cond_destroy(&self.cond);
+        return threadpool_shutdown;
+    }
+
+    /* join the FIFO of waiting producers */
+    if (pool->waiters_tail) {
+        pool->waiters_tail->next = &self;
+    } else {
+        pool->waiters_head = &self;
+    }
+    pool->waiters_tail = &self;
+
+    /* full barrier, pairs with ring_released */
+    pool_atomic_inc(&pool->full_waiters);
+
+    for (;;) {
+        err = threadpool_queue_full;
+
+        /* only the longest waiting producer may take a free slot */
+        if (pool->waiters_head == &self) {
+            err = threadpool_add(pool, function, argument, task_arg, arg_size, flags);
+            if (err != threadpool_queue_full) {
+                break;
+            }
+        }
+
+        if (pool_is_shutdown(pool)) {
+            err = threadpool_shutdown;
+            break;
+        }
+
+        if (abstime) {
+            if (pthread_cond_timedwait(&self.cond, &pool->full_lock, abstime) == ETIMEDOUT) {
+                err = threadpool_timedout;
+
+                /* last chance if we are at head */
+                if (pool->waiters_head == &self &&
+                    threadpool_add(pool, function, argument, task_arg, arg_size, flags) == threadpool_success) {
+                    err = threadpool_success;
+                }
+                break;
+            }
+        } else {
+            pthread_cond_wait(&self.cond, &pool->full_lock);
+        }
+    }
+
+    /* leave the FIFO */
+    if (pool->waiters_head == &self) {
+        pool->waiters_head = self.next;
+        prev = NULL;
+    } else {
+        for (prev = pool->waiters_head; prev->next != &self; prev = prev->next) {
+            /* find previous waiter */
+        }
+        prev->next = self.next;
+    }
+
+    if (pool->waiters_tail == &self) {
+        pool->waiters_tail = prev;
+    }
+
+    if (pool_atomic_dec(&pool->full_waiters) == 0 && pool_is_shutdown(pool)) {
+        pthread_cond_signal(&pool->waiters_gone);
+    }
+
+    /* there may be more free slots: pass on to the next waiter */
+    if (pool->waiters_head) {
+        pthread_cond_signal(&pool->waiters_head->cond);
+    }
+
+    pthread_mutex_unlock(&pool->full_lock);
+    pthread_cond_destroy(&self.cond);
+
+    return err;
+}
+
+
+int threadpool_add_batch (threadpool_t *pool, const threadpool_task_desc_t *descs, int n, int *accepted)
+{
+    int i = 0, k, r, start;
+    ub8 pos;
+    threadpool_task_t *ptask;
+    const threadpool_task_desc_t *desc;
+
+    if (accepted) {
+        *accepted = 0;
+    }
+
+    if ( pool == NULL || descs == NULL || n < 0 ) {
+        return threadpool_invalid;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (descs[i].function == NULL || descs[i].arg_size < 0) {
+            return threadpool_invalid;
+        }
+        if (descs[i].arg_size > pool->task_arg_size) {
+            return threadpool_task_arg_overflow;
+        }
+    }
+
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    i = 0;
+
+    /* added from a running task: fill deque of current worker first */
+    if (pool_stealing(pool) && pool_is_worker(pool)) {
+        threadpool_deque_t *dq = &pool->workers[pool_current_ctx->id - 1].deque;
+
+        for (; i < n; i++) {
+            desc = &descs[i];
+            if (!deque_push(pool, dq, desc->function, desc->argument, desc->task_arg, desc->arg_size, desc->flags)) {
+                break;
+            }
+        }
+    }
+
+    start = threadpool_local_ring(pool);
+
+    for (r = 0; r < pool->lane_rings && i < n; r++) {
+        threadpool_ring_t *ring = pool_lane_ring(pool, 0, start + r);
+
+        k = ring_claim_write_n(pool, ring, n - i, &pos);
+
+        for (; k > 0; k--, i++, pos++) {
+            threadpool_slot_t *slot = threadpool_slot_at(ring, pos);
+
+            desc = &descs[i];
+            ptask = threadpool_slot_task(slot);
+
+            ptask->function = desc->function;
+            ptask->argument = desc->argument;
+            ptask->arg_size = desc->arg_size;
+            ptask->flags = desc->flags;
+
+            if (desc->arg_size > 0) {
+                memcpy((void*) ptask->task_arg, desc->task_arg, desc->arg_size);
+            }
+
+            pool_count_add(pool);
+
+            ring_publish(slot, pos);
+        }
+    }
+
+    if (accepted) {
+        *accepted = i;
+    }
+
+    if (i > 0) {
+        if (threadpool_wakeup(pool, i) != 0) {
+            return threadpool_lock_failure;
+        }
+    }
+
+    return (i == n)? threadpool_success : threadpool_queue_full;
+}
+
+
+int threadpool_reserve (threadpool_t *pool, threadpool_task_t **slot, int arg_size)
+{
+    int i, start;
+    ub8 pos;
+    threadpool_slot_t *pslot;
+
+    if ( pool == NULL || slot == NULL || arg_size < 0 ) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        return threadpool_task_arg_overflow;
+    }
+
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    pslot = NULL;
+    start = threadpool_local_ring(pool);
+
+    for (i = 0; i < pool->lane_rings && !pslot; i++) {
+        pslot = ring_claim_write(pool, pool_lane_ring(pool, 0, start + i), &pos);
+    }
+
+    if (!pslot) {
+        return threadpool_queue_full;
+    }
+
+    /* seq stays at pos while reserved, commit takes pos back from it.
+       consumers find the ring empty at it till then */
+    *slot = threadpool_slot_task(pslot);
+    (*slot)->function = NULL;
+    (*slot)->arg_size = arg_size;
+
+    return threadpool_success;
+}
+
+
+int threadpool_commit (threadpool_t *pool, threadpool_task_t *slot, void (*function)(thread_context_t *), void *argument, int arg_size, ub8 flags)
+{
+    threadpool_slot_t *pslot;
+
+    if ( pool == NULL || slot == NULL || function == NULL || arg_size < 0 ) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        /* still have to give the slot back */
+        threadpool_abort(pool, slot);
+        return threadpool_task_arg_overflow;
+    }
+
+    pslot = threadpool_task_slot(slot);
+
+    slot->function = function;
+    slot->argument = argument;
+    slot->arg_size = arg_size;
+    slot->flags = flags;
+
+    pool_count_add(pool);
+
+    ring_publish(pslot, pslot->seq);
+
+    return threadpool_wakeup(pool, 1);
+}
+
+
+int threadpool_abort (threadpool_t *pool, threadpool_task_t *slot)
+{
+    threadpool_slot_t *pslot;
+
+    if ( pool == NULL || slot == NULL ) {
+        return threadpool_invalid;
+    }
+
+    /* a claimed ring position can not be undone: publish an empty task */
+    pslot = threadpool_task_slot(slot);
+
+    slot->function = NULL;
+    slot->arg_size = 0;
+
+    pool_count_add(pool);
+
+    ring_publish(pslot, pslot->seq);
+
+    /* tasks committed behind us may have found us at head and parked */
+    return threadpool_wakeup(pool, 1);
+}
+
+
+/* ticks of clock nsec, rounded down (up) */
+#define wheel_tick(wheel, nsec)     (((nsec) - (wheel)->start) / (POOL_TIMER_TICK_USEC * 1000ULL))
+#define wheel_tick_up(wheel, nsec)  (((nsec) - (wheel)->start + POOL_TIMER_TICK_USEC * 1000ULL - 1) / (POOL_TIMER_TICK_USEC * 1000ULL))
+
+
+/**
+ * wheel_link
+ *   put timer in the slot of its expire tick: level 0 if it is due within
+ *   POOL_WHEEL_SLOTS ticks, else the level whose slot covers it. timers
+ *   beyond the last level wait in the last slot and are linked again.
+ */
+static void wheel_link (threadpool_wheel_t *wheel, threadpool_timer_t *timer)
+{
+    int level;
+    ub8 delta, expire = timer->expire;
+    threadpool_timer_t **slot;
+
+    if (expire < wheel->now) {
+        expire = wheel->now;
+    }
+
+    delta = expire - wheel->now;
+
+    for (level = 0; level < POOL_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((ub8) 1 << (POOL_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    if (delta >= ((ub8) 1 << (POOL_WHEEL_BITS * POOL_WHEEL_LEVELS))) {
+        expire = wheel->now + ((ub8) 1 << (POOL_WHEEL_BITS * POOL_WHEEL_LEVELS)) - 1;
+    }
+
+    slot = &wheel->slots[level][(expire >> (POOL_WHEEL_BITS * level)) & (POOL_WHEEL_SLOTS - 1)];
+
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+
+static void wheel_unlink (threadpool_timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+}
+
+
+/**
+ * wheel_advance
+ *   run ticks up to target: timers of higher levels come down (cascade)
+ *   when the lower level wraps around, due timers of level 0 are appended
+ *   to *ptail in order of expire.
+ */
+static threadpool_timer_t ** wheel_advance (threadpool_wheel_t *wheel, ub8 target, threadpool_timer_t **ptail)
+{
+    int level;
+    ub8 t;
+    threadpool_timer_t *timer, *list, **slot;
+
+    for (; wheel->now <= target && wheel->pending; wheel->now++) {
+        t = wheel->now;
+
+        for (level = 1; level < POOL_WHEEL_LEVELS && !(t & (((ub8) 1 << (POOL_WHEEL_BITS * level)) - 1)); level++) {
+            slot = &wheel->slots[level][(t >> (POOL_WHEEL_BITS * level)) & (POOL_WHEEL_SLOTS - 1)];
+
+            list = *slot;
+            *slot = NULL;
+
+            while ((timer = list) != NULL) {
+                list = timer->next;
+                wheel_link(wheel, timer);
+            }
+        }
+
+        slot = &wheel->slots[0][t & (POOL_WHEEL_SLOTS - 1)];
+
+        while ((timer = *slot) != NULL) {
+            wheel_unlink(timer);
+            wheel->pending--;
+
+            timer->state = POOL_TIMER_FIRING;
+            timer->next = NULL;
+
+            *ptail = timer;
+            ptail = &timer->next;
+        }
+    }
+
+    if (!wheel->pending && wheel->now <= target) {
+        /* nothing left: no need to walk the empty ticks */
+        wheel->now = target + 1;
+    }
+
+    return ptail;
+}
+
+
+/* tick of next timer in level 0 or of next cascade, whichever first */
+static ub8 wheel_next (threadpool_wheel_t *wheel)
+{
+    ub8 t = wheel->now;
+    ub8 end = (t | (POOL_WHEEL_SLOTS - 1)) + 1;
+
+    /* cascade of this tick is not done yet */
+    if (!(t & (POOL_WHEEL_SLOTS - 1))) {
+        return t;
+    }
+
+    for (; t < end; t++) {
+        if (wheel->slots[0][t & (POOL_WHEEL_SLOTS - 1)]) {
+            break;
+        }
+    }
+
+    return t;
+}
+
+
+/* get an unused timer, allocates POOL_TIMER_CHUNK more if none */
+static threadpool_timer_t * wheel_alloc (threadpool_t *pool, threadpool_wheel_t *wheel)
+{
+    int i;
+    threadpool_timer_t *timer, *chunk;
+    unsigned char *cells;
+
+    if (!wheel->free_timers) {
+        size_t cells_offset = pool_align_size(sizeof(threadpool_timer_t) * POOL_TIMER_CHUNK, pool->task_arg_align);
+
+        if (wheel->num_chunks == wheel->max_chunks) {
+            int max_chunks = wheel->max_chunks? wheel->max_chunks * 2 : 16;
+            threadpool_timer_t **chunks;
+
+            /* index + 1 of timer must fit in 32 bits of id */
+            if ((ub8) max_chunks * POOL_TIMER_CHUNK >= 0xffffffffULL) {
+                return NULL;
+            }
+
+            chunks = (threadpool_timer_t **) realloc(wheel->chunks, sizeof(threadpool_timer_t *) * max_chunks);
+            if (!chunks) {
+                return NULL;
+            }
+            wheel->chunks = chunks;
+            wheel->max_chunks = max_chunks;
+        }
+
+        chunk = (threadpool_timer_t *) pool_aligned_alloc(pool->task_arg_align, cells_offset + (size_t) pool->task_stride * POOL_TIMER_CHUNK);
+        if (!chunk) {
+            return NULL;
+        }
+
+        cells = (unsigned char *) chunk + cells_offset;
+
+        for (i = POOL_TIMER_CHUNK - 1; i >= 0; i--) {
+            timer = &chunk[i];
+
+            timer->id = ((ub8) 1 << 32) | (ub8) (wheel->num_chunks * POOL_TIMER_CHUNK + i + 1);
+            timer->state = POOL_TIMER_FREE;
+            timer->task = threadpool_task_cell(pool, cells, i);
+
+            timer->next = wheel->free_timers;
+            wheel->free_timers = timer;
+        }
+
+        wheel->chunks[wheel->num_chunks++] = chunk;
+    }
+
+    timer = wheel->free_timers;
+    wheel->free_timers = timer->next;
+
+    return timer;
+}
+
+
+static void wheel_free (threadpool_wheel_t *wheel, threadpool_timer_t *timer)
+{
+    /* next generation: old id no longer matches */
+    timer->id += (ub8) 1 << 32;
+    timer->state = POOL_TIMER_FREE;
+
+    timer->next = wheel->free_timers;
+    wheel->free_timers = timer;
+}
+
+
+/* timer of id, NULL if it is free */
+static threadpool_timer_t * wheel_find (threadpool_wheel_t *wheel, ub8 id)
+{
+    ub4 index = (ub4) (id & 0xffffffffULL);
+    threadpool_timer_t *timer;
+
+    if (index == 0 || (int) ((index - 1) / POOL_TIMER_CHUNK) >= wheel->num_chunks) {
+        return NULL;
+    }
+
+    index--;
+    timer = &wheel->chunks[index / POOL_TIMER_CHUNK][index % POOL_TIMER_CHUNK];
+
+    if (timer->id != id || timer->state == POOL_TIMER_FREE) {
+        return NULL;
+    }
+
+    return timer;
+}
+
+
+/* link timer to run at clock nsec */
+static void wheel_schedule (threadpool_wheel_t *wheel, threadpool_timer_t *timer, ub8 at)
+{
+    ub8 now = wheel_tick(wheel, pool_now_nsec());
+
+    if (!wheel->pending && now > wheel->now) {
+        /* wheel is empty: skip the idle ticks */
+        wheel->now = now;
+    }
+
+    timer->at = at;
+    timer->expire = (at > wheel->start)? wheel_tick_up(wheel, at) : 0;
+    timer->state = POOL_TIMER_PENDING;
+
+    wheel_link(wheel, timer);
+    wheel->pending++;
+
+    /* due before the timer thread wakes up */
+    if (timer->expire < wheel->wake) {
+        wheel->wake = timer->expire;
+        pthread_cond_signal(&wheel->notify);
+    }
+}
+
+
+/**
+ * wheel_rearm
+ *   task of timer has gone to queue: free one-shot timer, link periodic
+ *   timer for its next run. a fixed-rate timer keeps its phase, ticks
+ *   missed meanwhile are coalesced into the next one. a fixed-delay or
+ *   cancelled timer whose task is still to run waits idle for
+ *   threadpool_periodic_run.
+ */
+static void wheel_rearm (threadpool_wheel_t *wheel, threadpool_timer_t *timer)
+{
+    ub8 now, at;
+
+    if (!timer->period || (timer->cancelled && !timer->busy)) {
+        wheel_free(wheel, timer);
+        return;
+    }
+
+    if (timer->mode == THREADPOOL_PERIODIC_DELAY || timer->cancelled) {
+        if (timer->busy) {
+            timer->state = POOL_TIMER_IDLE;
+        } else {
+            wheel_schedule(wheel, timer, pool_now_nsec() + timer->period);
+        }
+        return;
+    }
+
+    now = pool_now_nsec();
+    at = timer->at + timer->period;
+
+    if (at <= now) {
+        at += ((now - at) / timer->period + 1) * timer->period;
+    }
+
+    wheel_schedule(wheel, timer, at);
+}
+
+
+/**
+ * runs task of periodic timer on a worker, then lets its timer go on:
+ *   thread_ctx->task is the timer's own copy during the call.
+ */
+static void threadpool_periodic_run (thread_context_t *thread_ctx)
+{
+    threadpool_t *pool = (threadpool_t *) thread_ctx->pool;
+    threadpool_wheel_t *wheel = pool->wheel;
+    threadpool_task_t *task = thread_ctx->task;
+    threadpool_timer_t *timer = (threadpool_timer_t *) task->argument;
+
+    thread_ctx->task = timer->task;
+    (*(timer->task->function)) (thread_ctx);
+    thread_ctx->task = task;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    timer->busy = 0;
+
+    /* else the timer thread has it in hand */
+    if (timer->state == POOL_TIMER_IDLE) {
+        if (timer->cancelled) {
+            wheel_free(wheel, timer);
+        } else {
+            wheel_schedule(wheel, timer, pool_now_nsec() + timer->period);
+        }
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+
+/**
+ * threadpool_timer_fire
+ *   move due timers to the queue, POOL_TIMER_BATCH tasks per claim. when
+ *   queue is full the timer thread does not wait: timers not delivered
+ *   are linked again for the next tick, a fixed-rate timer keeps its
+ *   phase. a periodic timer whose last run is still queued or running
+ *   skips this tick.
+ */
+static void threadpool_timer_fire (threadpool_t *pool, threadpool_timer_t *due)
+{
+    int i, j, k, n, sent;
+    ub8 at;
+    threadpool_timer_t *timer, *first;
+    threadpool_wheel_t *wheel = pool->wheel;
+    threadpool_task_desc_t descs[POOL_TIMER_BATCH];
+    threadpool_timer_t *owners[POOL_TIMER_BATCH];
+
+    while (due) {
+        first = due;
+
+        pthread_mutex_lock(&wheel->lock);
+
+        for (n = k = 0; due && n < POOL_TIMER_BATCH; n++, due = due->next) {
+            if (!due->period) {
+                descs[k].function = due->task->function;
+                descs[k].argument = due->task->argument;
+                descs[k].task_arg = (void *) due->task->task_arg;
+                descs[k].arg_size = (int) due->task->arg_size;
+                descs[k].flags = due->task->flags;
+                owners[k++] = due;
+            } else if (!due->busy && !due->cancelled) {
+                due->busy = 1;
+
+                descs[k].function = threadpool_periodic_run;
+                descs[k].argument = (void *) due;
+                descs[k].task_arg = NULL;
+                descs[k].arg_size = 0;
+                descs[k].flags = 0;
+                owners[k++] = due;
+            }
+        }
+
+        pthread_mutex_unlock(&wheel->lock);
+
+        sent = k;
+        if (k > 0 && threadpool_add_batch(pool, descs, k, &sent) == threadpool_shutdown) {
+            sent = k;
+        }
+
+        pthread_mutex_lock(&wheel->lock);
+        for (i = j = 0; i < n; i++) {
+            timer = first;
+            first = first->next;
+
+            /* owners are in order of the due list */
+            if (j < k && owners[j] == timer && j++ >= sent) {
+                timer->busy = 0;
+
+                if (!timer->cancelled) {
+                    at = timer->at;
+                    wheel_schedule(wheel, timer, pool_now_nsec() + POOL_TIMER_TICK_USEC * 1000ULL);
+                    timer->at = at;
+                    continue;
+                }
+            }
+
+            wheel_rearm(wheel, timer);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+    }
+}
+
+
+/**
+ * timer thread: sleeps till next tick with due timers, then moves them
+ * to the queue.
+ */
+static void * threadpool_timer_run (void *param)
+{
+    threadpool_t *pool = (threadpool_t *) param;
+    threadpool_wheel_t *wheel = pool->wheel;
+    threadpool_timer_t *due, **tail;
+    struct timespec abstime;
+    ub8 now, at;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    while (!pool_is_shutdown(pool)) {
+        due = NULL;
+        now = pool_now_nsec();
+
+        tail = wheel_advance(wheel, wheel_tick(wheel, now), &due);
+        *tail = NULL;
+
+        if (due) {
+            pthread_mutex_unlock(&wheel->lock);
+            threadpool_timer_fire(pool, due);
+            pthread_mutex_lock(&wheel->lock);
+            continue;
+        }
+
+        if (!wheel->pending) {
+            wheel->wake = POOL_WHEEL_NEVER;
+            pthread_cond_wait(&wheel->notify, &wheel->lock);
+        } else {
+            wheel->wake = wheel_next(wheel);
+
+            at = wheel->start + wheel->wake * (POOL_TIMER_TICK_USEC * 1000ULL);
+            pool_abstime(&abstime, (at > now)? at - now : 0);
+
+            pthread_cond_timedwait(&wheel->notify, &wheel->lock, &abstime);
+        }
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+
+    return 0;
+}
+
+
+/**
+ * threadpool_add_timer
+ *   add task to run at clock nsec, then every period nsec if period > 0.
+ */
+static int threadpool_add_timer (threadpool_t *pool, ub8 at, ub8 period, int mode, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id)
+{
+    threadpool_timer_t *timer;
+    threadpool_wheel_t *wheel;
+
+    if (pool == NULL || function == NULL) {
+        return threadpool_invalid;
+    }
+
+    if (arg_size > pool->task_arg_size) {
+        return threadpool_task_arg_overflow;
+    }
+
+    /* Are we shutting down ? */
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
+    }
+
+    wheel = pool->wheel;
+
+    if (pthread_mutex_lock(&wheel->lock) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    /* checked again under lock: destroy joins only a started timer thread */
+    if (pool_is_shutdown(pool)) {
+        pthread_mutex_unlock(&wheel->lock);
+        return threadpool_shutdown;
+    }
+
+    if (!wheel->started) {
+        if (pthread_create(&wheel->thread, NULL, threadpool_timer_run, (void*) pool) != 0) {
+            pthread_mutex_unlock(&wheel->lock);
+            return threadpool_run_failure;
+        }
+        wheel->started = 1;
+    }
+
+    timer = wheel_alloc(pool, wheel);
+    if (!timer) {
+        pthread_mutex_unlock(&wheel->lock);
+        return threadpool_out_memory;
+    }
+
+    timer->task->function = function;
+    timer->task->argument = argument;
+    timer->task->flags = flags;
+    timer->task->arg_size = arg_size;
+
+    if (arg_size > 0) {
+        memcpy((void*) timer->task->task_arg, task_arg, arg_size);
+    }
+
+    timer->period = period;
+    timer->mode = mode;
+    timer->busy = timer->cancelled = 0;
+
+    wheel_schedule(wheel, timer, at);
+
+    if (timer_id) {
+        *timer_id = timer->id;
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+
+    return threadpool_success;
+}
+
+
+int threadpool_add_at (threadpool_t *pool, ub8 when, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id)
+{
+    return threadpool_add_timer(pool, when, 0, 0, function, argument, task_arg, arg_size, flags, timer_id);
+}
+
+
+int threadpool_add_after (threadpool_t *pool, ub8 delay, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id)
+{
+    return threadpool_add_timer(pool, pool_now_nsec() + delay, 0, 0, function, argument, task_arg, arg_size, flags, timer_id);
+}
+
+
+int threadpool_add_periodic (threadpool_t *pool, ub8 delay, ub8 period, int mode, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id)
+{
+    if (period == 0 || (mode != THREADPOOL_PERIODIC_RATE && mode != THREADPOOL_PERIODIC_DELAY)) {
+        return threadpool_invalid;
+    }
+
+    return threadpool_add_timer(pool, pool_now_nsec() + delay, period, mode, function, argument, task_arg, arg_size, flags, timer_id);
+}
+
+
+int threadpool_cancel_timer (threadpool_t *pool, ub8 timer_id)
+{
+    int err = threadpool_invalid;
+    threadpool_timer_t *timer;
+    threadpool_wheel_t *wheel;
+
+    if (pool == NULL) {
+        return threadpool_invalid;
+    }
+
+    wheel = pool->wheel;
+
+    if (pthread_mutex_lock(&wheel->lock) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    timer = wheel_find(wheel, timer_id);
+
+    if (!timer || timer->cancelled) {
+        /* unknown, or gone to queue for good */
+    } else if (timer->state == POOL_TIMER_PENDING) {
+        wheel_unlink(timer);
+        wheel->pending--;
+
+        if (timer->busy) {
+            /* last run still to come, threadpool_periodic_run frees it */
+            timer->cancelled = 1;
+            timer->state = POOL_TIMER_IDLE;
+        } else {
+            wheel_free(wheel, timer);
+        }
+        err = threadpool_success;
+    } else if (timer->period) {
+        /* firing or running: no more runs */
+        timer->cancelled = 1;
+        err = threadpool_success;
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+
+    return err;
+}
+
+
+/* future running on current thread, NULL if task is not from threadpool_submit */
+static POOL_THREAD_LOCAL threadpool_future_t *pool_current_future = NULL;
+
+#define threadpool_future_at(futures, i)  \
+    (&(futures)->chunks[(i) / POOL_FUTURE_CHUNK][(i) % POOL_FUTURE_CHUNK])
+
+
+/* push list of futures first..last on free stack */
+static void future_push (threadpool_futures_t *futures, threadpool_future_t *first, threadpool_future_t *last)
+{
+    ub8 head;
+
+    do {
+        head = pool_load64(&futures->free_head);
+        pool_store32(&last->next_free, (ub4) head);
+    } while (!pool_cas64(&futures->free_head, head, (((head >> 32) + 1) << 32) | (ub8) (first->index + 1)));
+}
+
+
+/* pop a free future, adds a chunk if none. tag of free_head avoids ABA */
+static threadpool_future_t * future_pop (threadpool_t *pool, threadpool_futures_t *futures)
+{
+    int i;
+    ub8 head;
+    ub4 index;
+    threadpool_future_t *future, *chunk;
+
+    for (;;) {
+        head = pool_load64(&futures->free_head);
+        index = (ub4) head;
+
+        if (index) {
+            future = threadpool_future_at(futures, index - 1);
+
+            if (pool_cas64(&futures->free_head, head, (((head >> 32) + 1) << 32) | (ub8) pool_load32(&future->next_free))) {
+                return future;
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&futures->lock);
+
+        if ((ub4) pool_load64(&futures->free_head) == 0) {
+            if (futures->num_chunks == POOL_FUTURE_CHUNKS) {
+                pthread_mutex_unlock(&futures->lock);
+                return NULL;
+            }
+
+            chunk = (threadpool_future_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_future_t) * POOL_FUTURE_CHUNK);
+            if (!chunk) {
+                pthread_mutex_unlock(&futures->lock);
+                return NULL;
+            }
+
+            for (i = 0; i < POOL_FUTURE_CHUNK; i++) {
+                chunk[i].pool = pool;
+                chunk[i].index = (ub4) (futures->num_chunks * POOL_FUTURE_CHUNK + i);
+                chunk[i].next_free = chunk[i].index + 2;
+            }
+
+            /* publish chunk before its futures can be found by index */
+            futures->chunks[futures->num_chunks] = chunk;
+            pool_atomic_inc(&futures->num_chunks);
+
+            future_push(futures, &chunk[0], &chunk[POOL_FUTURE_CHUNK - 1]);
+        }
+
+        pthread_mutex_unlock(&futures->lock);
+    }
+}
+
+
+/* mark future done and wake its waiters */
+static void threadpool_future_done (threadpool_future_t *future)
+{
+#if defined(POOL_HAS_FUTEX)
+    if (pool_xchg32(&future->state, POOL_FUTURE_DONE) == POOL_FUTURE_WAITED) {
+        pool_futex_wake(&future->state, INT_MAX);
+    }
+#else
+    threadpool_futures_t *futures = future->pool->futures;
+
+    if (pool_xchg32(&future->state, POOL_FUTURE_DONE) == POOL_FUTURE_WAITED) {
+        pthread_mutex_lock(&futures->lock);
+        pthread_cond_broadcast(&futures->notify);
+        pthread_mutex_unlock(&futures->lock);
+    }
+#endif
+}
+
+
+/**
+ * threadpool_group_done
+ *   one task of group is done. its waiter waits for running to drop too,
+ *   so the group stays till the task decremented it.
+ */
+static void threadpool_group_done (threadpool_group_t *group)
+{
+#if defined(POOL_HAS_FUTEX)
+    if (pool_atomic_dec(&group->state) == POOL_GROUP_WAITED) {
+        pool_futex_wake(&group->state, INT_MAX);
+    }
+#else
+    threadpool_futures_t *futures = group->pool->futures;
+
+    if (pool_atomic_dec(&group->state) == POOL_GROUP_WAITED) {
+        pthread_mutex_lock(&futures->lock);
+        pthread_cond_broadcast(&futures->notify);
+        pthread_mutex_unlock(&futures->lock);
+    }
+#endif
+}
+
+
+/* runs task of threadpool_submit or threadpool_group_add with its own function and argument */
+static void threadpool_future_run (thread_context_t *thread_ctx)
+{
+    threadpool_task_t *task = thread_ctx->task;
+    threadpool_future_t *future = (threadpool_future_t *) task->argument;
+    threadpool_future_t *outer = pool_current_future;
+    threadpool_group_t *group = future->group;
+
+    if (group) {
+        threadpool_t *pool = (threadpool_t *) thread_ctx->pool;
+
+        /* a waiter leaving at shutdown waits till no task is in the gate,
+           then its group may be gone: those seeing shutdown skip it */
+        pool_atomic_inc(&pool->group_gate);
+        if (pool_is_shutdown(pool)) {
+            pool_atomic_dec(&pool->group_gate);
+            threadpool_future_release(future);
+            return;
+        }
+        pool_atomic_inc(&group->running);
+        pool_atomic_dec(&pool->group_gate);
+    }
+
+    task->function = future->function;
+    task->argument = future->argument;
+
+    /* may be nested by a task waiting for others */
+    pool_current_future = future;
+    (*(task->function)) (thread_ctx);
+    pool_current_future = outer;
+
+    if (group) {
+        threadpool_group_done(group);
+        pool_atomic_dec(&group->running);
+    } else {
+        threadpool_future_done(future);
+    }
+    threadpool_future_release(future);
+}
+
+
+int threadpool_submit (threadpool_t *pool, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, threadpool_future_t **future)
+{
+    int err;
+    threadpool_future_t *fut;
+
+    if (pool == NULL || function == NULL || future == NULL) {
+        return threadpool_invalid;
+    }
+
+    *future = NULL;
+
+    fut = future_pop(pool, pool->futures);
+    if (!fut) {
+        return threadpool_out_memory;
+    }
+
+    fut->state = POOL_FUTURE_PENDING;
+    fut->refs = 2;
+    fut->function = function;
+    fut->argument = argument;
+    fut->group = NULL;
+    memset(fut->result, 0, sizeof(fut->result));
+
+    err = threadpool_add(pool, threadpool_future_run, (void*) fut, task_arg, arg_size, flags);
+    if (err != threadpool_success) {
+        future_push(pool->futures, fut, fut);
+        return err;
+    }
+
+    *future = fut;
+    return threadpool_success;
+}
+
+
+int threadpool_poll (threadpool_future_t *future)
+{
+    if (future == NULL) {
+        return threadpool_invalid;
+    }
+
+    return (pool_load32(&future->state) == POOL_FUTURE_DONE)? 1 : 0;
+}
+
+
+int threadpool_wait (threadpool_future_t *future, int timeout_msec)
+{
+    int i;
+    ub8 now, deadline = 0;
+#if !defined(POOL_HAS_FUTEX)
+    int err = threadpool_success;
+    threadpool_futures_t *futures;
+#endif
+
+    if (future == NULL) {
+        return threadpool_invalid;
+    }
+
+    /* a poll: not even spinning */
+    if (timeout_msec == 0) {
+        return (pool_load32(&future->state) == POOL_FUTURE_DONE)? threadpool_success : threadpool_timedout;
+    }
+
+    /* most tasks are short: spin before sleeping */
+    for (i = 0; i < POOL_FUTURE_SPIN; i++) {
+        if (pool_load32(&future->state) == POOL_FUTURE_DONE) {
+            return threadpool_success;
+        }
+        pool_cpu_relax();
+    }
+
+    if (timeout_msec > 0) {
+        deadline = pool_now_nsec() + (ub8) timeout_msec * 1000000ULL;
+    }
+
+#if defined(POOL_HAS_FUTEX)
+    for (;;) {
+        struct timespec ts, *pts = NULL;
+        int state = pool_load32(&future->state);
+
+        if (state == POOL_FUTURE_DONE) {
+            return threadpool_success;
+        }
+
+        if (timeout_msec >= 0) {
+            now = pool_now_nsec();
+            if (now >= deadline) {
+                return threadpool_timedout;
+            }
+
+            ts.tv_sec = (time_t) ((deadline - now) / 1000000000ULL);
+            ts.tv_nsec = (long) ((deadline - now) % 1000000000ULL);
+            pts = &ts;
+        }
+
+        if (state == POOL_FUTURE_PENDING && !pool_cas32(&future->state, POOL_FUTURE_PENDING, POOL_FUTURE_WAITED)) {
+            continue;
+        }
+
+        pool_futex_wait_timed(&future->state, POOL_FUTURE_WAITED, pts);
+    }
+#else
+    futures = future->pool->futures;
+
+    pthread_mutex_lock(&futures->lock);
+
+    while (pool_load32(&future->state) != POOL_FUTURE_DONE) {
+        pool_cas32(&future->state, POOL_FUTURE_PENDING, POOL_FUTURE_WAITED);
+
+        if (timeout_msec < 0) {
+            pthread_cond_wait(&futures->notify, &futures->lock);
+        } else {
+            struct timespec abstime;
+
+            now = pool_now_nsec();
+            if (now >= deadline) {
+                err = threadpool_timedout;
+                break;
+            }
+
+            pool_abstime(&abstime, deadline - now);
+            pthread_cond_timedwait(&futures->notify, &futures->lock, &abstime);
+        }
+    }
+
+    pthread_mutex_unlock(&futures->lock);
+
+    return err;
+#endif
+}
+
+
+void * threadpool_future_result (threadpool_future_t *future)
+{
+    return future? (void *) future->result : NULL;
+}
+
+
+void threadpool_future_release (threadpool_future_t *future)
+{
+    if (future && pool_atomic_dec(&future->refs) == 0) {
+        future_push(future->pool->futures, future, future);
+    }
+}
+
+
+void * threadpool_task_result (thread_context_t *thread_ctx)
+{
+    if (!pool_current_future || pool_current_future->pool != (threadpool_t *) thread_ctx->pool) {
+        return NULL;
+    }
+
+    return (void *) pool_current_future->result;
+}
+
+
+int threadpool_unused_queues (threadpool_t *pool)
+{
+    if ( !pool || pool_is_shutdown(pool) ) {
+        return threadpool_invalid;
+    } else {
+        return (pool->queue_size - pool_count_get(pool));
+    }
+}
+
+
+int threadpool_lane_stats (threadpool_t *pool, int prio, threadpool_lane_stats_t *stats)
+{
+    int r;
+
+    if (!pool || !stats || prio < 0 || prio >= pool->num_lanes) {
+        return threadpool_invalid;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (!pool->lane_stats) {
+        return threadpool_success;
+    }
+
+    for (r = 0; r < pool->lane_rings; r++) {
+        threadpool_ring_t *ring = pool_lane_ring(pool, prio, r);
+        ub8 added = pool_load64(&ring->added);
+        ub8 taken = pool_load64(&ring->taken);
+        ub8 wait_max = pool_xchg64(&ring->wait_max, 0);
+
+        stats->added += added;
+        stats->taken += taken;
+        stats->depth += (added > taken)? added - taken : 0;
+        stats->wait_usec += pool_load64(&ring->wait_sum) / 1000;
+
+        if (wait_max / 1000 > stats->wait_max_usec) {
+            stats->wait_max_usec = wait_max / 1000;
+        }
+    }
+
+    return threadpool_success;
+}
+
+
+int threadpool_get_threads_count (threadpool_t *pool)
+{
+    return pool ? pool_load32(&pool->thread_count) : 0;
+}
+
+
+int threadpool_resize (threadpool_t *pool, int threads)
+{
+    int err = 0;
+
+    if (pool == NULL || threads < 1 || threads > pool->max_threads) {
+        return threadpool_invalid;
+    }
+
+    if (pthread_mutex_lock(&pool->lock) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    if (pool_is_shutdown(pool)) {
+        pthread_mutex_unlock(&pool->lock);
+        return threadpool_shutdown;
+    }
+
+    pool_store32(&pool->target, threads);
+
+    while (!err && pool->thread_count < threads) {
+        err = threadpool_grow(pool, 1);
+    }
+
+    if (pool->thread_count > threads) {
+        /* workers above target retire once idle */
+        err = threadpool_wakeall(pool);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return err;
+}
+
+
+int threadpool_auto_threads (int blocking_ratio)
+{
+    int cpus = 0;
+    ub8 threads;
+
+    if (blocking_ratio < 0 || blocking_ratio > 99) {
+        return threadpool_invalid;
+    }
+
+#if defined(POOL_HAS_CPUTOPO)
+    cpus = cputopo_effective_cpus();
+#endif
+
+    if (cpus <= 0) {
+        return POOL_DEFAULT_THREADS;
+    }
+
+    /* a task on cpu (100 - blocking_ratio)% of its time keeps
+       100 / (100 - blocking_ratio) threads per cpu busy */
+    threads = ((ub8) cpus * 100 + (99 - blocking_ratio)) / (100 - blocking_ratio);
+
+    return (threads > POOL_MAX_THREADS)? POOL_MAX_THREADS : (int) threads;
+}
+
+
+int threadpool_destroy (threadpool_t *pool)
+{
+    int i, err = 0;
+
+    if (pool == NULL) {
+        return threadpool_invalid;
+    }
+
+    if (pthread_mutex_lock (&(pool->lock)) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    /* Already shutting down */
+    if (pool_is_shutdown(pool)) {
+        pthread_mutex_unlock (&(pool->lock));
+        return threadpool_shutdown;
+    }
+
+    pool_store32(&pool->shutdown, 1);
+
+    /* Wake up all worker threads */
+    err = threadpool_wakeall(pool);
+
+    /* retired workers are detached: wait until they left their slot */
+    for (i = 0; i < pool->max_threads; i++) {
+        while (pool->workers[i].state == POOL_WORKER_EXITED) {
+            pthread_cond_wait(&pool->worker_gone, &pool->lock);
+        }
+    }
+
+    if (pthread_mutex_unlock(&(pool->lock)) != 0) {
+        err = threadpool_lock_failure;
+    }
+
+    if (err) {
+        return err;
+    }
+
+    /* Wake up all blocked producers, they and waiting callers touch pool
+       until they left */
+    if (pthread_mutex_lock(&pool->full_lock) == 0) {
+        threadpool_waiter_t *waiter;
+
+        for (waiter = pool->waiters_head; waiter; waiter = waiter->next) {
+            pthread_cond_signal(&waiter->cond);
+        }
+
+        while (pool->full_waiters > 0 || pool->callers > 0) {
+            pthread_cond_wait(&pool->waiters_gone, &pool->full_lock);
+        }
+        pthread_mutex_unlock(&pool->full_lock);
+    }
+
+    /* Stop timer thread, pending timers are dropped */
+    if (pthread_mutex_lock(&pool->wheel->lock) == 0) {
+        pthread_cond_signal(&pool->wheel->notify);
+        pthread_mutex_unlock(&pool->wheel->lock);
+    }
+
+    if (pool->wheel->started && pthread_join(pool->wheel->thread, NULL) != 0) {
+        err = threadpool_run_failure;
+    }
+
+    /* Join all worker thread */
+    for (i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].state == POOL_WORKER_OFF) {
+            continue;
+        }
+        if (pthread_join (pool->thread_ctxs[i].thread, NULL) != 0) {
+            err = threadpool_run_failure;
+        }
+        pool->workers[i].state = POOL_WORKER_OFF;
+    }
+
+    /* Only if everything went well do we deallocate the pool */
+    if (!err) {
+        threadpool_free (pool);
+    }
+    return err;
+}
+
+int threadpool_free (threadpool_t *pool)
+{
+    int i;
+
+    if (pool == NULL || pool->started > 0) {
+        return -1;
+    }
+
+    pthread_mutex_destroy (&(pool->lock));
+    for (i = 0; i < pool->num_rings; i++) {
+        pthread_mutex_destroy (&(pool->rings[i].lock));
+
+#if defined(POOL_HAS_MMAP)
+        if (pool->rings[i].mapped) {
+            munmap(pool->rings[i].slots, pool->rings[i].mapped);
+        }
+#endif
+    }
+
+#if defined(POOL_HAS_NUMA)
+    free(pool->nodes);
+    free(pool->cpu_ring);
+#endif
+
+#if defined(POOL_HAS_CPUTOPO)
+    free(pool->cpus);
+#endif
+
+#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
+    free(pool->group_cpus);
+#endif
+
+    if (pool->heap) {
+        pthread_mutex_destroy (&(pool->heap->lock));
+        pool_aligned_free(pool->heap);
+    }
+
+    if (pool->wheel) {
+        for (i = 0; i < pool->wheel->num_chunks; i++) {
+            pool_aligned_free(pool->wheel->chunks[i]);
+        }
+        free(pool->wheel->chunks);
+
+        pthread_mutex_destroy (&(pool->wheel->lock));
+        pthread_cond_destroy (&(pool->wheel->notify));
+        pool_aligned_free(pool->wheel);
+    }
+
+    if (pool->futures) {
+        for (i = 0; i < pool->futures->num_chunks; i++) {
+            pool_aligned_free(pool->futures->chunks[i]);
+        }
+
+        pthread_mutex_destroy (&(pool->futures->lock));
+        pthread_cond_destroy (&(pool->futures->notify));
+        pool_aligned_free(pool->futures);
+    }
+
+    if (pool->strands) {
+        unsigned char *cell, *next;
+
+        for (i = 0; i < POOL_STRANDS; i++) {
+            /* tasks not run at shutdown are dropped */
+            for (cell = pool->strands[i].head; cell; cell = next) {
+                next = strand_cell_next(cell);
+                pool_aligned_free(cell);
+            }
+            for (cell = pool->strands[i].free; cell; cell = next) {
+                next = strand_cell_next(cell);
+                pool_aligned_free(cell);
+            }
+
+            pthread_mutex_destroy (&(pool->strands[i].lock));
+        }
+
+        pool_aligned_free(pool->strands);
+    }
+
+    pthread_mutex_destroy (&(pool->full_lock));
+    pthread_cond_destroy (&(pool->notify));
+    pthread_cond_destroy (&(pool->waiters_gone));
+    pthread_cond_destroy (&(pool->worker_gone));
+
+    if (pool->workers) {
+        for (i = 0; i < pool->max_threads; i++) {
+            pool_aligned_free(pool->workers[i].tasks);
+        }
+    }
+
+    pool_aligned_free(pool->workers);
+    pool_aligned_free(pool);
+    return 0;
+}
+
+/**
+ * threadpool_take_ring
+ *   take next task from ring, see threadpool_take.
+ */
+static threadpool_task_t * threadpool_take_ring (threadpool_t *pool, threadpool_worker_t *worker, threadpool_ring_t *ring, threadpool_task_t *taskcpy, threadpool_slot_t **pslot, ub8 *ppos)
+{
+    int k;
+    threadpool_slot_t *slot;
+
+    /* a nested take must not refill the batch the outer task runs from */
+    if (pool->batch_max > 1 && !worker->nested) {
+        /* fair share of queued tasks, so that a shallow queue is not
+           drained by one worker while others stay idle */
+        k = pool_count_get(pool) / pool_load32(&pool->thread_count);
+        k = (k < pool->batch_min)? pool->batch_min : ((k > pool->batch_max)? pool->batch_max : k);
+
+        k = ring_claim_read_n(pool, ring, k, ppos);
+
+        if (k > 0) {
+            for (worker->batch_len = 0; worker->batch_len < k; worker->batch_len++, (*ppos)++) {
+                slot = threadpool_slot_at(ring, *ppos);
+
+                threadpool_task_copy(pool, threadpool_task_cell(pool, worker->batch, worker->batch_len), threadpool_slot_task(slot));
+
+                pool_count_sub(pool);
+
+                ring_release(ring, slot, *ppos);
+            }
+
+            ring_released(pool);
+
+            worker->batch_next = 1;
+            return threadpool_task_cell(pool, worker->batch, 0);
+        }
+
+        return NULL;
+    }
+
+    slot = ring_claim_read(pool, ring, ppos);
+
+    if (!slot) {
+        return NULL;
+    }
+
+    /* pool->count -= 1; */
+    pool_count_sub(pool);
+
+    if (pool->inplace) {
+        /* slot stays owned by us until the task returns */
+        *pslot = slot;
+        return threadpool_slot_task(slot);
+    }
+
+    /* Grab our task */
+    threadpool_task_copy(pool, taskcpy, threadpool_slot_task(slot));
+
+    ring_release(ring, slot, *ppos);
+    ring_released(pool);
+    return taskcpy;
+}
+
+
+/**
+ * threadpool_take_lane
+ *   take next task from rings of lane: ring of our node first, other nodes
+ *   only when ours is empty.
+ */
+static threadpool_task_t * threadpool_take_lane (threadpool_t *pool, threadpool_worker_t *worker, int lane, threadpool_task_t *taskcpy, threadpool_ring_t **pring, threadpool_slot_t **pslot, ub8 *ppos)
+{
+    int i;
+    threadpool_task_t *task;
+
+    for (i = 0; i < pool->lane_rings; i++) {
+        *pring = pool_lane_ring(pool, lane, worker->ring + i);
+
+        task = threadpool_take_ring(pool, worker, *pring, taskcpy, pslot, ppos);
+        if (task) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * threadpool_aged_ring
+ *   ring whose oldest task has the highest effective priority: lane +
+ *   waited time / aging_nsec, so a task rises one lane per aging period.
+ *   ties go to the higher lane. NULL if all rings are empty. hint only:
+ *   reads head slots without claiming.
+ */
+static threadpool_ring_t * threadpool_aged_ring (threadpool_t *pool)
+{
+    int lane, r;
+    ub8 prio, best = 0, now = pool_now_nsec();
+    threadpool_ring_t *top = NULL;
+
+    for (lane = pool->num_lanes - 1; lane >= 0; lane--) {
+        for (r = 0; r < pool->lane_rings; r++) {
+            threadpool_ring_t *ring = pool_lane_ring(pool, lane, r);
+            ub8 pos = pool_load64(&ring->head);
+            threadpool_slot_t *slot = threadpool_slot_at(ring, pos);
+
+            if (pool_load64(&slot->seq) != pos + 1) {
+                continue;
+            }
+
+            prio = (ub8) lane + ((now > slot->stamp)? (now - slot->stamp) / pool->aging_nsec : 0);
+
+            if (!top || prio > best) {
+                top = ring;
+                best = prio;
+            }
+        }
+    }
+
+    return top;
+}
+
+
+/**
+ * threadpool_take
+ *   take next task for worker. returns the task to run or NULL if nothing
+ *   to do. in inplace mode the task is the ring slot itself (*pslot of
+ *   *pring), it must be given back by ring_release after the task returns.
+ *
+ *   order: rest of batch, earliest deadline, aged ring, higher lanes,
+ *   own deque, lowest lane, other deques.
+ */
+static threadpool_task_t * threadpool_take (threadpool_t *pool, thread_context_t *thread_ctx, threadpool_task_t *taskcpy, threadpool_ring_t **pring, threadpool_slot_t **pslot, ub8 *ppos)
+{
+    int lane;
+    ub8 deadline;
+    threadpool_task_t *task;
+    threadpool_worker_t *worker = &pool->workers[thread_ctx->id - 1];
+
+    *pslot = NULL;
+
+    /* rest of the batch dequeued last time */
+    if (worker->batch_next < worker->batch_len) {
+        return threadpool_task_cell(pool, worker->batch, worker->batch_next++);
+    }
+
+    while (pool->heap && heap_pop(pool, pool->heap, taskcpy, &deadline)) {
+        if (pool->expired && deadline < pool_now_nsec()) {
+            /* missed: hand over to expired instead of running late */
+            thread_ctx->task = taskcpy;
+            pool->expired(thread_ctx);
+            thread_ctx->task = NULL;
+            continue;
+        }
+
+        return taskcpy;
+    }
+
+    if (pool->num_lanes > 1) {
+        /* anti-starvation: a task long enough in a lower lane (or in
+           ring of other node) goes first */
+        *pring = threadpool_aged_ring(pool);
+        if (*pring) {
+            task = threadpool_take_ring(pool, worker, *pring, taskcpy, pslot, ppos);
+            if (task) {
+                return task;
+            }
+        }
+
+        for (lane = pool->num_lanes - 1; lane > 0; lane--) {
+            task = threadpool_take_lane(pool, worker, lane, taskcpy, pring, pslot, ppos);
+            if (task) {
+                return task;
+            }
+        }
+    }
+
+    /* newest task of our own first: still hot in cache */
+    if (pool_stealing(pool) && deque_pop(pool, &worker->deque, taskcpy)) {
+        return taskcpy;
+    }
+
+    task = threadpool_take_lane(pool, worker, 0, taskcpy, pring, pslot, ppos);
+    if (task) {
+        return task;
+    }
+
+    if (pool_stealing(pool) && threadpool_steal(pool, thread_ctx, taskcpy)) {
+        return taskcpy;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * threadpool_run_task
+ *   run task taken by threadpool_take, then give back its slot.
+ */
+static void threadpool_run_task (threadpool_t *pool, thread_context_t *thread_ctx, threadpool_task_t *task, threadpool_ring_t *ring, threadpool_slot_t *slot, ub8 pos)
+{
+    thread_ctx->task = task;
+
+    /* Get to work. function is NULL for aborted slot */
+    if (task->function) {
+        (*(task->function)) (thread_ctx);
+    }
+
+    if (slot) {
+        ring_release(ring, slot, pos);
+        ring_released(pool);
+        thread_ctx->task = NULL;
+    }
+}
+
+
+threadpool_group_t * threadpool_group_create (threadpool_t *pool)
+{
+    threadpool_group_t *group;
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    group = (threadpool_group_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_group_t));
+    if (group) {
+        group->pool = pool;
+        group->state = 0;
+        group->running = 0;
+    }
+
+    return group;
+}
+
+
+int threadpool_group_add (threadpool_group_t *group, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+{
+    int err;
+    threadpool_future_t *fut;
+
+    if (group == NULL || function == NULL) {
+        return threadpool_invalid;
+    }
+
+    fut = future_pop(group->pool, group->pool->futures);
+    if (!fut) {
+        return threadpool_out_memory;
+    }
+
+    fut->state = POOL_FUTURE_PENDING;
+    fut->refs = 1;
+    fut->function = function;
+    fut->argument = argument;
+    fut->group = group;
+
+    pool_atomic_inc(&group->state);
+
+    err = threadpool_add(group->pool, threadpool_future_run, (void*) fut, task_arg, arg_size, flags);
+    if (err != threadpool_success) {
+        future_push(group->pool->futures, fut, fut);
+        threadpool_group_done(group);
+    }
+
+    return err;
+}
+
+
+/**
+ * threadpool_enter
+ *   a thread other than a worker starts to wait for tasks of pool:
+ *   threadpool_destroy frees pool only after threadpool_leave.
+ */
+static void threadpool_enter (threadpool_t *pool)
+{
+    if (!pool_is_worker(pool)) {
+        pthread_mutex_lock(&pool->full_lock);
+        pool->callers++;
+        pthread_mutex_unlock(&pool->full_lock);
+    }
+}
+
+
+static void threadpool_leave (threadpool_t *pool)
+{
+    if (!pool_is_worker(pool)) {
+        pthread_mutex_lock(&pool->full_lock);
+        if (--pool->callers == 0 && pool_is_shutdown(pool)) {
+            pthread_cond_signal(&pool->waiters_gone);
+        }
+        pthread_mutex_unlock(&pool->full_lock);
+    }
+}
+
+
+/**
+ * threadpool_group_wait
+ *   a worker runs queued tasks while it waits: tasks it added to the group
+ *   are on top of its own deque (THREADPOOL_SCHED_STEAL), others come from
+ *   the queue. so nested fork-join does not hold a worker idle. it sleeps
+ *   only when there is nothing to take, and wakes up every msec to look
+ *   again. at shutdown queued tasks of the group are dropped: it stops
+ *   taking tasks and returns once the started ones are done.
+ */
+int threadpool_group_wait (threadpool_group_t *group)
+{
+    int v, spins = 0, err = threadpool_success;
+    ub8 pos;
+    threadpool_t *pool;
+    thread_context_t *thread_ctx = NULL;
+    threadpool_worker_t *worker = NULL;
+    threadpool_task_t *outer = NULL, *task, *taskcpy = NULL;
+    threadpool_ring_t *ring = NULL;
+    threadpool_slot_t *slot;
+    unsigned char *cell = NULL;
+
+    if (group == NULL) {
+        return threadpool_invalid;
+    }
+
+    pool = group->pool;
+
+    threadpool_enter(pool);
+
+    if (pool_is_worker(pool)) {
+        /* no memory: wait without running tasks */
+        cell = (unsigned char *) pool_aligned_alloc(pool->task_arg_align, pool->task_stride);
+        if (cell) {
+            thread_ctx = pool_current_ctx;
+            worker = &pool->workers[thread_ctx->id - 1];
+            taskcpy = threadpool_task_cell(pool, cell, 0);
+
+            /* the task calling us runs from our batch or slot: keep it */
+            outer = thread_ctx->task;
+            worker->nested++;
+        }
+    }
+
+    for (;;) {
+        v = pool_load32(&group->state);
+
+        if (!(v & ~POOL_GROUP_WAITED)) {
+            /* the last task still touches running */
+            while (pool_load32(&group->running) > 0) {
+                pool_cpu_relax();
+            }
+            break;
+        }
+
+        if (pool_is_shutdown(pool)) {
+            /* tasks are gated by shutdown before they count as running */
+            pool_full_barrier();
+            if (pool_load32(&pool->group_gate) == 0 && pool_load32(&group->running) == 0) {
+                err = threadpool_shutdown;
+                break;
+            }
+        } else if (worker) {
+            task = threadpool_take(pool, thread_ctx, taskcpy, &ring, &slot, &pos);
+            if (task) {
+                threadpool_run_task(pool, thread_ctx, task, ring, slot, pos);
+                spins = 0;
+                continue;
+            }
+        }
+
+        if (spins < POOL_FUTURE_SPIN) {
+            spins++;
+            pool_cpu_relax();
+            continue;
+        }
+
+        if (!(v & POOL_GROUP_WAITED)) {
+            pool_cas32(&group->state, v, v | POOL_GROUP_WAITED);
+            continue;
+        }
+
+        /* timed: nobody wakes us at shutdown */
+#if defined(POOL_HAS_FUTEX)
+        do {
+            struct timespec ts = {0, 1000000};
+            pool_futex_wait_timed(&group->state, v, &ts);
+        } while(0);
+#else
+        pthread_mutex_lock(&pool->futures->lock);
+        if (pool_load32(&group->state) == v) {
+            struct timespec abstime;
+            pool_abstime(&abstime, 1000000);
+            pthread_cond_timedwait(&pool->futures->notify, &pool->futures->lock, &abstime);
+        }
+        pthread_mutex_unlock(&pool->futures->lock);
+#endif
+    }
+
+    if (worker) {
+        worker->nested--;
+        thread_ctx->task = outer;
+        pool_aligned_free(cell);
+    }
+
+    /* group may be used again, not after shutdown: tasks were dropped */
+    if (err == threadpool_success) {
+        pool_cas32(&group->state, POOL_GROUP_WAITED, 0);
+    }
+
+    threadpool_leave(pool);
+
+    return err;
+}
+
+
+void threadpool_group_destroy (threadpool_group_t *group)
+{
+    pool_aligned_free(group);
+}
+
+
+#define threadpool_loop_chunk(loop, lo, hi, acc)  \
+    ((loop)->reduce? (loop)->reduce((lo), (hi), (acc), (loop)->ctx) : (loop)->body((lo), (hi), (loop)->ctx))
+
+
+/**
+ * threadpool_loop_run
+ *   claim and run chunks of loop till none is left or pool shuts down.
+ */
+static void threadpool_loop_run (threadpool_loop_t *loop)
+{
+    sb8 lo, hi, k, n, size, rem, chunk;
+    void *acc = NULL;
+
+    n = loop->end - loop->begin;
+
+    if (loop->reduce) {
+        /* no other thread touches it till the loop is done */
+        acc = loop->accs + (size_t) (pool_atomic_inc(&loop->joined) - 1) * loop->acc_stride;
+        memcpy(acc, loop->identity, loop->acc_size);
+    }
+
+    if (loop->partition == THREADPOOL_PARTITION_STATIC) {
+        size = n / loop->parts;
+        rem = n % loop->parts;
+
+        while ((k = pool_fetch_add64(&loop->next, 1)) < loop->parts) {
+            if (pool_is_shutdown(loop->pool)) {
+                pool_store32(&loop->stopped, 1);
+                break;
+            }
+            /* first rem blocks have one more index */
+            lo = loop->begin + k * size + (k < rem? k : rem);
+            hi = lo + size + (k < rem? 1 : 0);
+            if (lo < hi) {
+                threadpool_loop_chunk(loop, lo, hi, acc);
+            }
+        }
+        return;
+    }
+
+    if (loop->partition == THREADPOOL_PARTITION_DYNAMIC) {
+        while ((lo = pool_fetch_add64(&loop->next, loop->grain)) < loop->end) {
+            if (pool_is_shutdown(loop->pool)) {
+                pool_store32(&loop->stopped, 1);
+                break;
+            }
+            hi = (loop->end - lo > loop->grain)? lo + loop->grain : loop->end;
+            threadpool_loop_chunk(loop, lo, hi, acc);
+        }
+        return;
+    }
+
+    for (;;) {
+        lo = pool_load64(&loop->next);
+        if (lo >= loop->end) {
+            break;
+        }
+        if (pool_is_shutdown(loop->pool)) {
+            pool_store32(&loop->stopped, 1);
+            break;
+        }
+
+        chunk = (loop->end - lo) / (2 * loop->parts);
+        if (chunk < loop->grain) {
+            chunk = loop->grain;
+        }
+        hi = (loop->end - lo > chunk)? lo + chunk : loop->end;
+
+        if (pool_cas64(&loop->next, lo, hi)) {
+            threadpool_loop_chunk(loop, lo, hi, acc);
+        }
+    }
+}
+
+
+/* helper task of threadpool_parallel_for */
+static void threadpool_loop_task (thread_context_t *thread_ctx)
+{
+    threadpool_loop_run((threadpool_loop_t *) thread_ctx->task->argument);
+}
+
+
+int threadpool_parallel_for (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *ctx), void *ctx)
+{
+    return threadpool_parallel_for_ex(pool, begin, end, grain, body, ctx, THREADPOOL_PARTITION_GUIDED);
+}
+
+
+/**
+ * threadpool_loop_exec
+ *   share loop with up to threads helper tasks and the calling thread.
+ *   range, grain, partition and body or reduce are set by caller. at
+ *   most threads + 1 threads join the loop. threads is read once by
+ *   caller, thread_count may change under threadpool_resize.
+ */
+static int threadpool_loop_exec (threadpool_t *pool, threadpool_loop_t *loop, int threads)
+{
+    int i, err, helpers;
+    sb8 chunks;
+    threadpool_group_t group;
+
+    /* a worker calling us is one of the threads already */
+    helpers = threads - (pool_is_worker(pool)? 1 : 0);
+    chunks = (loop->end - loop->begin - 1) / loop->grain + 1;
+    if (helpers > chunks - 1) {
+        helpers = (int) (chunks - 1);
+    }
+
+    loop->pool = pool;
+    loop->stopped = 0;
+    loop->parts = helpers + 1;
+    loop->next = (loop->partition == THREADPOOL_PARTITION_STATIC)? 0 : loop->begin;
+    loop->joined = 0;
+
+    group.pool = pool;
+    group.state = 0;
+    group.running = 0;
+
+    /* queue full: we do their share */
+    for (i = 0; i < helpers; i++) {
+        if (threadpool_group_add(&group, threadpool_loop_task, (void*) loop, NULL, 0, 0) != threadpool_success) {
+            break;
+        }
+    }
+
+    threadpool_loop_run(loop);
+
+    err = threadpool_group_wait(&group);
+
+    /* helpers left early, the group does not tell */
+    if (err == threadpool_success && pool_load32(&loop->stopped)) {
+        err = threadpool_shutdown;
+    }
+
+    return err;
+}
+
+
+int threadpool_parallel_for_ex (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *ctx), void *ctx, int partition)
+{
+    int err;
+    threadpool_loop_t loop;
+
+    if (pool == NULL || body == NULL ||
+        partition < THREADPOOL_PARTITION_STATIC || partition > THREADPOOL_PARTITION_GUIDED) {
+        return threadpool_invalid;
+    }
+
+    threadpool_enter(pool);
+
+    if (pool_is_shutdown(pool)) {
+        err = threadpool_shutdown;
+    } else if (begin >= end) {
+        err = threadpool_success;
+    } else {
+        loop.begin = begin;
+        loop.end = end;
+        loop.grain = (grain < 1)? 1 : grain;
+        loop.partition = partition;
+        loop.body = body;
+        loop.ctx = ctx;
+        loop.reduce = NULL;
+
+        err = threadpool_loop_exec(pool, &loop, pool_load32(&pool->thread_count));
+    }
+
+    threadpool_leave(pool);
+
+    return err;
+}
+
+
+/**
+ * threadpool_parallel_reduce
+ *   each thread folds its chunks into its own accumulator, on its own
+ *   cache lines. the accumulators are combined pairwise after the loop:
+ *   (0,1) (2,3) ..., then (0,2) (4,6) ... and so on.
+ */
+int threadpool_parallel_reduce (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *acc, void *ctx), void (*combine)(void *acc, const void *other, void *ctx), const void *identity, void *result, size_t acc_size, void *ctx)
+{
+    int err, i, step, threads;
+    threadpool_loop_t loop;
+
+    if (pool == NULL || body == NULL || combine == NULL || identity == NULL || result == NULL || acc_size == 0) {
+        return threadpool_invalid;
+    }
+
+    memcpy(result, identity, acc_size);
+
+    if (begin >= end) {
+        return pool_is_shutdown(pool)? threadpool_shutdown : threadpool_success;
+    }
+
+    loop.begin = begin;
+    loop.end = end;
+    loop.grain = (grain < 1)? 1 : grain;
+    loop.partition = THREADPOOL_PARTITION_GUIDED;
+    loop.body = NULL;
+    loop.ctx = ctx;
+    loop.reduce = body;
+    loop.acc_size = acc_size;
+    loop.acc_stride = pool_align_size(acc_size, POOL_CACHELINE_SIZE);
+    loop.identity = identity;
+
+    threadpool_enter(pool);
+
+    threads = pool_load32(&pool->thread_count);
+
+    loop.accs = (unsigned char *) pool_aligned_alloc(POOL_CACHELINE_SIZE, loop.acc_stride * (threads + 1));
+    if (!loop.accs) {
+        err = threadpool_out_memory;
+    } else if (pool_is_shutdown(pool)) {
+        err = threadpool_shutdown;
+    } else {
+        err = threadpool_loop_exec(pool, &loop, threads);
+    }
+
+    threadpool_leave(pool);
+
+    if (err == threadpool_success) {
+        for (step = 1; step < loop.joined; step *= 2) {
+            for (i = 0; i + step < loop.joined; i += 2 * step) {
+                combine(loop.accs + i * loop.acc_stride, loop.accs + (i + step) * loop.acc_stride, ctx);
+            }
+        }
+
+        memcpy(result, loop.accs, acc_size);
+    }
+
+    pool_aligned_free(loop.accs);
+
+    return err;
+}
+
+
+/**
+ *  @struct threadpool_scan_t
+ *  @brief arrays of threadpool_parallel_scan, lives on the caller's stack
+ *
+ *  @var blocks    Number of blocks of in, scanned each by one thread.
+ *  @var sums      total of each block, stride bytes each.
+ *  @var offs      total of all blocks before each block, stride bytes each.
+ */
+typedef struct threadpool_scan_t
+{
+    const unsigned char *in;
+    unsigned char *out;
+    sb8 count;
+    size_t elem_size;
+    sb8 blocks;
+    size_t stride;
+    unsigned char *sums;
+    unsigned char *offs;
+    void (*combine)(void *, const void *, void *);
+    const void *identity;
+    void *ctx;
+} threadpool_scan_t;
+
+
+/* [lo, hi) of elements in block b */
+#define scan_block(scan, b, lo, hi)  do { \
+        (lo) = (scan)->count / (scan)->blocks * (b) + ((b) < (scan)->count % (scan)->blocks? (b) : (scan)->count % (scan)->blocks); \
+        (hi) = (lo) + (scan)->count / (scan)->blocks + ((b) < (scan)->count % (scan)->blocks? 1 : 0); \
+    } while(0)
+
+
+/* first pass: total of each block */
+static void threadpool_scan_sum (sb8 begin, sb8 end, void *arg)
+{
+    sb8 b, i, lo, hi;
+    threadpool_scan_t *scan = (threadpool_scan_t *) arg;
+
+    for (b = begin; b < end; b++) {
+        unsigned char *acc = scan->sums + (size_t) b * scan->stride;
+
+        memcpy(acc, scan->identity, scan->elem_size);
+
+        scan_block(scan, b, lo, hi);
+        for (i = lo; i < hi; i++) {
+            scan->combine(acc, scan->in + (size_t) i * scan->elem_size, scan->ctx);
+        }
+    }
+}
+
+
+/* second pass: scan each block from the total before it */
+static void threadpool_scan_block (sb8 begin, sb8 end, void *arg)
+{
+    sb8 b, i, lo, hi;
+    threadpool_scan_t *scan = (threadpool_scan_t *) arg;
+
+    for (b = begin; b < end; b++) {
+        unsigned char *acc = scan->offs + (size_t) b * scan->stride;
+
+        scan_block(scan, b, lo, hi);
+        for (i = lo; i < hi; i++) {
+            /* in may be out: read element before it is overwritten */
+            scan->combine(acc, scan->in + (size_t) i * scan->elem_size, scan->ctx);
+            memcpy(scan->out + (size_t) i * scan->elem_size, acc, scan->elem_size);
+        }
+    }
+}
+
+
+/**
+ * threadpool_parallel_scan
+ *   two passes over count / blocks elements per thread: totals of blocks,
+ *   then the scan of each block. between them the caller scans the few
+ *   totals of blocks, so each element is combined twice in all.
+ */
+int threadpool_parallel_scan (threadpool_t *pool, const void *in, void *out, sb8 count, size_t elem_size, void (*combine)(void *acc, const void *elem, void *ctx), const void *identity, void *ctx)
+{
+    int err;
+    sb8 b;
+    threadpool_scan_t scan;
 
-    int head;
-    int tail;
-    int count;
-    int shutdown;
-    int started;
+    if (pool == NULL || in == NULL || out == NULL || elem_size == 0 || combine == NULL || identity == NULL) {
+        return threadpool_invalid;
+    }
 
-    int thread_count;
-    int queue_size;
-    int task_arg_size;
-    int task_size;  /* total sizeof task */
+    if (count <= 0) {
+        return pool_is_shutdown(pool)? threadpool_shutdown : threadpool_success;
+    }
 
-    threadpool_task_t *queues;
+    scan.in = (const unsigned char *) in;
+    scan.out = (unsigned char *) out;
+    scan.count = count;
+    scan.elem_size = elem_size;
+    scan.combine = combine;
+    scan.identity = identity;
+    scan.ctx = ctx;
 
-    thread_context_t thread_ctxs[0];
-};
+    threadpool_enter(pool);
 
+    scan.blocks = pool_load32(&pool->thread_count) + (pool_is_worker(pool)? 0 : 1);
+    if (scan.blocks > count) {
+        scan.blocks = count;
+    }
 
-#if defined(__WINDOWS__)
-# define pool_count_get(pool)  InterlockedCompareExchange(&pool->count, 0, 0)
-# define pool_count_add(pool)  InterlockedIncrement(&pool->count)
-# define pool_count_sub(pool)  InterlockedDecrement(&pool->count)
-#else
-# define pool_count_get(pool)  __sync_add_and_fetch(&pool->count, 0)
-# define pool_count_add(pool)  __sync_add_and_fetch(&pool->count, 1)
-# define pool_count_sub(pool)  __sync_sub_and_fetch(&pool->count, 1)
-#endif
+    scan.stride = pool_align_size(elem_size, POOL_CACHELINE_SIZE);
+    scan.sums = (unsigned char *) pool_aligned_alloc(POOL_CACHELINE_SIZE, scan.stride * scan.blocks * 2);
+    if (!scan.sums) {
+        threadpool_leave(pool);
+        return threadpool_out_memory;
+    }
+    scan.offs = scan.sums + scan.stride * scan.blocks;
 
+    err = threadpool_parallel_for_ex(pool, 0, scan.blocks, 1, threadpool_scan_sum, &scan, THREADPOOL_PARTITION_STATIC);
 
-#define threadpool_get_task_at(pool, offset)  \
-    ((threadpool_task_t *) ((unsigned char *) pool->queues + offset * pool->task_size))
+    if (err == threadpool_success) {
+        memcpy(scan.offs, identity, elem_size);
+        for (b = 1; b < scan.blocks; b++) {
+            memcpy(scan.offs + b * scan.stride, scan.offs + (b - 1) * scan.stride, elem_size);
+            combine(scan.offs + b * scan.stride, scan.sums + (b - 1) * scan.stride, ctx);
+        }
 
+        err = threadpool_parallel_for_ex(pool, 0, scan.blocks, 1, threadpool_scan_block, &scan, THREADPOOL_PARTITION_STATIC);
+    }
 
-thread_context_t * threadpool_get_context (threadpool_t *pool, int id)
-{
-	return &(pool->thread_ctxs[id - 1]);
+    threadpool_leave(pool);
+
+    pool_aligned_free(scan.sums);
+
+    return err;
 }
 
 
 /**
- * @function void *threadpool_run(void *threadpool)
- * @brief the worker thread
- * @param threadpool the pool which own the thread
+ *  @struct threadpool_dag_node_t
+ *  @brief node of threadpool_dag_t, one task
+ *
+ *  @var pending   Number of predecessors not done in current run.
+ *  @var path      longest nsec of a path of predecessors done so far.
+ *  @var function, argument  task of node.
+ *  @var next      next node of a local ready list in threadpool_dag_exec.
+ *  @var preds     Number of predecessors.
+ *  @var succs     indexes of successors, num_succs of max_succs used.
  */
-static void *threadpool_run (void *threadpool);
+typedef struct POOL_CACHELINE_ALIGNED threadpool_dag_node_t
+{
+    volatile int pending;
+    volatile ub8 path;
 
-int threadpool_free(threadpool_t *pool);
+    void (*function)(thread_context_t *);
+    void *argument;
+    threadpool_dag_t *dag;
+    struct threadpool_dag_node_t *next;
 
-threadpool_t *threadpool_create(int thread_count, int queue_size, int stack_size, int affinity_cpus, void **thread_args, size_t task_arg_size)
+    int preds;
+    int num_succs;
+    int max_succs;
+    int *succs;
+} threadpool_dag_node_t;
+
+
+/**
+ *  @struct threadpool_dag_t
+ *  @brief tasks with dependencies, run by threadpool_dag_run
+ *
+ *  @var group     counts nodes not done in current run.
+ *  @var critical  longest nsec of a path done so far.
+ *  @var nodes     nodes by index, num_nodes of max_nodes used.
+ *  @var running   whether threadpool_dag_run is in progress.
+ */
+struct POOL_CACHELINE_ALIGNED threadpool_dag_t
 {
-    int i;
+    threadpool_group_t group;
 
-    threadpool_t *pool = NULL;
+    POOL_CACHELINE_ALIGNED volatile ub8 critical;
 
-    pthread_attr_t attr;
+    POOL_CACHELINE_ALIGNED threadpool_t *pool;
+    int num_nodes;
+    int max_nodes;
+    threadpool_dag_node_t *nodes;
+    int running;
+};
 
-#if !defined(__WINDOWS__) && !defined(__CYGWIN__)
-    cpu_set_t cpuset;
-#endif
 
-    /* Check thread_count for negative or otherwise very big input parameters */
-    if (thread_count < 0 || thread_count > POOL_MAX_THREADS) {
-        goto err;
-    }
-    if (thread_count == 0) {
-        thread_count = POOL_DEFAULT_THREADS;
-    }
+threadpool_dag_t * threadpool_dag_create (threadpool_t *pool)
+{
+    threadpool_dag_t *dag;
 
-    /* Check queue_size for negative or otherwise very big input parameters */
-    if (queue_size < 0 || queue_size > POOL_MAX_QUEUES) {
-        goto err;
+    if (pool == NULL) {
+        return NULL;
     }
 
-    if (queue_size == 0) {
-        queue_size = POOL_DEFAULT_QUEUES;
+    dag = (threadpool_dag_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_dag_t));
+    if (dag) {
+        memset(dag, 0, sizeof(*dag));
+        dag->pool = pool;
+        dag->group.pool = pool;
     }
 
-    /* Check task_arg_size for negative or otherwise very big input parameters */
-    if (task_arg_size == (size_t)(-1) || task_arg_size > POOL_TASK_ARG_SIZE_MAX) {
-        goto err;
-    }
+    return dag;
+}
 
-    /* create threadpool */
-    if ( (pool = (threadpool_t *) malloc (sizeof(threadpool_t) +
-            sizeof(thread_context_t) * thread_count +
-            (sizeof(threadpool_task_t) + task_arg_size) * queue_size)
-        ) == NULL ) {
-        goto err;
-    }
 
-    /* Initialize */
-    pool->thread_count = thread_count;
-    pool->queue_size = queue_size;
-    pool->task_arg_size = (int) task_arg_size;
-    pool->task_size = (int) (sizeof(threadpool_task_t) + task_arg_size);
-    pool->head = pool->tail = pool->count = 0;
-    pool->shutdown = pool->started = 0;
-    pool->queues = (threadpool_task_t *) (& pool->thread_ctxs[thread_count]);
+int threadpool_dag_add_node (threadpool_dag_t *dag, void (*function)(thread_context_t *), void *argument)
+{
+    threadpool_dag_node_t *node;
 
-    /* Initialize mutex and conditional variable first */
-    if ((pthread_mutex_init (&(pool->lock), NULL) != 0) ||
-       (pthread_cond_init (&(pool->notify), NULL) != 0)) {
-        goto err;
+    if (dag == NULL || function == NULL || dag->running) {
+        return threadpool_invalid;
     }
 
-	/* http://man7.org/linux/man-pages/man3/pthread_create.3.html */
-	if (pthread_attr_init_config(&attr, 0, PTHREAD_SCOPE_SYSTEM, PTHREAD_CREATE_JOINABLE) != 0) {
-		goto err;
-	}
+    if (dag->num_nodes == dag->max_nodes) {
+        int max_nodes = dag->max_nodes? dag->max_nodes * 2 : 64;
 
-    /* Start worker threads */
-    for (i = 0; i < thread_count; i++) {
-        thread_context_t * pctx = & pool->thread_ctxs[i];
+        /* realloc does not keep alignment */
+        node = (threadpool_dag_node_t *) pool_aligned_alloc(POOL_CACHELINE_SIZE, sizeof(threadpool_dag_node_t) * max_nodes);
+        if (!node) {
+            return threadpool_out_memory;
+        }
 
-        /* set thread id: 1 based */
-        pctx->id = i + 1;
+        if (dag->nodes) {
+            memcpy(node, dag->nodes, sizeof(threadpool_dag_node_t) * dag->num_nodes);
+            pool_aligned_free(dag->nodes);
+        }
 
-        /* set pool to each thread context */
-        pctx->pool = (void*) pool;
+        dag->nodes = node;
+        dag->max_nodes = max_nodes;
+    }
 
-        /* assign thread argument if valid */
-        if (thread_args) {
-            pctx->thread_arg = thread_args[i];
-        } else {
-            pctx->thread_arg = 0;
-        }
+    node = &dag->nodes[dag->num_nodes];
+    memset(node, 0, sizeof(*node));
 
-		/* Set affinity mask to include CPUs 0 to 7 */
-# if !defined(__WINDOWS__) && !defined(__CYGWIN__)
-		if (affinity_cpus > 0) {
-			thread_set_affinity_cpus(pctx->id, affinity_cpus, &cpuset);
+    node->function = function;
+    node->argument = argument;
+    node->dag = dag;
 
-			if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset) != 0) {
-				printf("pthread_attr_setaffinity_np error: %s\n", strerror(errno));
-				threadpool_destroy(pool);
-				pthread_attr_destroy(&attr);
-				return NULL;
-			}
-		}
-# endif
+    return dag->num_nodes++;
+}
 
-        if ( pthread_create (& pctx->thread, &attr, threadpool_run, (void*) pctx) != 0) {
-            threadpool_destroy(pool);
-            pthread_attr_destroy(&attr);
-            return NULL;
-        } else {
-# if !defined(__WINDOWS__) && !defined(__CYGWIN__)
-			CPU_ZERO(&cpuset);
-
-            if (pthread_getaffinity_np (pctx->thread, sizeof(cpu_set_t), &cpuset) != 0) {
-				printf("pthread_attr_setaffinity_np error: %s\n", strerror(errno));
-				threadpool_destroy(pool);
-				pthread_attr_destroy(&attr);
-				return NULL;
-			}
-# endif
 
-            pool->started++;
-        }
-    }
+int threadpool_dag_add_edge (threadpool_dag_t *dag, int from, int to)
+{
+    threadpool_dag_node_t *node;
 
-	/* Destroy the thread attributes object, since it is no longer needed */
-	if (pthread_attr_destroy(&attr) != 0) {
-		printf("pthread_attr_destroy error: %s\n", strerror(errno));
-		threadpool_destroy(pool);
-		return NULL;
-	}
+    if (dag == NULL || dag->running ||
+        from < 0 || from >= dag->num_nodes || to < 0 || to >= dag->num_nodes || from == to) {
+        return threadpool_invalid;
+    }
 
-    return pool;
+    node = &dag->nodes[from];
 
- err:
-    if(pool) {
-        threadpool_free(pool);
+    if (node->num_succs == node->max_succs) {
+        int max_succs = node->max_succs? node->max_succs * 2 : 4;
+        int *succs = (int *) realloc(node->succs, sizeof(int) * max_succs);
+        if (!succs) {
+            return threadpool_out_memory;
+        }
+        node->succs = succs;
+        node->max_succs = max_succs;
     }
-    return NULL;
+
+    node->succs[node->num_succs++] = to;
+    dag->nodes[to].preds++;
+
+    return threadpool_success;
 }
 
-int threadpool_add (threadpool_t *pool, void (*function)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags)
+
+/* raise *p to v if less */
+static void dag_path_max (volatile ub8 *p, ub8 v)
 {
-    int err = 0;
-    int next;
+    ub8 old = pool_load64(p);
 
-    if ( pool == NULL || function == NULL ) {
-        return threadpool_invalid;
+    while (old < v && !pool_cas64(p, old, v)) {
+        old = pool_load64(p);
     }
+}
 
-    if (arg_size > pool->task_arg_size) {
-        return threadpool_task_arg_overflow;
-    }
 
-    if (pthread_mutex_lock (&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
-    }
+static void threadpool_dag_task (thread_context_t *thread_ctx);
 
-    next = pool->tail + 1;
-    next = (next == pool->queue_size) ? 0 : next;
 
-    do {
-        /* Are we shutting down ? */
-        if (pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
+/**
+ * threadpool_dag_exec
+ *   run node, then the successors it makes ready: one goes on right here,
+ *   the others are added as tasks, which go to our own deque in
+ *   THREADPOOL_SCHED_STEAL mode and to the ring of our node otherwise.
+ *   so no worker waits for a whole level to finish.
+ */
+static void threadpool_dag_exec (thread_context_t *thread_ctx, threadpool_dag_node_t *node)
+{
+    int i;
+    ub8 t0, path;
+    threadpool_task_t *task = thread_ctx->task;
+    threadpool_dag_t *dag = node->dag;
+    threadpool_dag_node_t *succ, *local = NULL;
 
-        /* Are we full ? */
-        if (pool_count_get(pool) == pool->queue_size) {
-            err = threadpool_queue_full;
-            break;
-        }
+    while (node) {
+        task->function = node->function;
+        task->argument = node->argument;
 
-        /* Add task to queues */
-        do {
-            threadpool_task_t *ptask = threadpool_get_task_at(pool, pool->tail);
+        t0 = pool_now_nsec();
+        (*(node->function)) (thread_ctx);
+        path = node->path + (pool_now_nsec() - t0);
 
-            ptask->function = function;
-            ptask->argument = argument;
+        dag_path_max(&dag->critical, path);
 
-            if (arg_size > 0) {
-                /* task_arg is enabled */
-                ptask->arg_size = arg_size;
-                memcpy((void*) ptask->task_arg, task_arg, arg_size);
-            } else {
-                /* task_arg not enabled */
-                ptask->arg_size = 0;
-            }
+        for (i = 0; i < node->num_succs; i++) {
+            succ = &dag->nodes[node->succs[i]];
 
-            /* Use flags to determine whether argument or task_arg is enabled */
-            ptask->flags = flags;
-        } while(0);
+            /* full barrier of the decrement publishes path to the last one */
+            dag_path_max(&succ->path, path);
 
-        pool->tail = next;
+            if (pool_atomic_dec(&succ->pending) == 0) {
+                if (local && threadpool_add(dag->pool, threadpool_dag_task, (void*) succ, NULL, 0, 0) == threadpool_success) {
+                    continue;
+                }
 
-        /* pool->count += 1; */
-        pool_count_add(pool);
+                succ->next = local;
+                local = succ;
+            }
+        }
 
-        /* pthread_cond_broadcast */
-        if (pthread_cond_signal (&(pool->notify)) != 0) {
-            err = threadpool_lock_failure;
-            break;
+        node = local;
+        if (local) {
+            local = local->next;
         }
-    } while(0);
 
-    if (pthread_mutex_unlock (&pool->lock) != 0) {
-        err = threadpool_lock_failure;
+        /* dag may be freed once the last node is done: touched no more */
+        threadpool_group_done(&dag->group);
     }
+}
 
-    return err;
+
+static void threadpool_dag_task (thread_context_t *thread_ctx)
+{
+    threadpool_dag_exec(thread_ctx, (threadpool_dag_node_t *) thread_ctx->task->argument);
 }
 
 
-int threadpool_unused_queues (threadpool_t *pool)
+/* whether dag has no cycle, by removing nodes without predecessors */
+static int threadpool_dag_acyclic (threadpool_dag_t *dag)
 {
-    if ( !pool || pool->shutdown ) {
-        return threadpool_invalid;
-    } else {
-        return (pool->queue_size - pool_count_get(pool));
+    int i, n, done = 0;
+    int *preds, *ready;
+
+    preds = (int *) malloc(sizeof(int) * dag->num_nodes * 2);
+    if (!preds) {
+        return threadpool_out_memory;
+    }
+    ready = preds + dag->num_nodes;
+
+    for (n = 0, i = 0; i < dag->num_nodes; i++) {
+        preds[i] = dag->nodes[i].preds;
+        if (preds[i] == 0) {
+            ready[n++] = i;
+        }
+    }
+
+    while (n > 0) {
+        threadpool_dag_node_t *node = &dag->nodes[ready[--n]];
+        done++;
+
+        for (i = 0; i < node->num_succs; i++) {
+            if (--preds[node->succs[i]] == 0) {
+                ready[n++] = node->succs[i];
+            }
+        }
     }
+
+    free(preds);
+
+    return (done == dag->num_nodes)? threadpool_success : threadpool_invalid;
 }
 
 
-int threadpool_get_threads_count (threadpool_t *pool)
+/**
+ * threadpool_dag_unreached
+ *   number of nodes that do not run because the roots from index first
+ *   on were not queued: the nodes reachable from those roots. such nodes
+ *   never get ready, so workers leave their next alone, which links the
+ *   depth first stack here (self linked at bottom) and marks them seen.
+ */
+static int threadpool_dag_unreached (threadpool_dag_t *dag, int first)
 {
-    return pool ? pool->thread_count : 0;
+    int i, j, n = 0;
+    threadpool_dag_node_t *top, *node, *succ;
+
+    for (i = first; i < dag->num_nodes; i++) {
+        if (dag->nodes[i].preds || dag->nodes[i].next) {
+            continue;
+        }
+
+        top = &dag->nodes[i];
+        top->next = top;
+
+        while (top) {
+            node = top;
+            top = (node->next == node)? NULL : node->next;
+            n++;
+
+            for (j = 0; j < node->num_succs; j++) {
+                succ = &dag->nodes[node->succs[j]];
+                if (!succ->next) {
+                    succ->next = top? top : succ;
+                    top = succ;
+                }
+            }
+        }
+    }
+
+    return n;
 }
 
 
-int threadpool_destroy (threadpool_t *pool)
+int threadpool_dag_run (threadpool_dag_t *dag, ub8 *critical_nsec)
 {
-    int i, err = 0;
+    int i, err;
+    threadpool_t *pool;
+    thread_context_t *thread_ctx;
+    threadpool_task_t *outer, task;
 
-    if (pool == NULL) {
+    if (dag == NULL || dag->running) {
         return threadpool_invalid;
     }
 
-    if (pthread_mutex_lock (&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
+    pool = dag->pool;
+
+    if (pool_is_shutdown(pool)) {
+        return threadpool_shutdown;
     }
 
-    do {
-        /* Already shutting down */
-        if (pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
+    err = threadpool_dag_acyclic(dag);
+    if (err != threadpool_success) {
+        return err;
+    }
 
-        pool->shutdown = 1;
+    for (i = 0; i < dag->num_nodes; i++) {
+        dag->nodes[i].pending = dag->nodes[i].preds;
+        dag->nodes[i].path = 0;
+        dag->nodes[i].next = NULL;
+    }
 
-        /* Wake up all worker threads */
-        if ((pthread_cond_broadcast(&(pool->notify)) != 0) ||
-           (pthread_mutex_unlock(&(pool->lock)) != 0)) {
-            err = threadpool_lock_failure;
-            break;
+    dag->critical = 0;
+    dag->group.state = dag->num_nodes;
+    dag->running = 1;
+
+    for (i = 0; i < dag->num_nodes; i++) {
+        if (dag->nodes[i].preds) {
+            continue;
         }
 
-        /* Join all worker thread */
-        for (i = 0; i < pool->thread_count; i++) {
-            if (pthread_join (pool->thread_ctxs[i].thread, NULL) != 0) {
-                err = threadpool_run_failure;
+        err = threadpool_add(pool, threadpool_dag_task, (void*) &dag->nodes[i], NULL, 0, 0);
+
+        if (err == threadpool_queue_full) {
+            if (pool_is_worker(pool)) {
+                /* can not block on a worker: run it here */
+                thread_ctx = pool_current_ctx;
+                outer = thread_ctx->task;
+
+                memset(&task, 0, sizeof(task));
+                thread_ctx->task = &task;
+                threadpool_dag_exec(thread_ctx, &dag->nodes[i]);
+                thread_ctx->task = outer;
+
+                err = threadpool_success;
+            } else {
+                err = threadpool_add_timed(pool, threadpool_dag_task, (void*) &dag->nodes[i], NULL, 0, 0, NULL);
             }
         }
-    } while(0);
 
-    if (pthread_mutex_unlock (&pool->lock) != 0) {
-        err = threadpool_lock_failure;
+        if (err != threadpool_success) {
+            break;
+        }
     }
 
-    /* Only if everything went well do we deallocate the pool */
-    if (!err) {
-        threadpool_free (pool);
+    if (err != threadpool_success) {
+        /* nodes after root i never run: wait only for those queued */
+        int v, unreached = threadpool_dag_unreached(dag, i);
+
+        do {
+            v = pool_load32(&dag->group.state);
+        } while (!pool_cas32(&dag->group.state, v, v - unreached));
+
+        threadpool_group_wait(&dag->group);
+    } else {
+        err = threadpool_group_wait(&dag->group);
     }
+
+    dag->running = 0;
+
+    if (err == threadpool_success && critical_nsec) {
+        *critical_nsec = dag->critical;
+    }
+
     return err;
 }
 
-int threadpool_free (threadpool_t *pool)
+
+void threadpool_dag_destroy (threadpool_dag_t *dag)
 {
-    if (pool == NULL || pool->started > 0) {
-        return -1;
+    int i;
+
+    if (dag) {
+        for (i = 0; i < dag->num_nodes; i++) {
+            free(dag->nodes[i].succs);
+        }
+
+        pool_aligned_free(dag->nodes);
+        pool_aligned_free(dag);
     }
+}
 
-    pthread_mutex_lock (&(pool->lock));
-    pthread_mutex_destroy (&(pool->lock));
-    pthread_cond_destroy (&(pool->notify));
 
-    free(pool);
-    return 0;
+/**
+ * threadpool_touch_stack
+ *   fault in depth bytes of stack below the caller, top down as the
+ *   stack grows.
+ */
+static void threadpool_touch_stack (size_t depth)
+{
+    size_t off;
+    volatile unsigned char *stack = (volatile unsigned char *) pool_alloca(depth);
+
+    for (off = depth; off > POOL_PAGE_SIZE; off -= POOL_PAGE_SIZE) {
+        stack[off - 1] = 0;
+    }
+    stack[0] = 0;
+}
+
+
+/**
+ * threadpool_prewarm
+ *   worker gets to steady state before its first task: its stack is
+ *   touched and warmup is run. threadpool_create waits for it.
+ */
+static void threadpool_prewarm (threadpool_t *pool, thread_context_t *thread_ctx)
+{
+    if (pool->prewarm_stack) {
+        threadpool_touch_stack((size_t) pool->prewarm_stack);
+    }
+
+    if (pool->warmup) {
+        pool->warmup(thread_ctx);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->warmed++;
+    pthread_cond_broadcast(&pool->notify);
+    pthread_mutex_unlock(&pool->lock);
 }
 
+
 /**
  * each thread run function
  */
 static void *threadpool_run (void * param)
 {
+    ub8 pos;
+    int retired = 0;
+    threadpool_ring_t *ring = NULL;
+    threadpool_slot_t *slot;
+    threadpool_task_t *task;
+
     thread_context_t *thread_ctx = (thread_context_t *) param;
     threadpool_t *pool = thread_ctx->pool;
-    threadpool_task_t *taskcpy = (threadpool_task_t *) malloc(pool->task_size);
-
-    for (;;) {
-        /* Lock must be taken to wait on conditional variable */
-        pthread_mutex_lock(&(pool->lock));
+    unsigned char *cell = pool->workers[thread_ctx->id - 1].cell;
+    threadpool_task_t *taskcpy = threadpool_task_cell(pool, cell, 0);
 
-        /* Wait on condition variable, check for spurious wakeups.
-           When returning from pthread_cond_wait(), we own the lock. */
-        while ((pool_count_get(pool) == 0) && (!pool->shutdown)) {
-            pthread_cond_wait (&(pool->notify), &(pool->lock));
-        }
+    pool_current_ctx = thread_ctx;
 
-        if (pool->shutdown) {
-            break;
-        }
+    if (pool_load32(&pool->start_next) < pool->start_count) {
+        threadpool_start_parallel(pool);
+    }
 
-        /* Grab our task */
-        memcpy(taskcpy, threadpool_get_task_at(pool, pool->head), pool->task_size);
+    if (pool->thread_init) {
+        pool->thread_init(thread_ctx);
+    }
 
-        thread_ctx->task = (threadpool_task_t *) taskcpy;
+    if (pool->prewarm) {
+        threadpool_prewarm(pool, thread_ctx);
+    }
 
-        pool->head += 1;
-        pool->head = (pool->head == pool->queue_size) ? 0 : pool->head;
+    while (!pool_is_shutdown(pool)) {
+        task = threadpool_take(pool, thread_ctx, taskcpy, &ring, &slot, &pos);
 
-        /* pool->count -= 1; */
-        pool_count_sub(pool);
+        if (!task) {
+            if (threadpool_park(pool, thread_ctx)) {
+                retired = 1;
+                break;
+            }
+            continue;
+        }
 
-        /* Unlock */
-        pthread_mutex_unlock (&(pool->lock));
+        threadpool_run_task(pool, thread_ctx, task, ring, slot, pos);
+    }
 
-        /* Get to work */
-        (*(taskcpy->function)) (thread_ctx);
+    if (pool->thread_fini) {
+        pool->thread_fini(thread_ctx);
     }
 
-    pool->started--;
-    free(taskcpy);
+    pool_atomic_dec(&pool->started);
+    pool_aligned_free(cell);
+
+    if (retired) {
+        threadpool_slot_free(pool, thread_ctx);
+    }
 
-    pthread_mutex_unlock (&(pool->lock));
     pthread_exit(0);
 
     return 0;
@@ -503,18 +5850,25 @@ int pthread_attr_init_config (pthread_attr_t *pattr, int stack_size, int scope,
  *
  *   thrid: 线程编号, 0,1,2,3,...
  *   affinity_cpus: 亲和度, 表示每个线程可运行在几个 cpu 上. 亲和度=４: 表示每个线程可运行在 4 个 cpu 上
+ *   linux 上只分组进程可用的 cpu (在线, taskset, cgroup cpuset). 按拓扑放置见 threadpool_opts_t.affinity
  *
  * set cpu affinity for thread
  *   https://blog.csdn.net/guotianqing/article/details/80958281
  */
 int thread_set_affinity_cpus (int thrid, int affinity_cpus, cpu_set_t *cpuset)
 {
-	int cpu_id;
+	int cpu_id, pos;
 
 	CPU_ZERO(cpuset);
 
+#if defined(POOL_HAS_CPUTOPO)
+	/* 可用的 cpu: 在线且在进程继承的亲和掩码 (taskset, cgroup cpuset) 中 */
+	cpu_set_t allowed;
+	int onln_cpus = cputopo_allowed_cpus(&allowed);
+#else
 	/* 可用的 cpu 数 */
 	int onln_cpus = get_nprocs();
+#endif
 
 	/* 把可用的　cpu 按照亲和度分为组: cpu_grps = 2 [0,1] */
 	int cpu_grps = 1;
@@ -536,9 +5890,16 @@ int thread_set_affinity_cpus (int thrid, int affinity_cpus, cpu_set_t *cpuset)
 	/* 计算任意一个线程在亲和在哪组 cpu 上　*/
 	int grp_id = thrid % cpu_grps;
 
-	/* 给定 grp_id, 计算其所有的　cpu_id */
-	for (cpu_id = affinity_cpus * grp_id; cpu_id < affinity_cpus * (grp_id + 1); cpu_id++) {
-		CPU_SET(cpu_id, cpuset);
+	/* 给定 grp_id, 计算其所有的　cpu_id: 第 pos 个可用的 cpu */
+	for (cpu_id = 0, pos = 0; cpu_id < CPU_SETSIZE && pos < affinity_cpus * (grp_id + 1); cpu_id++) {
+#if defined(POOL_HAS_CPUTOPO)
+		if (!CPU_ISSET(cpu_id, &allowed)) {
+			continue;
+		}
+#endif
+		if (pos++ >= affinity_cpus * grp_id) {
+			CPU_SET(cpu_id, cpuset);
+		}
 	}
 
 	return onln_cpus;
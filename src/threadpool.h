@@ -64,6 +64,44 @@ extern "C" {
 #  define POOL_DEFAULT_THREADS         16
 #endif
 
+#ifndef POOL_MAX_LANES
+#  define POOL_MAX_LANES               16
+#endif
+
+#ifndef POOL_DEFAULT_AGING_MSEC
+#  define POOL_DEFAULT_AGING_MSEC      100
+#endif
+
+/* bytes of result slot of a future */
+#ifndef POOL_FUTURE_RESULT_SIZE
+#  define POOL_FUTURE_RESULT_SIZE      64
+#endif
+
+/* times threadpool_wait polls a future before sleeping */
+#ifndef POOL_FUTURE_SPIN
+#  define POOL_FUTURE_SPIN             1000
+#endif
+
+/* strands of threadpool_add_keyed, keys are hashed onto them */
+#ifndef POOL_STRANDS
+#  define POOL_STRANDS                 1024
+#endif
+
+/* tasks a worker runs from one strand before others go first */
+#ifndef POOL_STRAND_QUANTUM
+#  define POOL_STRAND_QUANTUM          64
+#endif
+
+/* tasks waiting in one strand at most */
+#ifndef POOL_STRAND_DEPTH
+#  define POOL_STRAND_DEPTH            4096
+#endif
+
+/* resolution of threadpool_add_at timers */
+#ifndef POOL_TIMER_TICK_USEC
+#  define POOL_TIMER_TICK_USEC         1000
+#endif
+
 #ifndef POOL_DEFAULT_QUEUES
 #  define POOL_DEFAULT_QUEUES          256
 #endif
@@ -72,6 +110,55 @@ extern "C" {
 #  define POOL_TASK_ARG_SIZE_MAX       16384
 #endif
 
+#ifndef POOL_CACHELINE_SIZE
+#  define POOL_CACHELINE_SIZE          64
+#endif
+
+/* put a struct or member at start of its own cache line */
+#if defined(_MSC_VER)
+#  define POOL_CACHELINE_ALIGNED       __declspec(align(POOL_CACHELINE_SIZE))
+#else
+#  define POOL_CACHELINE_ALIGNED       __attribute__((aligned(POOL_CACHELINE_SIZE)))
+#endif
+
+#ifndef POOL_DEFAULT_DEQUE_SIZE
+#  define POOL_DEFAULT_DEQUE_SIZE      256
+#endif
+
+/* queue_mode of threadpool_opts_t */
+#define THREADPOOL_QUEUE_MUTEX         0
+#define THREADPOOL_QUEUE_LOCKFREE      1
+
+/* park_mode of threadpool_opts_t */
+#define THREADPOOL_PARK_CONDVAR        0
+#define THREADPOOL_PARK_FUTEX          1
+
+/* sched_mode of threadpool_opts_t */
+#define THREADPOOL_SCHED_FIFO          0
+#define THREADPOOL_SCHED_STEAL         1
+#define THREADPOOL_SCHED_EDF           2
+
+/* startup of threadpool_opts_t */
+#define THREADPOOL_STARTUP_EAGER       0
+#define THREADPOOL_STARTUP_PARALLEL    1
+#define THREADPOOL_STARTUP_LAZY        2
+
+/* mode of threadpool_add_periodic */
+#define THREADPOOL_PERIODIC_RATE       0
+#define THREADPOOL_PERIODIC_DELAY      1
+
+/* partition of threadpool_parallel_for_ex */
+#define THREADPOOL_PARTITION_STATIC    0
+#define THREADPOOL_PARTITION_DYNAMIC   1
+#define THREADPOOL_PARTITION_GUIDED    2
+
+/* affinity of threadpool_opts_t */
+#define THREADPOOL_AFFINITY_GROUPS     0
+#define THREADPOOL_AFFINITY_CORE       1
+#define THREADPOOL_AFFINITY_COMPACT    2
+#define THREADPOOL_AFFINITY_SPREAD     3
+#define THREADPOOL_AFFINITY_NOSMT      4
+
 #if !defined(__WINDOWS__) && !defined(__CYGWIN__)
 /* 0-based cpu id */
 # ifndef POOL_CPU_ID_MAX
@@ -87,6 +174,12 @@ extern "C" {
 
 typedef struct threadpool_t threadpool_t;
 
+typedef struct threadpool_future_t threadpool_future_t;
+
+typedef struct threadpool_group_t threadpool_group_t;
+
+typedef struct threadpool_dag_t threadpool_dag_t;
+
 
 /**
  * @file threadpool.h
@@ -95,8 +188,11 @@ typedef struct threadpool_t threadpool_t;
  *   added by cheungmine.
  *   2014-06-17
  *   2018-11-20: task_arg for threadpool_task_t
+ *
+ *   each context fills whole cache lines, so that a worker writing its
+ *   own context does not invalidate the ones of its neighbours.
  */
-typedef struct thread_context_t
+typedef struct POOL_CACHELINE_ALIGNED thread_context_t
 {
     int id;
     void *pool;
@@ -127,6 +223,20 @@ typedef struct threadpool_task_t
 } threadpool_task_t;
 
 
+/**
+ *  @struct threadpool_task_desc_t
+ *  @brief one task for threadpool_add_batch, same as threadpool_add params
+ */
+typedef struct threadpool_task_desc_t
+{
+    void (*function)(thread_context_t *);
+    void *argument;
+    void *task_arg;
+    int arg_size;
+    ub8 flags;
+} threadpool_task_desc_t;
+
+
 typedef enum
 {
     threadpool_success             =  0,
@@ -136,7 +246,8 @@ typedef enum
     threadpool_shutdown            = -4,
     threadpool_run_failure         = -5,
     threadpool_out_memory          = -6,
-    threadpool_task_arg_overflow   = -7
+    threadpool_task_arg_overflow   = -7,
+    threadpool_timedout            = -8
 } threadpool_error_t;
 
 
@@ -149,15 +260,169 @@ static const char* threadpool_error_messages[] = {
     "threadpool_run_failure",
     "threadpool_out_memory",
     "threadpool_task_arg_overflow",
+    "threadpool_timedout",
     0
 };
 
 
+/**
+ * @struct threadpool_opts_t
+ * @brief optional settings for threadpool_create_ex
+ *
+ * @var queue_mode THREADPOOL_QUEUE_MUTEX (default): slots are claimed under
+ *   a mutex. THREADPOOL_QUEUE_LOCKFREE: bounded MPMC ring, slots are claimed
+ *   by CAS on per-slot sequence numbers. the mutex and condvar are used only
+ *   to park idle workers.
+ *
+ * @var sched_mode THREADPOOL_SCHED_FIFO (default): all workers pull from the
+ *   shared queue. THREADPOOL_SCHED_STEAL: each worker also owns a deque.
+ *   tasks added from inside a running task go to the deque of that worker
+ *   (LIFO for the owner), idle workers steal from random victims (FIFO).
+ *   THREADPOOL_SCHED_EDF: tasks added by threadpool_add_deadline go to a
+ *   heap of queue_size tasks ordered by deadline, workers take the earliest
+ *   deadline first (ties in order of adding) before any task of the rings.
+ * @var deque_size slots of each worker deque (THREADPOOL_SCHED_STEAL only),
+ *   0 for POOL_DEFAULT_DEQUE_SIZE.
+ * @var inplace 1: run task directly from its queue slot without copying it.
+ *   the slot is given back to producers only after the task returns, so a
+ *   long running task holds its slot (the queue looks full when producers
+ *   wrap around to it). tasks stolen from deques are still copied.
+ * @var batch_min, batch_max bounds of tasks a worker dequeues with one claim
+ *   into its local buffer. the actual number adapts to the queue depth
+ *   (queued tasks / thread_count). 0 for 1 (no batching). not allowed
+ *   with inplace.
+ * @var park_mode THREADPOOL_PARK_CONDVAR (default): idle workers wait on one
+ *   condvar. THREADPOOL_PARK_FUTEX: each idle worker waits on its own futex
+ *   and is pushed on an idle stack, producers wake exactly the one on top
+ *   (falls back to THREADPOOL_PARK_CONDVAR where futex is not available).
+ *   in both modes producers skip the wakeup when no worker is parked.
+ * @var spin_count times an idle worker polls for work before parking.
+ * @var task_arg_align alignment in bytes of task_arg in queue slots and in
+ *   task copies (power of 2, 8 to 4096), e.g. POOL_CACHELINE_SIZE for SIMD
+ *   payloads. 0 for 8. slots are then padded to multiple of it.
+ * @var numa 1: one ring of queue_size slots per numa node (linux only).
+ *   slots of a ring are first touched on its node, workers are pinned to
+ *   the cpus of their node (affinity_cpus is ignored) and take from the
+ *   ring of their node first, from other rings only when it is empty.
+ *   producers add to the ring of the node they run on. falls back to one
+ *   ring when numa topology is not available.
+ * @var affinity placement of workers on cpu topology (linux only), cpus are
+ *   those the process may run on (online, taskset, cgroup cpuset).
+ *   THREADPOOL_AFFINITY_GROUPS (default): groups of affinity_cpus cpus.
+ *   THREADPOOL_AFFINITY_CORE: one worker per physical core, on all its smt
+ *   siblings. THREADPOOL_AFFINITY_COMPACT: one cpu per worker, filling a
+ *   last level cache (L3/CCX) domain before the next one.
+ *   THREADPOOL_AFFINITY_SPREAD: one cpu per worker, round robin across
+ *   last level cache domains. THREADPOOL_AFFINITY_NOSMT: first smt thread
+ *   of one physical core per worker. workers wrap around when there are
+ *   more workers than cores or cpus. in numa mode workers are placed
+ *   within their node. check result by thread_check_affinity_cpus on
+ *   threadpool_get_context(pool, id)->thread.
+ * @var blocking_ratio percent of time (0 to 99) a task waits on i/o or
+ *   locks, for sizing pool when thread_count is 0: 0 for cpu bound tasks.
+ *   see threadpool_auto_threads. out of range fails threadpool_create_ex
+ *   even when thread_count is not 0.
+ * @var lanes number of priority lanes (1 to POOL_MAX_LANES), each with its
+ *   own ring of queue_size slots (per numa node). workers take from the
+ *   highest lane first. threadpool_add, threadpool_add_batch and
+ *   threadpool_reserve use lane 0 (lowest), threadpool_add_prio any lane.
+ *   lanes keep counters and stamp tasks, see threadpool_lane_stats.
+ *   0 for one lane without counters.
+ * @var aging_msec anti-starvation: a waiting task rises one lane each
+ *   aging_msec, workers take first from the lane whose oldest task ranks
+ *   highest. 0 for POOL_DEFAULT_AGING_MSEC.
+ * @var expired THREADPOOL_SCHED_EDF: called instead of the task function
+ *   for a task taken after its deadline (thread_ctx->task is the task).
+ *   NULL to run late tasks anyway.
+ * @var min_threads, max_threads bounds of running workers, thread_count
+ *   is the initial number. 0 for thread_count. see threadpool_resize.
+ *   slots of max_threads workers are allocated at creation, thread
+ *   contexts of workers started later have a thread_arg of 0.
+ * @var idle_msec a worker parked for idle_msec retires while more than
+ *   min_threads run. 0 to keep idle workers.
+ * @var spawn_usec one more worker is started (up to max_threads) each
+ *   spawn_usec while tasks are added with no worker parked. 0 to never
+ *   grow by load. the thread adding the task creates the worker.
+ * @var thread_init, thread_fini called by each worker when it starts and
+ *   before it exits (shutdown or retired). NULL for none.
+ * @var startup THREADPOOL_STARTUP_EAGER (default): threadpool_create
+ *   starts thread_count workers one by one. THREADPOOL_STARTUP_PARALLEL:
+ *   every started worker helps to start the next ones, threadpool_create
+ *   returns once all are started. THREADPOOL_STARTUP_LAZY: one worker is
+ *   started, then one more each time a task is added with no worker
+ *   idle, up to thread_count (by the thread adding the task).
+ * @var prewarm 1: no page faults on first tasks. queue slots are mapped
+ *   with MAP_POPULATE (linux, touched elsewhere), worker deques, batch
+ *   buffers and the EDF heap are touched. each worker touches
+ *   prewarm_stack bytes of its stack and runs warmup before taking
+ *   tasks, threadpool_create returns once the workers it started did
+ *   (only the first one with THREADPOOL_STARTUP_LAZY).
+ * @var prewarm_mlock 1: with prewarm, lock queue slots in memory (linux).
+ *   threadpool_create fails if RLIMIT_MEMLOCK is too low.
+ * @var prewarm_stack bytes of stack each worker touches with prewarm. must
+ *   leave 64 KB of stack_size (or of default stack size) untouched.
+ * @var warmup called by each worker with prewarm, e.g. to fill its caches
+ *   or thread_arg. NULL for none.
+ */
+typedef struct threadpool_opts_t
+{
+    int queue_mode;
+    int sched_mode;
+    int deque_size;
+    int inplace;
+    int batch_min;
+    int batch_max;
+    int park_mode;
+    int spin_count;
+    int task_arg_align;
+    int numa;
+    int affinity;
+    int blocking_ratio;
+    int lanes;
+    int aging_msec;
+    void (*expired)(thread_context_t *);
+    int min_threads;
+    int max_threads;
+    int idle_msec;
+    int spawn_usec;
+    void (*thread_init)(thread_context_t *);
+    void (*thread_fini)(thread_context_t *);
+    int startup;
+    int prewarm;
+    int prewarm_mlock;
+    int prewarm_stack;
+    void (*warmup)(thread_context_t *);
+} threadpool_opts_t;
+
+
+/**
+ * @struct threadpool_lane_stats_t
+ * @brief counters of a priority lane, see threadpool_lane_stats
+ *
+ * @var depth         tasks in lane (including reserved slots).
+ * @var added         tasks added to lane since pool was created.
+ * @var taken         tasks taken from lane by workers.
+ * @var wait_usec     total time tasks taken waited in lane.
+ * @var wait_max_usec longest wait of a task taken since last call.
+ */
+typedef struct threadpool_lane_stats_t
+{
+    ub8 depth;
+    ub8 added;
+    ub8 taken;
+    ub8 wait_usec;
+    ub8 wait_max_usec;
+} threadpool_lane_stats_t;
+
+
 /**
  * @function threadpool_create
  * @brief Creates a threadpool_t object.
- * @param thread_count Number of worker threads.
- * @param queue_size   Size of the queue for tasks.
+ * @param thread_count Number of worker threads, 0 for threadpool_auto_threads(0).
+ * @param queue_size   Size of the queue for tasks: slots of each ring, one
+ *    ring per priority lane (per numa node), and of the EDF heap. see
+ *    threadpool_opts_t.lanes, numa and sched_mode.
+ * @param stack_size   stack bytes of each worker thread, 0 for default.
  * @param thread_args  array of arguments with count of thread_count, NULL if ignored.
  * @param task_arg_size pre-allocated buffer for per-task if it > 0.
  * @return a newly created thread pool or NULL
@@ -165,6 +430,15 @@ static const char* threadpool_error_messages[] = {
 extern threadpool_t *threadpool_create (int thread_count, int queue_size, int stack_size, int affinity_cpus, void **thread_args, size_t task_arg_size);
 
 
+/**
+ * @function threadpool_create_ex
+ * @brief Creates a threadpool_t object with optional settings.
+ * @param opts  settings of pool, NULL for defaults (same as threadpool_create).
+ * @return a newly created thread pool or NULL
+ */
+extern threadpool_t *threadpool_create_ex (int thread_count, int queue_size, int stack_size, int affinity_cpus, void **thread_args, size_t task_arg_size, const threadpool_opts_t *opts);
+
+
 /**
  * @function threadpool_add
  * @brief add a new task in the queue of a thread pool
@@ -178,24 +452,427 @@ extern threadpool_t *threadpool_create (int thread_count, int queue_size, int st
 extern int threadpool_add (threadpool_t *pool, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags);
 
 
+/**
+ * @function threadpool_add_prio
+ * @brief add a new task in a priority lane (see threadpool_opts_t.lanes).
+ *    same as threadpool_add for prio 0. tasks of higher lanes do not go
+ *    to worker deques (THREADPOOL_SCHED_STEAL).
+ * @param prio     lane, 0 (lowest) to lanes - 1 (highest).
+ * @return 0 if all goes well, threadpool_queue_full if the lane is full,
+ *    threadpool_invalid if prio is out of range.
+ */
+extern int threadpool_add_prio (threadpool_t *pool, int prio, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags);
+
+
+/**
+ * @function threadpool_add_keyed
+ * @brief add a new task to the strand of key. tasks of a strand run one at
+ *    a time, in the order they were added, on any worker: tasks of one
+ *    key (a row, a session) are ordered without a thread of their own.
+ *    keys are hashed onto POOL_STRANDS strands, so two keys may share one.
+ *    a strand keeps running on the same worker while it has tasks, and is
+ *    queued to the numa node of that worker when it starts again.
+ *    the call never blocks nor runs tasks on the calling thread.
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes). threadpool_queue_full if the strand
+ *    was idle and the queue is full (tasks queued behind a running strand
+ *    take no slot), or if POOL_STRAND_DEPTH tasks wait in the strand.
+ */
+extern int threadpool_add_keyed (threadpool_t *pool, ub8 key, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags);
+
+
+/**
+ * @function threadpool_add_deadline
+ * @brief add a new task to run by deadline (THREADPOOL_SCHED_EDF only)
+ * @param deadline absolute time in nsec of threadpool_clock_nsec.
+ * @return 0 if all goes well, threadpool_queue_full if the deadline heap
+ *    is full, threadpool_invalid if pool is not THREADPOOL_SCHED_EDF.
+ */
+extern int threadpool_add_deadline (threadpool_t *pool, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 deadline);
+
+
+/**
+ * @function threadpool_clock_nsec
+ * @brief monotonic clock of the pool in nsec, e.g. for deadlines.
+ */
+extern ub8 threadpool_clock_nsec (void);
+
+
+/**
+ * @function threadpool_add_at
+ * @brief add a new task to the queue at a time, without holding a worker
+ *    while it waits. the task waits in a timing wheel (ticks of
+ *    POOL_TIMER_TICK_USEC) advanced by a timer thread, which is started
+ *    by the first call. due tasks go to the queue (lane 0) in batches,
+ *    never before when. while the queue is full they wait in the wheel
+ *    for the next tick (and may still be cancelled). tasks still waiting
+ *    at threadpool_destroy are dropped.
+ * @param when     absolute time in nsec of threadpool_clock_nsec.
+ * @param timer_id returns handle for threadpool_cancel_timer (may be NULL).
+ * @return 0 if all goes well, threadpool_out_memory if no more timers,
+ *    other negative values in case of error (@see threadpool_error_t).
+ */
+extern int threadpool_add_at (threadpool_t *pool, ub8 when, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id);
+
+
+/**
+ * @function threadpool_add_after
+ * @brief same as threadpool_add_at, delay nsec from now.
+ */
+extern int threadpool_add_after (threadpool_t *pool, ub8 delay, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id);
+
+
+/**
+ * @function threadpool_add_periodic
+ * @brief add a task to run every period nsec, first after delay nsec, on
+ *    the timer wheel of threadpool_add_at (monotonic clock).
+ *    THREADPOOL_PERIODIC_RATE: runs are due at delay + k * period without
+ *    drift. when the pool is overloaded, a tick whose last run is still
+ *    queued or running is skipped, ticks missed meanwhile are coalesced
+ *    into one run. THREADPOOL_PERIODIC_DELAY: next run is due period
+ *    after last run returns.
+ *    runs may be late by a tick of POOL_TIMER_TICK_USEC, a shorter period
+ *    runs once per tick. the task gets the same argument, task_arg and
+ *    flags each run.
+ * @param timer_id returns handle for threadpool_cancel_timer (may be NULL).
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_add_periodic (threadpool_t *pool, ub8 delay, ub8 period, int mode, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, ub8 *timer_id);
+
+
+/**
+ * @function threadpool_cancel_timer
+ * @brief remove a task of threadpool_add_at which is not due yet, or stop
+ *    a periodic task (a run already queued or running completes).
+ * @return 0 if cancelled, threadpool_invalid if timer_id is unknown, is
+ *    cancelled or its one-shot task has gone to the queue.
+ */
+extern int threadpool_cancel_timer (threadpool_t *pool, ub8 timer_id);
+
+
+/**
+ * @function threadpool_submit
+ * @brief add a new task with a future to wait for it and get its result.
+ *    the task writes up to POOL_FUTURE_RESULT_SIZE bytes of result into
+ *    threadpool_task_result(thread_ctx). futures are recycled by the pool,
+ *    no allocation per task.
+ * @param future   returns the future, caller must give it back by
+ *    threadpool_future_release (at any time, done or not).
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes), then *future is NULL.
+ */
+extern int threadpool_submit (threadpool_t *pool, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, threadpool_future_t **future);
+
+
+/**
+ * @function threadpool_wait
+ * @brief wait for task of future to return. spins POOL_FUTURE_SPIN times,
+ *    then sleeps (on a futex where available).
+ * @param timeout_msec max time to wait, -1 without limit. 0 only looks at
+ *    the future once, as threadpool_poll.
+ * @return 0 if task is done, threadpool_timedout if not done in time.
+ */
+extern int threadpool_wait (threadpool_future_t *future, int timeout_msec);
+
+
+/**
+ * @function threadpool_poll
+ * @brief 1 if task of future is done, 0 if not. never blocks.
+ */
+extern int threadpool_poll (threadpool_future_t *future);
+
+
+/**
+ * @function threadpool_future_result
+ * @brief result slot of future (POOL_FUTURE_RESULT_SIZE bytes), valid
+ *    once threadpool_wait or threadpool_poll tells task is done, and till
+ *    future is released.
+ */
+extern void * threadpool_future_result (threadpool_future_t *future);
+
+
+/**
+ * @function threadpool_future_release
+ * @brief give back future of threadpool_submit. must be called once for
+ *    each future before threadpool_destroy.
+ */
+extern void threadpool_future_release (threadpool_future_t *future);
+
+
+/**
+ * @function threadpool_task_result
+ * @brief result slot of future of the task running on thread_ctx, NULL if
+ *    the task was not added by threadpool_submit.
+ */
+extern void * threadpool_task_result (thread_context_t *thread_ctx);
+
+
+/**
+ * @function threadpool_group_create
+ * @brief create an empty group of tasks of pool, NULL if out of memory.
+ */
+extern threadpool_group_t * threadpool_group_create (threadpool_t *pool);
+
+
+/**
+ * @function threadpool_group_add
+ * @brief add a new task to the queue as member of group. may be called
+ *    from tasks of the group (nested fork-join).
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_group_add (threadpool_group_t *group, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags);
+
+
+/**
+ * @function threadpool_group_wait
+ * @brief wait till all tasks added to group are done. called from a task,
+ *    the worker runs queued tasks (its own first) while it waits, so it
+ *    does not deadlock when all workers wait. the group may be used again
+ *    after.
+ * @return 0 if all goes well, threadpool_shutdown if pool is destroyed
+ *    meanwhile: tasks still queued are dropped, those started are done
+ *    when it returns. threadpool_destroy waits for callers to return.
+ */
+extern int threadpool_group_wait (threadpool_group_t *group);
+
+
+/**
+ * @function threadpool_group_destroy
+ * @brief free group, no task of it may be pending.
+ */
+extern void threadpool_group_destroy (threadpool_group_t *group);
+
+
+/**
+ * @function threadpool_parallel_for
+ * @brief call body over [begin, end) split in chunks, on workers and on the
+ *    calling thread, and return when the whole range is done. same as
+ *    threadpool_parallel_for_ex with THREADPOOL_PARTITION_GUIDED.
+ *    threadpool_destroy from another thread stops it after the chunks
+ *    started: it returns threadpool_shutdown with the range part done.
+ * @param grain    min indexes of a chunk, 1 if < 1.
+ * @param body     called with the [begin, end) of a chunk and ctx.
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_parallel_for (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *ctx), void *ctx);
+
+
+/**
+ * @function threadpool_parallel_for_ex
+ * @brief as threadpool_parallel_for with a given partition of the range.
+ *    chunks are claimed from one atomic counter: no task is allocated per
+ *    chunk, and a worker starting late finds nothing left to do.
+ * @param partition  THREADPOOL_PARTITION_STATIC: one chunk per thread of
+ *    equal size, for uniform bodies. THREADPOOL_PARTITION_DYNAMIC: chunks
+ *    of grain indexes. THREADPOOL_PARTITION_GUIDED: chunks of half the
+ *    remaining indexes per thread, shrinking down to grain.
+ */
+extern int threadpool_parallel_for_ex (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *ctx), void *ctx, int partition);
+
+
+/**
+ * @function threadpool_parallel_reduce
+ * @brief reduce [begin, end) to result as threadpool_parallel_for, without
+ *    locks: each thread has its own accumulator, the accumulators are
+ *    combined in a tree at the end.
+ * @param body     fold indexes [begin, end) into acc.
+ * @param combine  fold other accumulator into acc. must be associative
+ *    and commutative: chunks are not folded in order.
+ * @param identity initial value of an accumulator, acc_size bytes.
+ * @param result   receives the reduction, acc_size bytes.
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_parallel_reduce (threadpool_t *pool, sb8 begin, sb8 end, sb8 grain, void (*body)(sb8 begin, sb8 end, void *acc, void *ctx), void (*combine)(void *acc, const void *other, void *ctx), const void *identity, void *result, size_t acc_size, void *ctx);
+
+
+/**
+ * @function threadpool_parallel_scan
+ * @brief inclusive prefix scan: out[i] = in[0] + ... + in[i], with +
+ *    being combine. in and out may be the same array.
+ * @param count    Number of elements of elem_size bytes in in and out.
+ * @param combine  fold elem into acc (acc = acc + elem). must be
+ *    associative, need not be commutative.
+ * @param identity neutral element, elem_size bytes.
+ * @return 0 if all goes well, negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_parallel_scan (threadpool_t *pool, const void *in, void *out, sb8 count, size_t elem_size, void (*combine)(void *acc, const void *elem, void *ctx), const void *identity, void *ctx);
+
+
+/**
+ * @function threadpool_dag_create
+ * @brief create an empty graph of tasks of pool, NULL if out of memory.
+ */
+extern threadpool_dag_t * threadpool_dag_create (threadpool_t *pool);
+
+
+/**
+ * @function threadpool_dag_add_node
+ * @brief add a task as node of dag. routine gets argument as
+ *    thread_ctx->task->argument.
+ * @return index of node (>= 0), negative values in case of error (@see
+ *    threadpool_error_t for codes).
+ */
+extern int threadpool_dag_add_node (threadpool_dag_t *dag, void (*routine)(thread_context_t *), void *argument);
+
+
+/**
+ * @function threadpool_dag_add_edge
+ * @brief node to may start only after node from is done.
+ * @return 0 if all goes well, negative values in case of error.
+ */
+extern int threadpool_dag_add_edge (threadpool_dag_t *dag, int from, int to);
+
+
+/**
+ * @function threadpool_dag_run
+ * @brief run all nodes of dag and wait till they are done. a node starts
+ *    as soon as its last predecessor is done, on the worker of that one.
+ *    dag may be run again after. if a root can not be queued, nodes
+ *    queued already are waited for (not when pool is shutting down:
+ *    destroy dag after pool then) and the error is returned.
+ * @param critical_nsec  receives run time of the longest path of nodes,
+ *    NULL if not wanted. the wall time of the run less this is the time
+ *    lost to scheduling.
+ * @return 0 if all goes well, threadpool_invalid if dag has a cycle, other
+ *    negative values in case of error (@see threadpool_error_t for codes).
+ */
+extern int threadpool_dag_run (threadpool_dag_t *dag, ub8 *critical_nsec);
+
+
+/**
+ * @function threadpool_dag_destroy
+ * @brief free dag, it may not be running.
+ */
+extern void threadpool_dag_destroy (threadpool_dag_t *dag);
+
+
+/**
+ * @function threadpool_add_timed
+ * @brief add a new task, blocking while the queue is full
+ * @param abstime  absolute time (CLOCK_REALTIME, as pthread_cond_timedwait)
+ *   to give up at, NULL to wait without limit.
+ * @return 0 if all goes well, threadpool_timedout if queue was still full
+ *   at abstime, other negative values in case of error (@see
+ *   threadpool_error_t for codes).
+ *
+ * blocked producers are served in FIFO order: only the longest waiting one
+ *   retries when a slot frees up. threadpool_add never blocks and is not
+ *   queued behind them.
+ */
+extern int threadpool_add_timed (threadpool_t *pool, void (*routine)(thread_context_t *), void *argument, void *task_arg, int arg_size, ub8 flags, const struct timespec *abstime);
+
+
+/**
+ * @function threadpool_add_batch
+ * @brief add n tasks in the queue with one claim of contiguous slots
+ * @param pool     Thread pool to which add the tasks.
+ * @param descs    Array of n tasks.
+ * @param n        Number of tasks in descs.
+ * @param accepted returns number of leading tasks of descs added (may be NULL).
+ * @return 0 if all n tasks added, threadpool_queue_full if only *accepted
+ *   tasks added, other negative values in case of error (@see
+ *   threadpool_error_t for codes).
+ */
+extern int threadpool_add_batch (threadpool_t *pool, const threadpool_task_desc_t *descs, int n, int *accepted);
+
+
+/**
+ * @function threadpool_reserve
+ * @brief reserve a queue slot so that caller can build task_arg in place
+ * @param pool     Thread pool to which add the task.
+ * @param slot     returns the reserved task. caller writes up to arg_size
+ *   bytes into (*slot)->task_arg, then must call either threadpool_commit
+ *   or threadpool_abort with it. workers take the slots of a ring in
+ *   order: tasks added to the ring after the reserved slot are not run
+ *   till it is committed or aborted. so keep a reservation short, do not
+ *   block or wait for other tasks between reserve and commit.
+ * @param arg_size Max bytes caller will write into task_arg.
+ * @return 0 if all goes well, negative values in case of error (@see
+ * threadpool_error_t for codes).
+ */
+extern int threadpool_reserve (threadpool_t *pool, threadpool_task_t **slot, int arg_size);
+
+
+/**
+ * @function threadpool_commit
+ * @brief hand over a reserved slot to workers as a new task
+ * @param slot     task returned by threadpool_reserve.
+ * @param arg_size actual bytes written into slot->task_arg.
+ * @return 0 if all goes well, negative values in case of error.
+ */
+extern int threadpool_commit (threadpool_t *pool, threadpool_task_t *slot, void (*routine)(thread_context_t *), void *argument, int arg_size, ub8 flags);
+
+
+/**
+ * @function threadpool_abort
+ * @brief give up a reserved slot. the slot is skipped by workers.
+ * @param slot     task returned by threadpool_reserve.
+ * @return 0 if all goes well, negative values in case of error.
+ */
+extern int threadpool_abort (threadpool_t *pool, threadpool_task_t *slot);
+
+
 /**
  * @function threadpool_unused_queues
  * @brief get unused size of queues in thread pool
  * @param pool     Thread pool to which get size of queues
- * @return 0 if queues are full, positive values for unused queues.
+ * @return free slots of all rings and of the EDF heap together: a lane
+ *    may be full while others are not. 0 if queues are full.
  *    negative values in case of error (@see threadpool_error_t for codes).
  */
 extern int threadpool_unused_queues (threadpool_t *pool);
 
 /**
  * @function threadpool_get_threads_count
- * @brief get size of pool (number of threads)
+ * @brief get size of pool (number of running worker threads)
  * @param pool     Thread pool to which get number of threads
  * @return number of threads.
  */
 extern int threadpool_get_threads_count (threadpool_t *pool);
 
 
+/**
+ * @function threadpool_resize
+ * @brief set number of worker threads. new workers start at once, extra
+ *    workers retire when they next go idle. a retired worker leaves its
+ *    slot after thread_fini, this call may wait for that to reuse it.
+ * @param pool     Thread pool.
+ * @param threads  1 to opts->max_threads.
+ * @return 0 if all goes well, negative values in case of error.
+ */
+extern int threadpool_resize (threadpool_t *pool, int threads);
+
+
+/**
+ * @function threadpool_lane_stats
+ * @brief read counters of a priority lane. all zero if pool was created
+ *    without opts->lanes. wait_max_usec is reset by the call.
+ * @param pool     Thread pool.
+ * @param prio     lane, 0 to lanes - 1.
+ * @param stats    counters read.
+ * @return 0 if success. threadpool_invalid if prio is out of range.
+ */
+extern int threadpool_lane_stats (threadpool_t *pool, int prio, threadpool_lane_stats_t *stats);
+
+
+/**
+ * @function threadpool_auto_threads
+ * @brief number of threads for pool on cpus the process can keep busy
+ *    (affinity mask, cgroup v2 cpu.max or v1 cfs quota).
+ *    cpus * 100 / (100 - blocking_ratio): cpus for cpu bound pools, more
+ *    threads for pools whose tasks block.
+ * @param blocking_ratio  percent of time a task blocks, 0 to 99.
+ * @return number of threads, POOL_DEFAULT_THREADS if cpus are unknown.
+ *    threadpool_invalid if blocking_ratio is out of range.
+ */
+extern int threadpool_auto_threads (int blocking_ratio);
+
+
 /**
  * @function threadpool_get_context
  * @brief get thread_context_t by id
@@ -229,6 +906,7 @@ extern int pthread_attr_init_config (pthread_attr_t *pattr, int stack_size, int
  *
  *   thrid: 线程编号, 0,1,2,3,...
  *   affinity_cpus: 亲和度, 表示每个线程可运行在几个 cpu 上. 亲和度=４: 表示每个线程可运行在 4 个 cpu 上
+ *   linux 上只分组进程可用的 cpu (在线, taskset, cgroup cpuset). 按拓扑放置见 threadpool_opts_t.affinity
  *
  * set cpu affinity for thread
  *   https://blog.csdn.net/guotianqing/article/details/80958281